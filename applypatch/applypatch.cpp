@@ -40,14 +40,20 @@
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "applypatch/deflate_backend.h"
 #include "edify/expr.h"
 #include "otautil/paths.h"
 #include "otautil/print_sha1.h"
 
 using namespace std::string_literals;
 
+static bool PatchPartitionInternal(const Partition& target, const Partition& source,
+                                   const Value& patch, const Value* bonus,
+                                   const std::vector<const Value*>& dictionaries,
+                                   bool backup_source);
 static bool GenerateTarget(const Partition& target, const FileContents& source_file,
-                           const Value& patch, const Value* bonus_data, bool backup_source);
+                           const Value& patch, const Value* bonus_data,
+                           const std::vector<const Value*>& dictionaries, bool backup_source);
 
 bool LoadFileContents(const std::string& filename, FileContents* file) {
   // No longer allow loading contents from eMMC partitions.
@@ -267,6 +273,18 @@ int ShowLicenses() {
 
 bool PatchPartition(const Partition& target, const Partition& source, const Value& patch,
                     const Value* bonus, bool backup_source) {
+  return PatchPartitionInternal(target, source, patch, bonus, {}, backup_source);
+}
+
+bool PatchPartition(const Partition& target, const Partition& source, const Value& patch,
+                    const std::vector<const Value*>& dictionaries, bool backup_source) {
+  return PatchPartitionInternal(target, source, patch, nullptr, dictionaries, backup_source);
+}
+
+static bool PatchPartitionInternal(const Partition& target, const Partition& source,
+                                   const Value& patch, const Value* bonus,
+                                   const std::vector<const Value*>& dictionaries,
+                                   bool backup_source) {
   LOG(INFO) << "Patching " << target.name;
 
   // We try to load and check against the target hash first.
@@ -280,7 +298,7 @@ bool PatchPartition(const Partition& target, const Partition& source, const Valu
 
   FileContents source_file;
   if (ReadPartitionToBuffer(source, &source_file, backup_source)) {
-    return GenerateTarget(target, source_file, patch, bonus, backup_source);
+    return GenerateTarget(target, source_file, patch, bonus, dictionaries, backup_source);
   }
 
   LOG(ERROR) << "Failed to find any match";
@@ -326,7 +344,8 @@ bool FlashPartition(const Partition& partition, const std::string& source_filena
 }
 
 static bool GenerateTarget(const Partition& target, const FileContents& source_file,
-                           const Value& patch, const Value* bonus_data, bool backup_source) {
+                           const Value& patch, const Value* bonus_data,
+                           const std::vector<const Value*>& dictionaries, bool backup_source) {
   uint8_t expected_sha1[SHA_DIGEST_LENGTH];
   if (ParseSha1(target.hash, expected_sha1) != 0) {
     LOG(ERROR) << "Failed to parse target hash \"" << target.hash << "\"";
@@ -363,27 +382,48 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
   // We store the decoded output in memory.
   FileContents patched;
   SHA_CTX ctx;
-  SHA1_Init(&ctx);
   SinkFn sink = [&patched, &ctx](const unsigned char* data, size_t len) {
     SHA1_Update(&ctx, data, len);
     patched.data.insert(patched.data.end(), data, data + len);
     return len;
   };
 
-  int result;
-  if (use_bsdiff) {
-    result = ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), patch, 0, sink);
-  } else {
-    result =
-        ApplyImagePatch(source_file.data.data(), source_file.data.size(), patch, sink, bonus_data);
-  }
+  auto apply_patch = [&](bool allow_accelerated_deflate) {
+    patched.data.clear();
+    SHA1_Init(&ctx);
+    int result;
+    if (use_bsdiff) {
+      result = ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), patch, 0, sink);
+    } else if (dictionaries.empty()) {
+      result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), patch, sink,
+                               bonus_data, allow_accelerated_deflate);
+    } else {
+      result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), patch, sink,
+                               dictionaries, allow_accelerated_deflate);
+    }
+    if (result != 0) {
+      LOG(ERROR) << "Failed to apply the patch: " << result;
+      return false;
+    }
+    SHA1_Final(patched.sha1, &ctx);
+    return true;
+  };
 
-  if (result != 0) {
-    LOG(ERROR) << "Failed to apply the patch: " << result;
+  if (!apply_patch(true)) {
     return false;
   }
 
-  SHA1_Final(patched.sha1, &ctx);
+  // An accelerated deflate backend is expected to be byte-identical to stock zlib. Should it ever
+  // produce a different stream, redo the patching with stock zlib before giving up.
+  if (!use_bsdiff && GetAcceleratedDeflateBackend() != nullptr &&
+      memcmp(patched.sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
+    LOG(WARNING) << "Patching with deflate backend " << GetAcceleratedDeflateBackend()->Name()
+                 << " did not produce the expected SHA-1; retrying with zlib";
+    if (!apply_patch(false)) {
+      return false;
+    }
+  }
+
   if (memcmp(patched.sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
     LOG(ERROR) << "Patching did not produce the expected SHA-1 of " << short_sha1(expected_sha1);
 
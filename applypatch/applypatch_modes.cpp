@@ -56,7 +56,8 @@ static int FlashMode(const std::string& target_emmc, const std::string& source_f
 }
 
 static int PatchMode(const std::string& target_emmc, const std::string& source_emmc,
-                     const std::string& patch_file, const std::string& bonus_file) {
+                     const std::string& patch_file, const std::string& bonus_file,
+                     const std::vector<std::string>& dict_files) {
   std::string err;
   auto target = Partition::Parse(target_emmc, &err);
   if (!target) {
@@ -87,6 +88,21 @@ static int PatchMode(const std::string& target_emmc, const std::string& source_e
     bonus = std::make_unique<Value>(Value::Type::BLOB, std::move(bonus_contents));
   }
 
+  if (!dict_files.empty()) {
+    std::vector<std::unique_ptr<Value>> dictionaries;
+    std::vector<const Value*> dictionary_ptrs;
+    for (const auto& dict_file : dict_files) {
+      std::string dict_contents;
+      if (!android::base::ReadFileToString(dict_file, &dict_contents)) {
+        PLOG(ERROR) << "Failed to read dictionary file \"" << dict_file << "\"";
+        return 1;
+      }
+      dictionaries.push_back(std::make_unique<Value>(Value::Type::BLOB, std::move(dict_contents)));
+      dictionary_ptrs.push_back(dictionaries.back().get());
+    }
+    return PatchPartition(target, source, patch, dictionary_ptrs, false) ? 0 : 1;
+  }
+
   return PatchPartition(target, source, patch, bonus.get(), false) ? 0 : 1;
 }
 
@@ -99,7 +115,7 @@ static void Usage() {
       "  applypatch --flash <source-file>\n"
       "             --target EMMC:<target-file>:<target-size>:<target-sha1>\n\n"
       "patch mode\n"
-      "  applypatch [--bonus <bonus-file>]\n"
+      "  applypatch [--bonus <bonus-file> | --dict <dict-file> [--dict <dict-file> ...]]\n"
       "             --patch <patch-file>\n"
       "             --target EMMC:<target-file>:<target-size>:<target-sha1>\n"
       "             --source EMMC:<source-file>:<source-size>:<source-sha1>\n\n"
@@ -113,6 +129,7 @@ int applypatch_modes(int argc, char* argv[]) {
     // clang-format off
     { "bonus", required_argument, nullptr, 0 },
     { "check", required_argument, nullptr, 0 },
+    { "dict", required_argument, nullptr, 0 },
     { "flash", required_argument, nullptr, 0 },
     { "license", no_argument, nullptr, 0 },
     { "patch", required_argument, nullptr, 0 },
@@ -127,6 +144,7 @@ int applypatch_modes(int argc, char* argv[]) {
   std::string target;
   std::string patch;
   std::string bonus;
+  std::vector<std::string> dicts;
 
   bool check_mode = false;
   bool flash_mode = false;
@@ -142,6 +160,8 @@ int applypatch_modes(int argc, char* argv[]) {
         std::string option = OPTIONS[option_index].name;
         if (option == "bonus") {
           bonus = optarg;
+        } else if (option == "dict") {
+          dicts.push_back(optarg);
         } else if (option == "check") {
           check_target = optarg;
           check_mode = true;
@@ -172,14 +192,18 @@ int applypatch_modes(int argc, char* argv[]) {
     return CheckMode(check_target);
   }
   if (flash_mode) {
-    if (!bonus.empty()) {
-      LOG(ERROR) << "bonus file not supported in flash mode";
+    if (!bonus.empty() || !dicts.empty()) {
+      LOG(ERROR) << "bonus or dictionary file not supported in flash mode";
       return 1;
     }
     return FlashMode(target, source);
   }
   if (patch_mode) {
-    return PatchMode(target, source, patch, bonus);
+    if (!bonus.empty() && !dicts.empty()) {
+      LOG(ERROR) << "bonus and dictionary files can't be used together";
+      return 1;
+    }
+    return PatchMode(target, source, patch, bonus, dicts);
   }
 
   Usage();
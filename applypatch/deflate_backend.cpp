@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/deflate_backend.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <zlib.h>
+
+static constexpr size_t kDeflateBufferSize = 32768;
+
+class ZlibDeflateStream : public DeflateStream {
+ public:
+  ~ZlibDeflateStream() override {
+    if (initialized_) {
+      deflateEnd(&strm_);
+    }
+  }
+
+  bool Init(const DeflateParams& params) {
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    strm_.avail_in = 0;
+    strm_.next_in = nullptr;
+    int ret = deflateInit2(&strm_, params.level, params.method, params.window_bits,
+                           params.mem_level, params.strategy);
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to init deflate: " << ret;
+      return false;
+    }
+    initialized_ = true;
+    return true;
+  }
+
+  bool Deflate(const uint8_t* data, size_t len, bool finish, std::vector<uint8_t>* buffer,
+               const DeflateSinkFn& sink) override {
+    if (buffer->size() < kDeflateBufferSize) {
+      buffer->resize(kDeflateBufferSize);
+    }
+    // The input length for an update never exceeds INT_MAX.
+    strm_.avail_in = len;
+    strm_.next_in = data;
+    int ret;
+    do {
+      strm_.avail_out = buffer->size();
+      strm_.next_out = buffer->data();
+      ret = deflate(&strm_, finish ? Z_FINISH : Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        LOG(ERROR) << "Failed to deflate stream: " << ret;
+        return false;
+      }
+
+      size_t have = buffer->size() - strm_.avail_out;
+      if (have > 0 && !sink(buffer->data(), have)) {
+        return false;
+      }
+    } while ((strm_.avail_in != 0 || strm_.avail_out == 0) && ret != Z_STREAM_END);
+
+    if (ret == Z_STREAM_END) {
+      finished_ = true;
+    }
+    return true;
+  }
+
+  bool Finished() const override {
+    return finished_;
+  }
+
+ private:
+  z_stream strm_;
+  bool initialized_{ false };
+  bool finished_{ false };
+};
+
+class ZlibDeflateBackend : public DeflateBackend {
+ public:
+  const char* Name() const override {
+    return "zlib";
+  }
+
+  bool MatchesZlib(const DeflateParams& /* params */) const override {
+    return true;
+  }
+
+  std::unique_ptr<DeflateStream> CreateStream(const DeflateParams& params) const override {
+    auto stream = std::make_unique<ZlibDeflateStream>();
+    if (!stream->Init(params)) {
+      return nullptr;
+    }
+    return stream;
+  }
+};
+
+static std::atomic<const DeflateBackend*> accelerated_backend{ nullptr };
+
+const DeflateBackend* GetZlibDeflateBackend() {
+  static const ZlibDeflateBackend zlib_backend;
+  return &zlib_backend;
+}
+
+void SetAcceleratedDeflateBackend(const DeflateBackend* backend) {
+  if (backend != nullptr) {
+    LOG(INFO) << "Using accelerated deflate backend " << backend->Name();
+  }
+  accelerated_backend = backend;
+}
+
+const DeflateBackend* GetAcceleratedDeflateBackend() {
+  return accelerated_backend;
+}
+
+std::vector<const DeflateBackend*> GetDeflateBackends() {
+  std::vector<const DeflateBackend*> backends{ GetZlibDeflateBackend() };
+  if (const DeflateBackend* backend = accelerated_backend; backend != nullptr) {
+    backends.push_back(backend);
+  }
+  return backends;
+}
+
+const DeflateBackend* SelectDeflateBackend(const DeflateParams& params, bool allow_accelerated) {
+  const DeflateBackend* backend = accelerated_backend;
+  if (allow_accelerated && backend != nullptr && backend->MatchesZlib(params)) {
+    return backend;
+  }
+  return GetZlibDeflateBackend();
+}
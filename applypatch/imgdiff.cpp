@@ -85,9 +85,16 @@
  *                windowBits      (4)
  *                memLevel        (4)
  *                strategy        (4)
+ *        if chunk type == CHUNK_DEFLATE_DICT:  (version 2 only)
+ *           <the same fields as CHUNK_DEFLATE>
+ *           dictionary count     (4)
+ *           dictionary index     (4)   [repeated 'dictionary count' times]
  *        if chunk type == RAW:             (version 2 only)
  *           target len           (4)
  *           data                 (target len)
+ *        if chunk type == CHUNK_COPY:      (version 2 only)
+ *           source start         (8)
+ *           source len           (8)
  *
  * All integers are little-endian.  "source start" and "source len" specify the section of the
  * input image that comprises this chunk, including the gzip header and footer for gzip chunks.
@@ -106,6 +113,23 @@
  * reduce the size of recovery-from-boot patches by combining the boot image with recovery ramdisk
  * information that is stored on the system partition.
  *
+ * As a generalization of the bonus data, it can also take a list of source dictionaries (with
+ * "--dict", image mode only). Dictionaries are identified by their index in the list, which must be
+ * the same when applying the patch. Unlike the bonus data, they aren't tied to chunk #1: for each
+ * deflate chunk, imgdiff tries appending each dictionary to the uncompressed source data, and keeps
+ * the ones that make the patch smaller. A chunk that uses any dictionary is written as a
+ * CHUNK_DEFLATE_DICT, which records the indices of the dictionaries appended to its source, in
+ * order. This allows diffing against multiple reference sources (e.g. recovery resources that live
+ * on different partitions), without having to concatenate them into a single bonus file.
+ *
+ * In image mode, this tool has an option "--cdc" to apply content-defined chunking to large normal
+ * chunks. Such a chunk is split with a rolling (gear) hash into pieces whose boundaries only depend
+ * on the content around them. Target pieces that are found in the corresponding source chunk are
+ * emitted as CHUNK_COPY, while each run of changed pieces is diffed (as a CHUNK_NORMAL) only
+ * against the source range between its neighboring matched pieces. This avoids a single large
+ * bsdiff (and its suffix array) over the whole chunk when only small parts of a large image have
+ * changed.
+ *
  * When generating the patch between two zip files, this tool has an option "--block-limit" to
  * split the large source/target files into several pair of pieces, with each piece has at most
  * *limit* blocks.  When this option is used, we also need to output the split info into the file
@@ -153,7 +177,13 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -167,6 +197,7 @@
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
+#include "applypatch/deflate_backend.h"
 #include "applypatch/imgdiff_image.h"
 #include "otautil/rangeset.h"
 
@@ -248,7 +279,9 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
+  { "dict", required_argument, nullptr, 0 },
   { "block-limit", required_argument, nullptr, 0 },
+  { "cdc", no_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
@@ -310,11 +343,21 @@ bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
   return true;
 }
 
+bool ImageChunk::AddDictionary(uint32_t index, const std::vector<uint8_t>& dictionary) {
+  if (type_ != CHUNK_DEFLATE) {
+    return false;
+  }
+  uncompressed_data_.insert(uncompressed_data_.end(), dictionary.begin(), dictionary.end());
+  dictionary_indices_.push_back(index);
+  return true;
+}
+
 void ImageChunk::ChangeDeflateChunkToNormal() {
   if (type_ != CHUNK_DEFLATE) return;
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
   uncompressed_data_.clear();
+  dictionary_indices_.clear();
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
@@ -386,8 +429,18 @@ bool ImageChunk::ReconstructDeflateChunk() {
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
   // (the maximum).
   for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
+    if (TryReconstruction(level, GetZlibDeflateBackend())) {
       compress_level_ = level;
+
+      // The patch must always be applicable with stock zlib. Additionally report whether the
+      // accelerated backend (if any) would reproduce the chunk, i.e. whether applying the patch
+      // could take the fast path.
+      const DeflateBackend* accelerated = GetAcceleratedDeflateBackend();
+      if (accelerated != nullptr) {
+        bool matched = TryReconstruction(level, accelerated);
+        LOG(DEBUG) << "Deflate backend " << accelerated->Name()
+                   << (matched ? " reproduces" : " doesn't reproduce") << " chunk at " << start_;
+      }
       return true;
     }
   }
@@ -397,44 +450,34 @@ bool ImageChunk::ReconstructDeflateChunk() {
 
 /*
  * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
- * stored in the chunk).
+ * in the chunk with the given deflate backend, and checks that it matches exactly the compressed
+ * data we started with (also stored in the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
-  int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
-  if (ret < 0) {
-    LOG(ERROR) << "Failed to initialize deflate: " << ret;
+bool ImageChunk::TryReconstruction(int level, const DeflateBackend* backend) {
+  DeflateParams params{ level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY };
+  std::unique_ptr<DeflateStream> stream = backend->CreateStream(params);
+  if (!stream) {
+    LOG(ERROR) << "Failed to initialize deflate with " << backend->Name();
     return false;
   }
 
   std::vector<uint8_t> buffer(BUFFER_SIZE);
   size_t offset = 0;
-  do {
-    strm.avail_out = buffer.size();
-    strm.next_out = buffer.data();
-    ret = deflate(&strm, Z_FINISH);
-    if (ret < 0) {
-      LOG(ERROR) << "Failed to deflate: " << ret;
-      return false;
-    }
-
-    size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
+  auto compare_sink = [this, &offset](const uint8_t* data, size_t len) {
+    if (offset + len > raw_data_len_ ||
+        memcmp(data, input_file_ptr_->data() + start_ + offset, len) != 0) {
       // mismatch; data isn't the same.
-      deflateEnd(&strm);
       return false;
     }
-    offset += compressed_size;
-  } while (ret != Z_STREAM_END);
-  deflateEnd(&strm);
+    offset += len;
+    return true;
+  };
+  if (!stream->Deflate(uncompressed_data_.data(), uncompressed_data_.size(), true, &buffer,
+                       compare_sink)) {
+    return false;
+  }
 
-  if (offset != raw_data_len_) {
+  if (!stream->Finished() || offset != raw_data_len_) {
     // mismatch; ran out of data before we should have.
     return false;
   }
@@ -450,7 +493,19 @@ PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
-      data_(std::move(data)) {}
+      dictionary_indices_(src.GetDictionaryIndices()),
+      data_(std::move(data)) {
+  if (type_ == CHUNK_DEFLATE && !dictionary_indices_.empty()) {
+    type_ = CHUNK_DEFLATE_DICT;
+  }
+}
+
+PatchChunk PatchChunk::CopyFromSource(const ImageChunk& tgt, const ImageChunk& src) {
+  CHECK_EQ(tgt.GetRawDataLength(), src.GetRawDataLength());
+  PatchChunk patch(tgt, src, {});
+  patch.type_ = CHUNK_COPY;
+  return patch;
+}
 
 // Construct a CHUNK_RAW patch from the target data directly.
 PatchChunk::PatchChunk(const ImageChunk& tgt)
@@ -471,7 +526,7 @@ bool PatchChunk::RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size) {
 }
 
 void PatchChunk::UpdateSourceOffset(const SortedRangeSet& src_range) {
-  if (type_ == CHUNK_DEFLATE) {
+  if (type_ == CHUNK_DEFLATE || type_ == CHUNK_DEFLATE_DICT) {
     source_start_ = src_range.GetOffsetInRangeSet(source_start_);
   }
 }
@@ -480,15 +535,21 @@ void PatchChunk::UpdateSourceOffset(const SortedRangeSet& src_range) {
 // header_type    4 bytes
 // CHUNK_NORMAL   8*3 = 24 bytes
 // CHUNK_DEFLATE  8*5 + 4*5 = 60 bytes
+// CHUNK_DEFLATE_DICT  60 + 4 + 4 * dictionary count bytes
 // CHUNK_RAW      4 bytes + patch_size
+// CHUNK_COPY     8*2 = 16 bytes
 size_t PatchChunk::GetHeaderSize() const {
   switch (type_) {
     case CHUNK_NORMAL:
       return 4 + 8 * 3;
     case CHUNK_DEFLATE:
       return 4 + 8 * 5 + 4 * 5;
+    case CHUNK_DEFLATE_DICT:
+      return 4 + 8 * 5 + 4 * 5 + 4 + 4 * dictionary_indices_.size();
     case CHUNK_RAW:
       return 4 + 4 + data_.size();
+    case CHUNK_COPY:
+      return 4 + 8 * 2;
     default:
       CHECK(false) << "unexpected chunk type: " << type_;  // Should not reach here.
       return 0;
@@ -507,6 +568,7 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
       Write8(fd, static_cast<int64_t>(offset));
       return offset + data_.size();
     case CHUNK_DEFLATE:
+    case CHUNK_DEFLATE_DICT:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: deflate  (%10zu, %10zu)  %10zu", index,
                                                target_start_, target_len_, data_.size());
       Write8(fd, static_cast<int64_t>(source_start_));
@@ -519,6 +581,12 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
       Write4(fd, ImageChunk::WINDOWBITS);
       Write4(fd, ImageChunk::MEMLEVEL);
       Write4(fd, ImageChunk::STRATEGY);
+      if (type_ == CHUNK_DEFLATE_DICT) {
+        Write4(fd, static_cast<int32_t>(dictionary_indices_.size()));
+        for (uint32_t dictionary_index : dictionary_indices_) {
+          Write4(fd, static_cast<int32_t>(dictionary_index));
+        }
+      }
       return offset + data_.size();
     case CHUNK_RAW:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: raw      (%10zu, %10zu)", index,
@@ -528,6 +596,12 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
         CHECK(false) << "Failed to write " << data_.size() << " bytes patch";
       }
       return offset;
+    case CHUNK_COPY:
+      LOG(INFO) << android::base::StringPrintf("chunk %zu: copy     (%10zu, %10zu)", index,
+                                               target_start_, target_len_);
+      Write8(fd, static_cast<int64_t>(source_start_));
+      Write8(fd, static_cast<int64_t>(source_len_));
+      return offset;
     default:
       CHECK(false) << "unexpected chunk type: " << type_;
       return offset;
@@ -535,7 +609,7 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
 }
 
 size_t PatchChunk::PatchSize() const {
-  if (type_ == CHUNK_RAW) {
+  if (type_ == CHUNK_RAW || type_ == CHUNK_COPY) {
     return GetHeaderSize();
   }
   return GetHeaderSize() + data_.size();
@@ -1396,6 +1470,47 @@ bool ImageModeImage::SetBonusData(const std::vector<uint8_t>& bonus_data) {
   return true;
 }
 
+bool ImageModeImage::SetDictionaries(const std::vector<std::vector<uint8_t>>& dictionaries) {
+  CHECK(is_source_);
+  for (size_t i = 0; i < dictionaries.size(); i++) {
+    LOG(INFO) << "  using " << dictionaries[i].size() << " bytes of dictionary " << i;
+  }
+  dictionaries_ = dictionaries;
+  return true;
+}
+
+// Generates the patch for a pair of deflate chunks, choosing which of the source dictionaries to
+// append to |src|. Each dictionary is tried in turn, and kept only if it makes the patch smaller
+// than the best one so far. Writes the source chunk with the chosen dictionaries (if any) to
+// |selected_src|.
+bool ImageModeImage::MakePatchWithDictionaries(const ImageChunk& tgt, const ImageChunk& src,
+                                               ImageChunk* selected_src,
+                                               std::vector<uint8_t>* patch_data) const {
+  CHECK(is_source_);
+  *selected_src = src;
+  if (!ImageChunk::MakePatch(tgt, *selected_src, patch_data, nullptr)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < dictionaries_.size(); i++) {
+    ImageChunk candidate = *selected_src;
+    if (!candidate.AddDictionary(i, dictionaries_[i])) {
+      return false;
+    }
+    std::vector<uint8_t> candidate_patch;
+    if (!ImageChunk::MakePatch(tgt, candidate, &candidate_patch, nullptr)) {
+      return false;
+    }
+    if (candidate_patch.size() < patch_data->size()) {
+      LOG(INFO) << "  dictionary " << i << " shrinks the patch for chunk at " << tgt.GetStartOffset()
+                << " from " << patch_data->size() << " to " << candidate_patch.size() << " bytes";
+      *selected_src = std::move(candidate);
+      *patch_data = std::move(candidate_patch);
+    }
+  }
+  return true;
+}
+
 // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
 // same sequence of deflate and normal chunks).
 bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image) {
@@ -1452,11 +1567,166 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
   return true;
 }
 
+// Parameters for content-defined chunking: a piece boundary is declared where the low bits of the
+// rolling hash are zero, which gives pieces of 64 KiB on average, bounded to [16 KiB, 256 KiB].
+static constexpr size_t kCdcMinPieceSize = 16 * 1024;
+static constexpr size_t kCdcMaxPieceSize = 256 * 1024;
+static constexpr uint64_t kCdcBoundaryMask = (1ULL << 16) - 1;
+// Only normal chunks larger than this are split with content-defined chunking.
+static constexpr size_t kCdcMinChunkSize = 1024 * 1024;
+
+// Returns the table of random values for the gear hash; generated with a fixed seed so that the
+// boundaries are deterministic.
+static const std::array<uint64_t, 256>& GearTable() {
+  static const std::array<uint64_t, 256> table = [] {
+    std::array<uint64_t, 256> result;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (auto& value : result) {
+      // splitmix64
+      uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      value = z ^ (z >> 31);
+    }
+    return result;
+  }();
+  return table;
+}
+
+// Splits |data| into content-defined pieces. Returns the list of (offset, length) pairs.
+static std::vector<std::pair<size_t, size_t>> SplitByContent(const uint8_t* data, size_t len) {
+  const auto& gear = GearTable();
+  std::vector<std::pair<size_t, size_t>> pieces;
+  size_t start = 0;
+  while (start < len) {
+    size_t end = std::min(len, start + kCdcMaxPieceSize);
+    size_t pos = std::min(end, start + kCdcMinPieceSize);
+    uint64_t hash = 0;
+    for (; pos < end; pos++) {
+      hash = (hash << 1) + gear[data[pos]];
+      if ((hash & kCdcBoundaryMask) == 0) {
+        pos++;
+        break;
+      }
+    }
+    pieces.emplace_back(start, pos - start);
+    start = pos;
+  }
+  return pieces;
+}
+
+// Generates the patches for a pair of large normal chunks with content-defined chunking, and
+// appends them to |patch_chunks|. See the comment at the top of the file for the details.
+bool ImageModeImage::GenerateContentDefinedPatches(const ImageModeImage& tgt_image,
+                                                   const ImageModeImage& src_image,
+                                                   const ImageChunk& tgt_chunk,
+                                                   const ImageChunk& src_chunk,
+                                                   std::vector<PatchChunk>* patch_chunks) {
+  const uint8_t* src_data = src_chunk.GetRawData();
+  const uint8_t* tgt_data = tgt_chunk.GetRawData();
+  auto src_pieces = SplitByContent(src_data, src_chunk.GetRawDataLength());
+  auto tgt_pieces = SplitByContent(tgt_data, tgt_chunk.GetRawDataLength());
+
+  // Index the source pieces by the hash of their contents.
+  auto piece_hash = [](const uint8_t* data, size_t len) {
+    return std::hash<std::string_view>{}(
+        std::string_view(reinterpret_cast<const char*>(data), len));
+  };
+  std::unordered_multimap<size_t, size_t> src_index;
+  for (size_t k = 0; k < src_pieces.size(); k++) {
+    const auto& [offset, len] = src_pieces[k];
+    src_index.emplace(piece_hash(src_data + offset, len), offset);
+  }
+
+  // For each target piece, look for the source offset of an identical piece.
+  static constexpr size_t kNoMatch = std::numeric_limits<size_t>::max();
+  std::vector<size_t> matches(tgt_pieces.size(), kNoMatch);
+  size_t matched_bytes = 0;
+  for (size_t k = 0; k < tgt_pieces.size(); k++) {
+    const auto& [offset, len] = tgt_pieces[k];
+    auto [begin, end] = src_index.equal_range(piece_hash(tgt_data + offset, len));
+    for (auto it = begin; it != end; it++) {
+      if (it->second + len <= src_chunk.GetRawDataLength() &&
+          memcmp(src_data + it->second, tgt_data + offset, len) == 0) {
+        matches[k] = it->second;
+        matched_bytes += len;
+        break;
+      }
+    }
+  }
+  LOG(INFO) << "content-defined chunking matched " << matched_bytes << " of "
+            << tgt_chunk.GetRawDataLength() << " bytes in " << tgt_pieces.size() << " pieces";
+
+  auto make_src = [&](size_t offset, size_t len) {
+    return ImageChunk(CHUNK_NORMAL, src_chunk.GetStartOffset() + offset, &src_image.file_content_,
+                      len);
+  };
+  auto make_tgt = [&](size_t offset, size_t len) {
+    return ImageChunk(CHUNK_NORMAL, tgt_chunk.GetStartOffset() + offset, &tgt_image.file_content_,
+                      len);
+  };
+
+  // The runs of changed pieces whose neighboring matches are out of order are all diffed against
+  // the whole source chunk, so its suffix array is only built once.
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+
+  size_t k = 0;
+  size_t prev_src_end = 0;  // end of the source range of the last matched piece
+  while (k < tgt_pieces.size()) {
+    size_t tgt_offset = tgt_pieces[k].first;
+    if (matches[k] != kNoMatch) {
+      // Merge the following matched pieces as long as they're also contiguous in the source.
+      size_t src_offset = matches[k];
+      size_t len = tgt_pieces[k].second;
+      for (k++; k < tgt_pieces.size() && matches[k] == src_offset + len; k++) {
+        len += tgt_pieces[k].second;
+      }
+      patch_chunks->push_back(
+          PatchChunk::CopyFromSource(make_tgt(tgt_offset, len), make_src(src_offset, len)));
+      prev_src_end = src_offset + len;
+      continue;
+    }
+
+    // Collect the run of changed pieces.
+    size_t tgt_len = 0;
+    for (; k < tgt_pieces.size() && matches[k] == kNoMatch; k++) {
+      tgt_len += tgt_pieces[k].second;
+    }
+    ImageChunk tgt_piece = make_tgt(tgt_offset, tgt_len);
+    if (PatchChunk::RawDataIsSmaller(tgt_piece, 0)) {
+      patch_chunks->emplace_back(tgt_piece);
+      continue;
+    }
+
+    // Diff against the source range between the neighboring matched pieces; or the whole source
+    // chunk if the matches are out of order.
+    size_t next_src_start = (k < tgt_pieces.size()) ? matches[k] : src_chunk.GetRawDataLength();
+    bool whole_source = prev_src_end >= next_src_start;
+    ImageChunk src_piece = whole_source ? make_src(0, src_chunk.GetRawDataLength())
+                                        : make_src(prev_src_end, next_src_start - prev_src_end);
+
+    std::vector<uint8_t> patch_data;
+    if (!ImageChunk::MakePatch(tgt_piece, src_piece, &patch_data,
+                               whole_source ? &bsdiff_cache : nullptr)) {
+      LOG(ERROR) << "Failed to generate patch for target piece at " << tgt_piece.GetStartOffset();
+      delete bsdiff_cache;
+      return false;
+    }
+    if (PatchChunk::RawDataIsSmaller(tgt_piece, patch_data.size())) {
+      patch_chunks->emplace_back(tgt_piece);
+    } else {
+      patch_chunks->emplace_back(tgt_piece, src_piece, std::move(patch_data));
+    }
+  }
+  delete bsdiff_cache;
+  return true;
+}
+
 // In image mode, generate patches against the given source chunks and bonus_data; write the
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, bool content_defined_chunking) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
@@ -1470,8 +1740,26 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
       continue;
     }
 
+    if (content_defined_chunking && tgt_chunk.GetType() == CHUNK_NORMAL &&
+        src_chunk.GetType() == CHUNK_NORMAL && tgt_chunk.GetRawDataLength() >= kCdcMinChunkSize &&
+        src_chunk.GetRawDataLength() >= kCdcMinChunkSize) {
+      if (!GenerateContentDefinedPatches(tgt_image, src_image, tgt_chunk, src_chunk,
+                                         &patch_chunks)) {
+        LOG(ERROR) << "Failed to generate patches for target chunk " << i;
+        return false;
+      }
+      continue;
+    }
+
+    // Deflate chunks may additionally be diffed against the source dictionaries, which are chosen
+    // separately for each chunk.
     std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
+    ImageChunk selected_src = src_chunk;
+    bool generated =
+        (tgt_chunk.GetType() == CHUNK_DEFLATE && !src_image.dictionaries_.empty())
+            ? src_image.MakePatchWithDictionaries(tgt_chunk, src_chunk, &selected_src, &patch_data)
+            : ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr);
+    if (!generated) {
       LOG(ERROR) << "Failed to generate patch for target chunk " << i;
       return false;
     }
@@ -1481,11 +1769,11 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, selected_src, std::move(patch_data));
     }
   }
 
-  CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
+  CHECK(content_defined_chunking || tgt_image.NumOfChunks() == patch_chunks.size());
 
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
@@ -1500,7 +1788,9 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
 int imgdiff(int argc, const char** argv) {
   bool verbose = false;
   bool zip_mode = false;
+  bool content_defined_chunking = false;
   std::vector<uint8_t> bonus_data;
+  std::vector<std::vector<uint8_t>> dictionaries;
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
@@ -1543,10 +1833,19 @@ int imgdiff(int argc, const char** argv) {
         if (name == "block-limit" && !android::base::ParseUint(optarg, &blocks_limit)) {
           LOG(ERROR) << "Failed to parse size blocks_limit: " << optarg;
           return 1;
+        } else if (name == "cdc") {
+          content_defined_chunking = true;
         } else if (name == "split-info") {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "dict") {
+          std::string dictionary;
+          if (!android::base::ReadFileToString(optarg, &dictionary)) {
+            PLOG(ERROR) << "Failed to read dictionary file " << optarg;
+            return 1;
+          }
+          dictionaries.emplace_back(dictionary.begin(), dictionary.end());
         }
         break;
       }
@@ -1565,6 +1864,10 @@ int imgdiff(int argc, const char** argv) {
     LOG(ERROR)
         << "  -z <zip-mode>,    Generate patches in zip mode, src and tgt should be zip files.\n"
            "  -b <bonus-file>,  Bonus file in addition to src, image mode only.\n"
+           "  --dict <file>,    Source dictionary in addition to src, image mode only. Can be\n"
+           "                    specified multiple times; not to be used together with -b.\n"
+           "  --cdc,            Use content-defined chunking for large normal chunks, image\n"
+           "                    mode only.\n"
            "  --block-limit,    For large zips, split the src and tgt based on the block limit;\n"
            "                    and generate patches between each pair of pieces. Concatenate "
            "these\n"
@@ -1576,6 +1879,11 @@ int imgdiff(int argc, const char** argv) {
     return 2;
   }
 
+  if (!dictionaries.empty() && (zip_mode || !bonus_data.empty())) {
+    LOG(ERROR) << "--dict is only supported in image mode, and without a bonus file";
+    return 2;
+  }
+
   if (zip_mode) {
     ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
     ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
@@ -1631,8 +1939,12 @@ int imgdiff(int argc, const char** argv) {
     if (!bonus_data.empty() && !src_image.SetBonusData(bonus_data)) {
       return 1;
     }
+    if (!dictionaries.empty() && !src_image.SetDictionaries(dictionaries)) {
+      return 1;
+    }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2],
+                                         content_defined_chunking)) {
       return 1;
     }
   }
@@ -33,6 +33,7 @@
 #include <android-base/logging.h>
 #include <android-base/memory.h>
 #include <applypatch/applypatch.h>
+#include <applypatch/deflate_backend.h>
 #include <applypatch/imgdiff.h>
 #include <openssl/sha.h>
 #include <zlib.h>
@@ -48,28 +49,39 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+// Scratch buffers that are shared by all the chunks of a single ApplyImagePatch() call. Reusing
+// them avoids reallocating (and zero-filling) the expanded source, as well as the deflate output
+// buffer, for every CHUNK_DEFLATE.
+struct ImagePatchScratch {
+  // Holds the inflated source of the current deflate chunk. bsdiff needs random access into the
+  // whole source, so this can't be replaced by a streaming inflate.
+  std::vector<uint8_t> expanded_source;
+  // Output buffer for re-deflating the patched data.
+  std::vector<uint8_t> deflate_buffer;
+};
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
-// patched data and stream the deflated data to output.
+// patched data and stream the deflated data to output. The deflation goes through an accelerated
+// backend if |allow_accelerated_deflate| is set and the backend matches stock zlib for the
+// parameters in the chunk header.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
                                             const Value& patch, size_t patch_offset,
-                                            const char* deflate_header, SinkFn sink) {
+                                            const char* deflate_header, SinkFn sink,
+                                            std::vector<uint8_t>* buffer,
+                                            bool allow_accelerated_deflate) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   CHECK_GT(expected_target_length, static_cast<size_t>(0));
-  int level = Read4(deflate_header + 40);
-  int method = Read4(deflate_header + 44);
-  int window_bits = Read4(deflate_header + 48);
-  int mem_level = Read4(deflate_header + 52);
-  int strategy = Read4(deflate_header + 56);
-
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = nullptr;
-  int ret = deflateInit2(&strm, level, method, window_bits, mem_level, strategy);
-  if (ret != Z_OK) {
-    LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+  DeflateParams params;
+  params.level = Read4(deflate_header + 40);
+  params.method = Read4(deflate_header + 44);
+  params.window_bits = Read4(deflate_header + 48);
+  params.mem_level = Read4(deflate_header + 52);
+  params.strategy = Read4(deflate_header + 56);
+
+  const DeflateBackend* backend = SelectDeflateBackend(params, allow_accelerated_deflate);
+  std::unique_ptr<DeflateStream> stream = backend->CreateStream(params);
+  if (!stream) {
+    LOG(ERROR) << "Failed to init uncompressed data deflation with " << backend->Name();
     return false;
   }
 
@@ -77,48 +89,32 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   // the fly and outputs the compressed data to the given sink.
   size_t actual_target_length = 0;
   size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
-  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &sink](const uint8_t* data, size_t len) -> size_t {
-    // The input patch length for an update never exceeds INT_MAX.
-    strm.avail_in = len;
-    strm.next_in = data;
-    do {
-      std::vector<uint8_t> buffer(buffer_size);
-      strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
-      if (actual_target_length + len < expected_target_length) {
-        ret = deflate(&strm, Z_NO_FLUSH);
-      } else {
-        ret = deflate(&strm, Z_FINISH);
-      }
-      if (ret != Z_OK && ret != Z_STREAM_END) {
-        LOG(ERROR) << "Failed to deflate stream: " << ret;
-        // zero length indicates an error in the sink function of bspatch().
-        return 0;
-      }
-
-      size_t have = buffer_size - strm.avail_out;
-      total_written += have;
-      if (sink(buffer.data(), have) != have) {
-        LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
-        return 0;
-      }
-    } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
-
+  auto output_sink = [&total_written, &sink](const uint8_t* data, size_t len) -> bool {
+    total_written += len;
+    if (sink(data, len) != len) {
+      LOG(ERROR) << "Failed to write " << len << " compressed bytes to output.";
+      return false;
+    }
+    return true;
+  };
+  auto compression_sink = [&stream, &actual_target_length, &expected_target_length, &output_sink,
+                           buffer](const uint8_t* data, size_t len) -> size_t {
+    bool finish = actual_target_length + len >= expected_target_length;
+    if (!stream->Deflate(data, len, finish, buffer, output_sink)) {
+      // zero length indicates an error in the sink function of bspatch().
+      return 0;
+    }
     actual_target_length += len;
     return len;
   };
 
-  int bspatch_result = ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink);
-  deflateEnd(&strm);
-
-  if (bspatch_result != 0) {
+  if (ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink) != 0) {
     return false;
   }
 
-  if (ret != Z_STREAM_END) {
-    LOG(ERROR) << "ret is expected to be Z_STREAM_END, but it's " << ret;
+  if (!stream->Finished()) {
+    LOG(ERROR) << "Deflate stream is not finished after writing " << actual_target_length
+               << " bytes";
     return false;
   }
 
@@ -132,6 +128,11 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
+static int ApplyImagePatchInternal(const unsigned char* old_data, size_t old_size,
+                                   const Value& patch, SinkFn sink, const Value* bonus_data,
+                                   const std::vector<const Value*>& dictionaries,
+                                   bool allow_accelerated_deflate);
+
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink) {
   Value patch(Value::Type::BLOB,
@@ -140,20 +141,35 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsign
 }
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data) {
+                    const Value* bonus_data, bool allow_accelerated_deflate) {
+  return ApplyImagePatchInternal(old_data, old_size, patch, sink, bonus_data, {},
+                                 allow_accelerated_deflate);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const std::vector<const Value*>& dictionaries, bool allow_accelerated_deflate) {
+  return ApplyImagePatchInternal(old_data, old_size, patch, sink, nullptr, dictionaries,
+                                 allow_accelerated_deflate);
+}
+
+static int ApplyImagePatchInternal(const unsigned char* old_data, size_t old_size,
+                                   const Value& patch, SinkFn sink, const Value* bonus_data,
+                                   const std::vector<const Value*>& dictionaries,
+                                   bool allow_accelerated_deflate) {
   if (patch.data.size() < 12) {
     printf("patch too short to contain header\n");
     return -1;
   }
 
-  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
-  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_DEFLATE_DICT, CHUNK_RAW and CHUNK_COPY.
+  // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and CHUNK_GZIP.)
   const char* const patch_header = patch.data.data();
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
     return -1;
   }
 
+  ImagePatchScratch scratch;
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
@@ -208,7 +224,28 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
       pos += data_len;
 
       LOG(DEBUG) << "Processed chunk type raw";
-    } else if (type == CHUNK_DEFLATE) {
+    } else if (type == CHUNK_COPY) {
+      const char* copy_header = patch_header + pos;
+      pos += 16;
+      if (pos > patch.data.size()) {
+        printf("failed to read chunk %d copy header data\n", i);
+        return -1;
+      }
+
+      size_t src_start = static_cast<size_t>(Read8(copy_header));
+      size_t src_len = static_cast<size_t>(Read8(copy_header + 8));
+
+      if (src_start > old_size || src_len > old_size - src_start) {
+        printf("source data too short\n");
+        return -1;
+      }
+      if (sink(old_data + src_start, src_len) != src_len) {
+        printf("failed to write chunk %d copy data\n", i);
+        return -1;
+      }
+
+      LOG(DEBUG) << "Processed chunk type copy";
+    } else if (type == CHUNK_DEFLATE || type == CHUNK_DEFLATE_DICT) {
       // deflate chunks have an additional 60 bytes in their chunk header.
       const char* deflate_header = patch_header + pos;
       pos += 60;
@@ -232,10 +269,47 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
 
       // Note: expanded_len will include the bonus data size if the patch was constructed with
       // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
-      // from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
+      // from the bonus_data value. Similarly for CHUNK_DEFLATE_DICT, the referenced dictionaries
+      // are appended in order.
+      std::vector<const Value*> appended;
+      if (type == CHUNK_DEFLATE) {
+        if (i == 1 && bonus_data != nullptr) {
+          appended.push_back(bonus_data);
+        }
+      } else {
+        if (pos + 4 > patch.data.size()) {
+          printf("failed to read chunk %d dictionary count\n", i);
+          return -1;
+        }
+        size_t dictionary_count = static_cast<uint32_t>(Read4(patch_header + pos));
+        pos += 4;
+        if (dictionary_count > (patch.data.size() - pos) / 4) {
+          printf("failed to read chunk %d dictionary indices\n", i);
+          return -1;
+        }
+        for (size_t k = 0; k < dictionary_count; k++) {
+          size_t index = static_cast<uint32_t>(Read4(patch_header + pos));
+          pos += 4;
+          if (index >= dictionaries.size() || dictionaries[index] == nullptr) {
+            printf("chunk %d refers to missing dictionary %zu\n", i, index);
+            return -1;
+          }
+          appended.push_back(dictionaries[index]);
+        }
+      }
+      size_t bonus_size = 0;
+      for (const Value* value : appended) {
+        bonus_size += value->data.size();
+      }
+      if (bonus_size > expanded_len) {
+        printf("bonus data (%zu bytes) exceeds the expanded source (%zu bytes)\n", bonus_size,
+               expanded_len);
+        return -1;
+      }
 
-      std::vector<unsigned char> expanded_source(expanded_len);
+      // Reuse the scratch buffer from the previous deflate chunk; only grow it when needed.
+      std::vector<uint8_t>& expanded_source = scratch.expanded_source;
+      expanded_source.resize(expanded_len);
 
       // inflate() doesn't like strm.next_out being a nullptr even with
       // avail_out being zero (Z_STREAM_ERROR).
@@ -258,26 +332,29 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
         // Because we've provided enough room to accommodate the output
         // data, we expect one call to inflate() to suffice.
         ret = inflate(&strm, Z_SYNC_FLUSH);
+        size_t avail_out = strm.avail_out;
+        inflateEnd(&strm);
         if (ret != Z_STREAM_END) {
           printf("source inflation returned %d\n", ret);
           return -1;
         }
         // We should have filled the output buffer exactly, except
         // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
+        if (avail_out != bonus_size) {
+          printf("source inflation short by %zu bytes\n", avail_out - bonus_size);
           return -1;
         }
-        inflateEnd(&strm);
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
-                 bonus_size);
+        uint8_t* bonus_start = expanded_source.data() + (expanded_len - bonus_size);
+        for (const Value* value : appended) {
+          memcpy(bonus_start, value->data.data(), value->data.size());
+          bonus_start += value->data.size();
         }
       }
 
       if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink)) {
+                                           patch_offset, deflate_header, sink,
+                                           &scratch.deflate_buffer, allow_accelerated_deflate)) {
         LOG(ERROR) << "Fail to apply streaming bspatch.";
         return -1;
       }
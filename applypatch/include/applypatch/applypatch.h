@@ -79,6 +79,11 @@ std::ostream& operator<<(std::ostream& os, const Partition& partition);
 bool PatchPartition(const Partition& target, const Partition& source, const Value& patch,
                     const Value* bonus, bool backup_source);
 
+// Same as above, but for an imgdiff patch that was generated against a list of source dictionaries
+// (imgdiff --dict). 'dictionaries' must be given in the same order as when generating the patch.
+bool PatchPartition(const Partition& target, const Partition& source, const Value& patch,
+                    const std::vector<const Value*>& dictionaries, bool backup_source);
+
 // Returns whether the contents of the eMMC target or the cached file match the embedded hash.
 // It will look for the backup on /cache if the given partition doesn't match the checksum.
 bool PatchPartitionCheck(const Partition& target, const Partition& source);
@@ -113,9 +118,16 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
 
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
 // the optional bonus data. Writes the patched output through the given 'sink'. Returns 0 on
-// success.
+// success. 'allow_accelerated_deflate' controls whether the deflate chunks may be recompressed with
+// a registered accelerated backend (see deflate_backend.h), or always with stock zlib.
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const Value* bonus_data, bool allow_accelerated_deflate = true);
+
+// Same as above, but with a list of source dictionaries instead of the bonus data. CHUNK_DEFLATE_DICT
+// chunks refer to the dictionaries by their indices in 'dictionaries'.
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data);
+                    const std::vector<const Value*>& dictionaries,
+                    bool allow_accelerated_deflate = true);
 
 // freecache.cpp
 
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_DEFLATE_BACKEND_H
+#define _APPLYPATCH_DEFLATE_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// The zlib encoder parameters that are recorded in the header of a CHUNK_DEFLATE.
+struct DeflateParams {
+  int level;
+  int method;
+  int window_bits;
+  int mem_level;
+  int strategy;
+};
+
+// Receives the compressed output of a DeflateStream. Returns false to abort the compression.
+using DeflateSinkFn = std::function<bool(const uint8_t*, size_t)>;
+
+// A single deflate stream, created by a DeflateBackend with a fixed set of parameters.
+class DeflateStream {
+ public:
+  virtual ~DeflateStream() = default;
+
+  // Compresses |len| bytes from |data| and passes the compressed output to |sink|, using |buffer|
+  // as the (reusable) output buffer. |finish| should be set when feeding the last piece of input,
+  // which flushes and terminates the stream. Returns false on any error.
+  virtual bool Deflate(const uint8_t* data, size_t len, bool finish, std::vector<uint8_t>* buffer,
+                       const DeflateSinkFn& sink) = 0;
+
+  // Returns whether the stream has been terminated (i.e. Z_STREAM_END has been seen).
+  virtual bool Finished() const = 0;
+};
+
+// A deflate implementation that can be used by imgpatch to recompress the patched data, and by
+// imgdiff to check the reconstruction of deflate chunks. The stock zlib backend is always
+// available. A zlib-compatible accelerated implementation (e.g. zlib-ng or libdeflate) can be
+// plugged in via SetAcceleratedDeflateBackend().
+class DeflateBackend {
+ public:
+  virtual ~DeflateBackend() = default;
+
+  virtual const char* Name() const = 0;
+
+  // Returns whether the backend is known to produce a stream that is byte-identical to the one
+  // from stock zlib with the given parameters. The stock zlib backend always returns true.
+  virtual bool MatchesZlib(const DeflateParams& params) const = 0;
+
+  // Creates a stream with the given parameters, or returns nullptr on error.
+  virtual std::unique_ptr<DeflateStream> CreateStream(const DeflateParams& params) const = 0;
+};
+
+// Returns the stock zlib backend.
+const DeflateBackend* GetZlibDeflateBackend();
+
+// Registers an accelerated backend, which takes priority over stock zlib for the parameters that it
+// claims to match. Passing nullptr unregisters it. The backend must outlive all the users.
+void SetAcceleratedDeflateBackend(const DeflateBackend* backend);
+
+// Returns the registered accelerated backend, or nullptr if none.
+const DeflateBackend* GetAcceleratedDeflateBackend();
+
+// Returns all the available backends, starting with stock zlib and followed by the accelerated
+// backend if one is registered.
+std::vector<const DeflateBackend*> GetDeflateBackends();
+
+// Returns the backend to be used for the given parameters. It returns the accelerated backend if
+// one is registered, |allow_accelerated| is true and the backend matches stock zlib for |params|.
+// Otherwise it falls back to stock zlib.
+const DeflateBackend* SelectDeflateBackend(const DeflateParams& params, bool allow_accelerated);
+
+#endif  // _APPLYPATCH_DEFLATE_BACKEND_H
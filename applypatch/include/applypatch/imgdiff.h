@@ -24,6 +24,8 @@
 #define CHUNK_GZIP 1     // version 1 only
 #define CHUNK_DEFLATE 2  // version 2 only
 #define CHUNK_RAW 3      // version 2 only
+#define CHUNK_DEFLATE_DICT 4  // version 2 only, CHUNK_DEFLATE with source dictionaries
+#define CHUNK_COPY 5          // version 2 only, verbatim copy of a source range
 
 // The gzip header size is actually variable, but we currently don't
 // support gzipped data with any of the optional fields, so for now it
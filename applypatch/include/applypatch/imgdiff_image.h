@@ -28,6 +28,7 @@
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
+#include "deflate_backend.h"
 #include "imgdiff.h"
 #include "otautil/rangeset.h"
 
@@ -69,6 +70,13 @@ class ImageChunk {
   void SetUncompressedData(std::vector<uint8_t> data);
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
+  // Appends the source dictionary with the given |index| to the uncompressed data. Only applicable
+  // to CHUNK_DEFLATE.
+  bool AddDictionary(uint32_t index, const std::vector<uint8_t>& dictionary);
+  const std::vector<uint32_t>& GetDictionaryIndices() const {
+    return dictionary_indices_;
+  }
+
   bool operator==(const ImageChunk& other) const;
   bool operator!=(const ImageChunk& other) const {
     return !(*this == other);
@@ -101,7 +109,7 @@ class ImageChunk {
                         bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
 
  private:
-  bool TryReconstruction(int level);
+  bool TryReconstruction(int level, const DeflateBackend* backend);
 
   int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
   size_t start_;                                // offset of chunk in the original input file
@@ -114,6 +122,7 @@ class ImageChunk {
   // --- for CHUNK_DEFLATE chunks only: ---
   std::vector<uint8_t> uncompressed_data_;
   std::string entry_name_;  // used for zip entries
+  std::vector<uint32_t> dictionary_indices_;  // source dictionaries appended to the data
 };
 
 // PatchChunk stores the patch data between a source chunk and a target chunk. It also keeps track
@@ -125,6 +134,9 @@ class PatchChunk {
   // Construct a CHUNK_RAW patch from the target data directly.
   explicit PatchChunk(const ImageChunk& tgt);
 
+  // Construct a CHUNK_COPY patch, where the target data is identical to the source chunk.
+  static PatchChunk CopyFromSource(const ImageChunk& tgt, const ImageChunk& src);
+
   // Return true if raw data size is smaller than the patch size.
   static bool RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size);
 
@@ -153,6 +165,9 @@ class PatchChunk {
   size_t target_uncompressed_len_;
   size_t target_compress_level_;  // the deflate compression level of the target chunk.
 
+  // --- for CHUNK_DEFLATE_DICT chunks only: ---
+  std::vector<uint32_t> dictionary_indices_;  // indices of the source dictionaries being used
+
   std::vector<uint8_t> data_;  // storage for the patch data
 };
 
@@ -295,14 +310,35 @@ class ImageModeImage : public Image {
 
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
+  // Sets the list of source dictionaries, which GeneratePatches() selects from for each deflate
+  // chunk. The dictionaries are referred to by their indices in the list, which should be passed
+  // to imgpatch in the same order.
+  bool SetDictionaries(const std::vector<std::vector<uint8_t>>& dictionaries);
+
   // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
   // same sequence of deflate and normal chunks).
   static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
-  // result to |patch_name|.
+  // result to |patch_name|. Large normal chunks are split with content-defined chunking if
+  // |content_defined_chunking| is true.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, bool content_defined_chunking = false);
+
+ private:
+  // Generate the patches between a pair of large normal chunks with content-defined chunking.
+  static bool GenerateContentDefinedPatches(const ImageModeImage& tgt_image,
+                                            const ImageModeImage& src_image,
+                                            const ImageChunk& tgt_chunk,
+                                            const ImageChunk& src_chunk,
+                                            std::vector<PatchChunk>* patch_chunks);
+
+  // Generate the patch between a pair of deflate chunks, with the source dictionaries that make it
+  // the smallest appended to |src|. Only applicable to the source image.
+  bool MakePatchWithDictionaries(const ImageChunk& tgt, const ImageChunk& src,
+                                 ImageChunk* selected_src, std::vector<uint8_t>* patch_data) const;
+
+  std::vector<std::vector<uint8_t>> dictionaries_;  // the source dictionaries, by index
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
@@ -45,4 +45,8 @@ class UpdaterInterface {
   virtual std::string GetResult() const = 0;
   virtual uint8_t* GetMappedPackageAddress() const = 0;
   virtual size_t GetMappedPackageLength() const = 0;
+
+  // Passes the madvise(2) |advice| for |length| bytes at |offset| of the mapped package, e.g.
+  // MADV_WILLNEED for an entry that's about to be extracted.
+  virtual void AdvisePackageRange(uint64_t offset, uint64_t length, int advice) const = 0;
 };
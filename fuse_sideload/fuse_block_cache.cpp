@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fuse_block_cache.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+static constexpr uint32_t kNoBlock = UINT32_MAX;
+
+// The number of back-to-back sequential reads before prefetching kicks in. Looking up the zip
+// central directory jumps around the end of the file, which shouldn't trigger prefetching.
+static constexpr size_t kSequentialReadsToPrefetch = 2;
+
+// The number of threads hashing the prefetched blocks. Hashing a block takes about as long as
+// receiving it over USB, so a couple of threads keep up with the prefetch thread.
+static constexpr size_t kHashThreads = 2;
+
+FuseBlockCache::FuseBlockCache(FuseDataProvider* provider, size_t capacity, size_t prefetch_blocks,
+                               Validator validator)
+    : provider_(provider),
+      block_size_(provider->fuse_block_size()),
+      capacity_(std::max<size_t>(capacity, 2)),
+      prefetch_blocks_(prefetch_blocks),
+      validator_(std::move(validator)),
+      last_block_(kNoBlock),
+      in_flight_(kNoBlock) {
+  uint64_t file_size = provider->file_size();
+  file_blocks_ = (file_size == 0) ? 0 : (((file_size - 1) / block_size_) + 1);
+  zero_block_ = std::make_shared<std::vector<uint8_t>>(block_size_);
+  if (prefetch_blocks_ > 0) {
+    prefetch_thread_ = std::thread(&FuseBlockCache::PrefetchThread, this);
+    for (size_t i = 0; i < kHashThreads; i++) {
+      hash_threads_.emplace_back(&FuseBlockCache::HashThread, this);
+    }
+  }
+}
+
+FuseBlockCache::~FuseBlockCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (prefetch_thread_.joinable()) {
+    prefetch_thread_.join();
+  }
+  for (auto& thread : hash_threads_) {
+    thread.join();
+  }
+}
+
+bool FuseBlockCache::ReadBlock(uint32_t block, uint8_t* data,
+                               const std::vector<uint32_t>& upcoming) {
+  uint32_t fetch_size = block_size_;
+  uint64_t offset = static_cast<uint64_t>(block) * block_size_;
+  if (offset + fetch_size > provider_->file_size()) {
+    // If we're reading the last (partial) block of the file, expect a shorter response from the
+    // provider, and pad the rest of the block with zeroes.
+    fetch_size = provider_->file_size() - offset;
+    memset(data + fetch_size, 0, block_size_ - fetch_size);
+  }
+
+  std::lock_guard<std::mutex> lock(provider_mutex_);
+  if (!upcoming.empty()) {
+    std::vector<uint32_t> blocks{ block };
+    blocks.insert(blocks.end(), upcoming.begin(), upcoming.end());
+    provider_->Prefetch(blocks);
+  }
+  return provider_->ReadBlockAlignedData(data, fetch_size, block);
+}
+
+FuseBlockCache::BlockData FuseBlockCache::Get(uint32_t block) {
+  if (block >= file_blocks_) {
+    return zero_block_;
+  }
+
+  std::lock_guard<std::mutex> reader_lock(reader_mutex_);
+
+  // Reads that aren't block aligned often start in the block where the previous one ended.
+  if (block != last_block_) {
+    sequential_reads_ =
+        (last_block_ != kNoBlock && block == last_block_ + 1) ? sequential_reads_ + 1 : 0;
+    last_block_ = block;
+  }
+
+  if (auto it = index_.find(block); it != index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.hits++;
+    if (sequential_reads_ >= kSequentialReadsToPrefetch) {
+      SchedulePrefetch(block);
+    }
+    return lru_.front().data;
+  }
+
+  // Take the block from the prefetched ones, waiting for it if it's being fetched right now.
+  std::shared_ptr<PendingBlock> pending;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, block] { return in_flight_ != block; });
+    if (auto it = prefetched_.find(block); it != prefetched_.end()) {
+      pending = std::move(it->second);
+      prefetched_.erase(it);
+      stats_.prefetch_hits++;
+      // Hash it right here if no hashing thread has picked it up yet, rather than wait for the
+      // blocks queued before it; otherwise wait for the hash.
+      if (auto q = std::find(hash_queue_.begin(), hash_queue_.end(), pending);
+          q != hash_queue_.end()) {
+        hash_queue_.erase(q);
+      } else {
+        cv_.wait(lock, [&pending] { return pending->hashed; });
+      }
+    } else {
+      stats_.misses++;
+      // It's about to be read right here; don't have the prefetch thread read it again.
+      prefetch_queue_.erase(std::remove(prefetch_queue_.begin(), prefetch_queue_.end(), block),
+                            prefetch_queue_.end());
+    }
+
+    if (sequential_reads_ >= kSequentialReadsToPrefetch) {
+      SchedulePrefetch(block);
+    } else {
+      // The reader jumped elsewhere; what has been queued is unlikely to be read soon.
+      prefetch_queue_.clear();
+      stats_.prefetch_wasted += prefetched_.size();
+      prefetched_.clear();
+      hash_queue_.clear();
+    }
+  }
+
+  std::vector<uint8_t> data;
+  Digest digest;
+  if (pending != nullptr && pending->hashed) {
+    data = std::move(pending->data);
+    digest = pending->digest;
+  } else {
+    if (pending != nullptr) {
+      data = std::move(pending->data);
+    } else {
+      data.resize(block_size_);
+      if (!ReadBlock(block, data.data())) {
+        return nullptr;
+      }
+    }
+    SHA256(data.data(), data.size(), digest.data());
+  }
+
+  if (!validator_(block, data.data(), digest)) {
+    return nullptr;
+  }
+
+  if (lru_.size() >= capacity_) {
+    index_.erase(lru_.back().block);
+    lru_.pop_back();
+  }
+  lru_.push_front(Entry{ block, std::make_shared<std::vector<uint8_t>>(std::move(data)) });
+  index_[block] = lru_.begin();
+  return lru_.front().data;
+}
+
+void FuseBlockCache::SchedulePrefetch(uint32_t block) {
+  // Called with |mutex_| held.
+  uint64_t end = std::min<uint64_t>(static_cast<uint64_t>(block) + 1 + prefetch_blocks_,
+                                    file_blocks_);
+  bool queued = false;
+  for (uint64_t next = block + 1; next < end; next++) {
+    uint32_t b = static_cast<uint32_t>(next);
+    if (index_.count(b) != 0 || prefetched_.count(b) != 0 || b == in_flight_ ||
+        std::find(prefetch_queue_.begin(), prefetch_queue_.end(), b) != prefetch_queue_.end()) {
+      continue;
+    }
+    prefetch_queue_.push_back(b);
+    queued = true;
+  }
+  if (queued) {
+    cv_.notify_all();
+  }
+}
+
+void FuseBlockCache::PrefetchThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !prefetch_queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+
+    uint32_t block = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+    // Let the provider fetch the rest of the queue meanwhile, if it can.
+    std::vector<uint32_t> upcoming(prefetch_queue_.begin(), prefetch_queue_.end());
+    in_flight_ = block;
+    lock.unlock();
+
+    std::vector<uint8_t> data(block_size_);
+    bool success = ReadBlock(block, data.data(), upcoming);
+
+    lock.lock();
+    in_flight_ = kNoBlock;
+    if (success) {
+      auto pending = std::make_shared<PendingBlock>();
+      pending->data = std::move(data);
+      prefetched_[block] = pending;
+      hash_queue_.push_back(std::move(pending));
+    }
+    cv_.notify_all();
+  }
+}
+
+void FuseBlockCache::HashThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !hash_queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+
+    // The reader doesn't touch a block while it's queued or being hashed, so it can be hashed
+    // without holding the lock.
+    std::shared_ptr<PendingBlock> pending = std::move(hash_queue_.front());
+    hash_queue_.pop_front();
+    lock.unlock();
+
+    Digest digest;
+    SHA256(pending->data.data(), pending->data.size(), digest.data());
+
+    lock.lock();
+    pending->digest = digest;
+    pending->hashed = true;
+    cv_.notify_all();
+  }
+}
+
+void FuseBlockCache::Clear() {
+  std::lock_guard<std::mutex> reader_lock(reader_mutex_);
+  lru_.clear();
+  index_.clear();
+  last_block_ = kNoBlock;
+  sequential_reads_ = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  prefetch_queue_.clear();
+  cv_.wait(lock, [this] { return in_flight_ == kNoBlock; });
+  stats_.prefetch_wasted += prefetched_.size();
+  prefetched_.clear();
+  hash_queue_.clear();
+}
+
+FuseBlockCache::Stats FuseBlockCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.prefetch_wasted += prefetched_.size();
+  return stats;
+}
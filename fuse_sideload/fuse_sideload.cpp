@@ -37,6 +37,11 @@
 // causes the filesystem to be unmounted and the adb process on the
 // device shut down.
 //
+// If the package carries a signed chunk manifest (see verify_chunk_manifest()) and keys are
+// given, the invariant gets stronger: each chunk of the signed part of the package must match
+// its hash in the manifest, so the package can be installed while it's being read instead of
+// having to be hashed in full up front. In that case a third file, "/sideload/verified", exists.
+//
 // Note that only the minimal set of file operations needed for these
 // two files is implemented.  In particular, you can't opendir() or
 // readdir() on the "/sideload" directory; ls on it won't work.
@@ -45,6 +50,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
 #include <stdint.h>
@@ -57,42 +63,172 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "fuse_block_cache.h"
+
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
 static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
+static constexpr uint64_t VERIFIED_FLAG_ID = FUSE_ROOT_ID + 3;
 
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
-using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+// The max size of a read request, as long as the block size isn't larger. The kernel splits reads
+// into requests of this size, and each request costs a round trip to this process.
+static constexpr uint32_t MAX_READ_SIZE = 1 << 20;  // 1 MiB
+
+// The number of threads serving FUSE_READ requests. The kernel issues reads concurrently (e.g.
+// readahead alongside the reader's own request), which can then be replied to in parallel.
+static constexpr size_t READ_THREADS = 4;
+
+// The largest chunk of a chunk manifest. Each read from the host may need a whole chunk around it.
+static constexpr uint32_t MAX_CHUNK_SIZE = 1 << 22;  // 4 MiB
+
+using SHA256Digest = FuseBlockCache::Digest;
+
+// Checks the data of the signed part of the package against a chunk manifest as it's read from the
+// host. The host blocks don't need to line up with the manifest chunks: reading a block reads (and
+// checks) every chunk it overlaps. The blocks read along are kept for the reads that follow, so a
+// sequential reader gets each block from the host only once.
+class ChunkCheckingDataProvider : public FuseDataProvider {
+ public:
+  explicit ChunkCheckingDataProvider(FuseDataProvider* provider)
+      : FuseDataProvider(provider->file_size(), provider->fuse_block_size()),
+        provider_(provider) {}
+
+  // Starts checking the reads against |manifest|. Must not be called while a read is going on.
+  void SetManifest(ChunkManifest&& manifest) {
+    manifest_ = std::move(manifest);
+    span_blocks_.clear();
+  }
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    for (uint32_t block = start_block; fetch_size > 0; block++) {
+      uint32_t size = std::min(fetch_size, fuse_block_size_);
+      if (!ReadBlock(buffer, size, block)) {
+        return false;
+      }
+      buffer += size;
+      fetch_size -= size;
+    }
+    return true;
+  }
+
+  void Prefetch(const std::vector<uint32_t>& blocks) const override {
+    provider_->Prefetch(blocks);
+  }
+
+  bool Valid() const override {
+    return provider_->Valid();
+  }
+
+ private:
+  bool ReadBlock(uint8_t* buffer, uint32_t size, uint32_t block) const {
+    uint64_t offset = static_cast<uint64_t>(block) * fuse_block_size_;
+    if (manifest_.hashes.empty() || offset >= manifest_.signed_len) {
+      return provider_->ReadBlockAlignedData(buffer, size, block);
+    }
+    if (auto it = span_blocks_.find(block); it != span_blocks_.end() && it->second.checked) {
+      memcpy(buffer, it->second.data.data(), size);
+      return true;
+    }
+
+    // Read all the chunks that overlap the signed part of the block.
+    uint64_t signed_end = std::min<uint64_t>(offset + fuse_block_size_, manifest_.signed_len);
+    uint64_t first_chunk = offset / manifest_.chunk_size;
+    uint64_t last_chunk = (signed_end - 1) / manifest_.chunk_size;
+    uint64_t span_start = first_chunk * manifest_.chunk_size;
+    uint64_t span_end =
+        std::min<uint64_t>((last_chunk + 1) * manifest_.chunk_size, manifest_.signed_len);
+    uint32_t first_block = span_start / fuse_block_size_;
+    uint32_t last_block = (span_end - 1) / fuse_block_size_;
+    uint64_t span_offset = static_cast<uint64_t>(first_block) * fuse_block_size_;
+
+    std::vector<uint8_t> span(static_cast<size_t>(last_block - first_block + 1) *
+                              fuse_block_size_);
+    for (uint32_t b = first_block; b <= last_block; b++) {
+      uint8_t* data = span.data() + (static_cast<uint64_t>(b) * fuse_block_size_ - span_offset);
+      uint32_t fetch_size = std::min<uint64_t>(
+          fuse_block_size_, file_size_ - static_cast<uint64_t>(b) * fuse_block_size_);
+      if (auto it = span_blocks_.find(b); it != span_blocks_.end()) {
+        memcpy(data, it->second.data.data(), fetch_size);
+      } else if (!provider_->ReadBlockAlignedData(data, fetch_size, b)) {
+        return false;
+      }
+    }
+    for (uint64_t chunk = first_chunk; chunk <= last_chunk; chunk++) {
+      const uint8_t* data = span.data() + (chunk * manifest_.chunk_size - span_offset);
+      if (!CheckChunk(manifest_, chunk, data)) {
+        fprintf(stderr, "chunk %" PRIu64 " doesn't match the chunk manifest\n", chunk);
+        return false;
+      }
+    }
+
+    memcpy(buffer, span.data() + (static_cast<uint64_t>(block) * fuse_block_size_ - span_offset),
+           size);
+
+    // Only the blocks entirely within the checked chunks are pinned down by them. The others at
+    // the edges are only worth keeping for the data, to check along with their next chunk.
+    span_blocks_.clear();
+    for (uint32_t b = first_block; b <= last_block; b++) {
+      uint64_t start = static_cast<uint64_t>(b) * fuse_block_size_;
+      const uint8_t* data = span.data() + (start - span_offset);
+      bool checked = start >= span_start && start + fuse_block_size_ <= span_end;
+      span_blocks_.emplace(
+          b, SpanBlock{ std::vector<uint8_t>(data, data + fuse_block_size_), checked });
+    }
+    return true;
+  }
+
+  struct SpanBlock {
+    std::vector<uint8_t> data;
+    bool checked;
+  };
+
+  FuseDataProvider* provider_;
+  ChunkManifest manifest_{};
+
+  // The blocks read for the last block that was asked for, including that one.
+  mutable std::map<uint32_t, SpanBlock> span_blocks_;
+};
 
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
-  FuseDataProvider* provider;  // Provider of the source data.
+  // Provider of the source data, which checks it against the chunk manifest if there is one.
+  std::unique_ptr<ChunkCheckingDataProvider> provider;
 
   uint64_t file_size;  // bytes
 
   uint32_t block_size;   // block size that the adb host is using to send the file to us
   uint32_t file_blocks;  // file size in block_size blocks
+  uint32_t max_read;     // max size of a read request, a multiple of block_size
 
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
+  std::unique_ptr<FuseBlockCache> cache;  // the blocks recently read from the host
 
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  // SHA-256 hash of each block from |hashes_base| on (all zeros if block hasn't been read yet).
+  // The blocks before |hashes_base| are pinned down by the chunk manifest and need no entry.
+  std::vector<SHA256Digest> hashes;
+  uint32_t hashes_base;
 
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+  bool chunk_verified;  // whether |provider| checks the package against a chunk manifest
 };
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -113,6 +249,14 @@ static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, s
   }
 }
 
+static void fuse_reply_error(const fuse_data* fd, uint64_t unique, int error) {
+  fuse_out_header outhdr;
+  outhdr.len = sizeof(outhdr);
+  outhdr.error = error;
+  outhdr.unique = unique;
+  TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+}
+
 static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   const fuse_init_in* req = static_cast<const fuse_init_in*>(data);
 
@@ -140,10 +284,18 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
 
   out.major = FUSE_KERNEL_VERSION;
   out.max_readahead = req->max_readahead;
-  out.flags = 0;
+  // Let the kernel have several reads in flight, to be served by the read threads.
+  out.flags = req->flags & FUSE_ASYNC_READ;
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+#if defined(FUSE_MAX_PAGES)
+  // Since 7.28, the kernel caps requests at 32 pages unless told to allow more.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = fd->max_read / getpagesize();
+  }
+#endif
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -173,6 +325,8 @@ static int handle_getattr(void* /* data */, const fuse_data* fd, const fuse_in_h
     fill_attr(&(out.attr), fd, PACKAGE_FILE_ID, fd->file_size, S_IFREG | 0444);
   } else if (hdr->nodeid == EXIT_FLAG_ID) {
     fill_attr(&(out.attr), fd, EXIT_FLAG_ID, 0, S_IFREG | 0);
+  } else if (hdr->nodeid == VERIFIED_FLAG_ID && fd->chunk_verified) {
+    fill_attr(&(out.attr), fd, VERIFIED_FLAG_ID, 0, S_IFREG | 0444);
   } else {
     return -ENOENT;
   }
@@ -197,6 +351,10 @@ static int handle_lookup(void* data, const fuse_data* fd, const fuse_in_header*
     out.nodeid = EXIT_FLAG_ID;
     out.generation = EXIT_FLAG_ID;
     fill_attr(&(out.attr), fd, EXIT_FLAG_ID, 0, S_IFREG | 0);
+  } else if (filename == FUSE_SIDELOAD_HOST_VERIFIED_FLAG && fd->chunk_verified) {
+    out.nodeid = VERIFIED_FLAG_ID;
+    out.generation = VERIFIED_FLAG_ID;
+    fill_attr(&(out.attr), fd, VERIFIED_FLAG_ID, 0, S_IFREG | 0444);
   } else {
     return -ENOENT;
   }
@@ -223,57 +381,45 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint64_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
-  }
-
-  uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+// Checks a block just fetched from the host, zero-padded to the block size, against the hashes.
+// |digest| is the SHA-256 of the whole block, computed by the cache. Returns true if the block is
+// accepted.
+static bool validate_block(fuse_data* fd, uint32_t block, const uint8_t* /* data */,
+                           const SHA256Digest& digest) {
+  // The blocks entirely within the signed part have been checked against the chunk manifest by
+  // the provider. The bytes past the signed length (the archive comment) are not covered, so the
+  // block holding them still goes through the first-read check below.
+  if (block < fd->hashes_base) {
+    return true;
   }
 
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
-  }
-
-  fd->curr_block = block;
-
   // Verify the hash of the block we just got from the host.
   //
   // - If the hash of the just-received data matches the stored hash for the block, accept it.
   // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
   //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
-
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  // - Otherwise, reject the block.
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
+  SHA256Digest& blockhash = fd->hashes[block - fd->hashes_base];
+  if (digest == blockhash) {
+    return true;
   }
 
   for (uint8_t i : blockhash) {
     if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
+      return false;
     }
   }
 
-  fd->hashes[block] = hash;
-  return 0;
+  blockhash = digest;
+  return true;
+}
+
+// Fetches a block, from the cache or from the host. Sets |data| to the block data. Returns 0 on
+// successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, uint32_t block, FuseBlockCache::BlockData* data) {
+  *data = fd->cache->Get(block);
+  return (*data == nullptr) ? -EIO : 0;
 }
 
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
@@ -291,57 +437,179 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   // past the end of the file so we're always returning exactly as many bytes as were requested.
   // (Users of the mapped file have to know its real length anyway.)
 
+  if (size > fd->max_read) return -EINVAL;
+
   fuse_out_header outhdr;
   outhdr.len = sizeof(outhdr) + size;
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
-  vec[0].iov_base = &outhdr;
-  vec[0].iov_len = sizeof(outhdr);
+  // The reply is gathered straight from the cached blocks. Since we mount the filesystem with
+  // max_read a multiple of block_size, a read spans at most max_read / block_size + 1 blocks. The
+  // references in |blocks| keep them alive until the reply is written, even if evicted meanwhile.
+  std::vector<FuseBlockCache::BlockData> blocks;
+  std::vector<iovec> vec;
+  vec.push_back({ &outhdr, sizeof(outhdr) });
 
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
+  uint32_t block_offset = offset - (static_cast<uint64_t>(block) * fd->block_size);
+  while (size > 0) {
+    FuseBlockCache::BlockData block_data;
+    int result = fetch_block(fd, block, &block_data);
+    if (result != 0) return result;
 
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+    uint32_t len = std::min(size, fd->block_size - block_offset);
+    vec.push_back({ const_cast<uint8_t*>(block_data->data()) + block_offset, len });
+    blocks.push_back(std::move(block_data));
 
-  uint32_t block_offset = offset - (block * fd->block_size);
+    size -= len;
+    block++;
+    block_offset = 0;
+  }
+
+  if (writev(fd->ffd, vec.data(), vec.size()) == -1) {
+    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+  }
+  return NO_STATUS;
+}
 
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
+// Serves FUSE_READ requests on a few threads, so that concurrent reads from the kernel don't queue
+// up behind each other's replies.
+class ReadThreadPool {
+ public:
+  ReadThreadPool(fuse_data* fd, size_t threads) : fd_(fd) {
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back(&ReadThreadPool::Run, this);
+    }
+  }
 
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
+  // Serves the requests still queued, then stops the threads.
+  ~ReadThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  void Submit(const fuse_in_header& hdr, const fuse_read_in& req) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.push_back({ hdr, req });
+    }
+    cv_.notify_one();
+  }
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+ private:
+  struct Request {
+    fuse_in_header hdr;
+    fuse_read_in req;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !requests_.empty(); });
+      if (requests_.empty()) {
+        return;
+      }
+      Request request = requests_.front();
+      requests_.pop_front();
+      lock.unlock();
+
+      int result = handle_read(&request.req, fd_, &request.hdr);
+      if (result != NO_STATUS) {
+        fuse_reply_error(fd_, request.hdr.unique, result);
+      }
+
+      lock.lock();
+    }
   }
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
-    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+  fuse_data* fd_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> requests_;
+  bool stop_ = false;
+};
+
+// Reads the package through fetch_block(), so the data read while verifying the chunk manifest is
+// pinned like any other read.
+class FuseDataVerifier : public VerifierInterface {
+ public:
+  explicit FuseDataVerifier(fuse_data* fd) : fd_(fd) {}
+
+  uint64_t GetPackageSize() const override {
+    return fd_->file_size;
   }
-  return NO_STATUS;
+
+  bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) override {
+    if (byte_count > fd_->file_size || offset > fd_->file_size - byte_count) {
+      return false;
+    }
+    while (byte_count > 0) {
+      uint32_t block = offset / fd_->block_size;
+      FuseBlockCache::BlockData block_data;
+      if (fetch_block(fd_, block, &block_data) != 0) {
+        return false;
+      }
+      uint32_t block_offset = offset - static_cast<uint64_t>(block) * fd_->block_size;
+      uint64_t size = std::min<uint64_t>(byte_count, fd_->block_size - block_offset);
+      memcpy(buffer, block_data->data() + block_offset, size);
+      buffer += size;
+      offset += size;
+      byte_count -= size;
+    }
+    return true;
+  }
+
+  // Not needed by verify_chunk_manifest().
+  bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& /* hashers */,
+                          uint64_t /* start */, uint64_t /* length */,
+                          const HashProgressCallback& /* on_progress */) override {
+    return false;
+  }
+
+  void SetProgress(float /* progress */) override {}
+
+ private:
+  fuse_data* fd_;
+};
+
+// Loads the chunk manifest of the package into |fd| if it has one signed by any of the |keys|.
+static void load_chunk_manifest(fuse_data* fd, const std::vector<Certificate>& keys) {
+  FuseDataVerifier verifier(fd);
+  ChunkManifest manifest;
+  if (verify_chunk_manifest(&verifier, keys, &manifest) != VERIFY_SUCCESS) {
+    printf("no valid chunk manifest; package needs whole-file verification\n");
+    return;
+  }
+  if (manifest.chunk_size > MAX_CHUNK_SIZE) {
+    fprintf(stderr, "chunk manifest uses too large chunks (%u)\n", manifest.chunk_size);
+    return;
+  }
+
+  // The blocks cached so far haven't been checked against the manifest; fetch them again.
+  fd->cache->Clear();
+  uint64_t signed_len = manifest.signed_len;
+  uint32_t chunk_size = manifest.chunk_size;
+  fd->provider->SetManifest(std::move(manifest));
+  fd->chunk_verified = true;
+  // Only the blocks past the fully signed ones need the first-read hashes from now on.
+  uint32_t pinned = std::min<uint64_t>(signed_len / fd->block_size, fd->file_blocks);
+  fd->hashes.erase(fd->hashes.begin(), fd->hashes.begin() + (pinned - fd->hashes_base));
+  fd->hashes.shrink_to_fit();
+  fd->hashes_base = pinned;
+  printf("verifying %u-byte blocks against the %u-byte chunks of the chunk manifest\n",
+         fd->block_size, chunk_size);
 }
 
-int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point) {
+int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point,
+                      const std::vector<Certificate>& keys, size_t cache_size) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
   umount2(mount_point, MNT_FORCE);
@@ -360,10 +628,11 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   }
 
   fuse_data fd = {};
-  fd.provider = provider.get();
+  fd.provider = std::make_unique<ChunkCheckingDataProvider>(provider.get());
   fd.file_size = file_size;
   fd.block_size = block_size;
   fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  fd.max_read = std::max(block_size, MAX_READ_SIZE / block_size * block_size);
 
   int result;
   if (fd.file_blocks > (1 << 18)) {
@@ -377,18 +646,19 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
+  {
+    // Prefetch up to a quarter of the cache ahead of a sequential reader, leaving the rest for the
+    // blocks that are read over and over (e.g. the zip central directory).
+    size_t cache_blocks = cache_size / block_size;
+    fd.cache = std::make_unique<FuseBlockCache>(
+        fd.provider.get(), cache_blocks, cache_blocks / 4,
+        [&fd](uint32_t block, const uint8_t* data, const SHA256Digest& digest) {
+          return validate_block(&fd, block, data, digest);
+        });
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
+
+  if (!keys.empty()) {
+    load_chunk_manifest(&fd, keys);
   }
 
   fd.ffd.reset(open("/dev/fuse", O_RDWR));
@@ -401,7 +671,7 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   {
     std::string opts = android::base::StringPrintf(
         "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
+        fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
                    opts.c_str());
@@ -411,85 +681,93 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
   }
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  for (;;) {
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
-    if (len == -1) {
-      perror("read request");
-      if (errno == ENODEV) {
-        result = -1;
-        break;
+  {
+    ReadThreadPool read_threads(&fd, READ_THREADS);
+    uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
+    for (;;) {
+      ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
+      if (len == -1) {
+        perror("read request");
+        if (errno == ENODEV) {
+          result = -1;
+          break;
+        }
+        continue;
       }
-      continue;
-    }
 
-    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
-      fprintf(stderr, "request too short: len=%zd\n", len);
-      continue;
-    }
+      if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
+        fprintf(stderr, "request too short: len=%zd\n", len);
+        continue;
+      }
 
-    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
-    void* data = request_buffer + sizeof(fuse_in_header);
+      fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
+      void* data = request_buffer + sizeof(fuse_in_header);
 
-    result = -ENOSYS;
+      result = -ENOSYS;
 
-    switch (hdr->opcode) {
-      case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
-        break;
+      switch (hdr->opcode) {
+        case FUSE_INIT:
+          result = handle_init(data, &fd, hdr);
+          break;
 
-      case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
-        break;
+        case FUSE_LOOKUP:
+          result = handle_lookup(data, &fd, hdr);
+          break;
 
-      case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
-        break;
+        case FUSE_GETATTR:
+          result = handle_getattr(data, &fd, hdr);
+          break;
 
-      case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
-        break;
+        case FUSE_OPEN:
+          result = handle_open(data, &fd, hdr);
+          break;
 
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
-        break;
+        case FUSE_READ:
+          if (static_cast<size_t>(len) < sizeof(fuse_in_header) + sizeof(fuse_read_in)) {
+            result = -EINVAL;
+            break;
+          }
+          read_threads.Submit(*hdr, *static_cast<const fuse_read_in*>(data));
+          result = NO_STATUS;
+          break;
 
-      case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
-        break;
+        case FUSE_FLUSH:
+          result = handle_flush(data, &fd, hdr);
+          break;
 
-      case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
-        break;
+        case FUSE_RELEASE:
+          result = handle_release(data, &fd, hdr);
+          break;
 
-      default:
-        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
-        break;
-    }
+        default:
+          fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
+          break;
+      }
 
-    if (result == NO_STATUS_EXIT) {
-      result = 0;
-      break;
-    }
+      if (result == NO_STATUS_EXIT) {
+        result = 0;
+        break;
+      }
 
-    if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
+      if (result != NO_STATUS) {
+        fuse_reply_error(&fd, hdr->unique, result);
+      }
     }
   }
 
 done:
+  if (fd.cache) {
+    FuseBlockCache::Stats stats = fd.cache->stats();
+    printf("block cache: %zu hits, %zu prefetch hits, %zu misses, %zu prefetched blocks unused\n",
+           stats.hits, stats.prefetch_hits, stats.misses, stats.prefetch_wasted);
+    // Stop prefetching before the provider goes away.
+    fd.cache.reset();
+  }
   provider->Close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
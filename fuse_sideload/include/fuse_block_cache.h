@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "fuse_provider.h"
+
+// An LRU cache of the blocks read from a FuseDataProvider. It keeps the most recently used
+// blocks in memory, and once it sees the reader going through the file sequentially, it fetches
+// the following blocks from the provider on a background thread.
+//
+// Every block is passed to the validator on the reader's thread before it enters the cache, so a
+// prefetched block is checked exactly like one fetched on demand. Only the SHA-256 of a prefetched
+// block is computed ahead of time, by a pool of hashing threads, so that the reader just compares
+// digests. The provider is only ever used by one thread at a time. Get() may be called from
+// several threads; the calls are serialized.
+class FuseBlockCache {
+ public:
+  using Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+  // Checks (and may record) the content of a block just read from the provider. The data is
+  // zero-padded to the full block size, and |digest| is the SHA-256 of all of it.
+  using Validator =
+      std::function<bool(uint32_t block, const uint8_t* data, const Digest& digest)>;
+
+  // The data of a block, shared with the cache. It stays valid after being evicted.
+  using BlockData = std::shared_ptr<const std::vector<uint8_t>>;
+
+  struct Stats {
+    size_t hits = 0;             // Served from the cache.
+    size_t prefetch_hits = 0;    // Served from a block prefetched in the background.
+    size_t misses = 0;           // Read from the provider on demand.
+    size_t prefetch_wasted = 0;  // Prefetched, but dropped (or still pending) without being read.
+  };
+
+  // Caches up to |capacity| blocks (at least two), and prefetches up to |prefetch_blocks| blocks
+  // ahead of a sequential reader; zero disables prefetching.
+  FuseBlockCache(FuseDataProvider* provider, size_t capacity, size_t prefetch_blocks,
+                 Validator validator);
+
+  // Stops the prefetch and hashing threads, waiting for the work in progress.
+  ~FuseBlockCache();
+
+  // Returns the data of |block|, or nullptr if it can't be read or doesn't pass the validator.
+  // Blocks past the end of the file read as zeroes.
+  BlockData Get(uint32_t block);
+
+  // Drops all the blocks, e.g. when the validator starts checking them differently.
+  void Clear();
+
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    uint32_t block;
+    BlockData data;
+  };
+
+  // A prefetched block, not validated yet.
+  struct PendingBlock {
+    std::vector<uint8_t> data;
+    Digest digest;
+    bool hashed = false;
+  };
+
+  // Reads |block| from the provider into |data|, padding the last partial block with zeroes. The
+  // provider is told about the |upcoming| blocks beforehand.
+  bool ReadBlock(uint32_t block, uint8_t* data, const std::vector<uint32_t>& upcoming = {});
+
+  // Queues the blocks following |block| for prefetching.
+  void SchedulePrefetch(uint32_t block);
+
+  void PrefetchThread();
+
+  void HashThread();
+
+  FuseDataProvider* provider_;
+  uint32_t block_size_;
+  uint32_t file_blocks_;
+  size_t capacity_;
+  size_t prefetch_blocks_;
+  Validator validator_;
+
+  BlockData zero_block_;
+
+  // Serializes Get() and Clear(), and guards the states below up to |mutex_|.
+  std::mutex reader_mutex_;
+
+  // The validated blocks, most recently used first.
+  std::list<Entry> lru_;
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> index_;
+
+  uint32_t last_block_;
+  size_t sequential_reads_ = 0;
+
+  // Guards the states below, which are shared with the prefetch and hashing threads.
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<uint32_t> prefetch_queue_;
+  std::map<uint32_t, std::shared_ptr<PendingBlock>> prefetched_;
+  std::deque<std::shared_ptr<PendingBlock>> hash_queue_;  // Prefetched, but not hashed yet.
+  uint32_t in_flight_;
+  bool stop_ = false;
+  Stats stats_;
+
+  // Serializes the reads from the provider.
+  std::mutex provider_mutex_;
+
+  std::thread prefetch_thread_;
+  std::vector<std::thread> hash_threads_;
+};
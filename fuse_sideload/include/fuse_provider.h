@@ -20,6 +20,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
@@ -44,6 +45,10 @@ class FuseDataProvider {
   virtual bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                                     uint32_t start_block) const = 0;
 
+  // Hints that |blocks| are going to be read soon, in that order. A provider that can have several
+  // reads in flight may start fetching them. Called from the same thread as ReadBlockAlignedData().
+  virtual void Prefetch(const std::vector<uint32_t>& /* blocks */) const {}
+
   virtual bool Valid() const = 0;
 
   virtual void Close() {}
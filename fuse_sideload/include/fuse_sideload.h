@@ -18,8 +18,10 @@
 #define __FUSE_SIDELOAD_H
 
 #include <memory>
+#include <vector>
 
 #include "fuse_provider.h"
+#include "otautil/verifier.h"
 
 // Define the filenames created by the sideload FUSE filesystem.
 static constexpr const char* FUSE_SIDELOAD_HOST_MOUNTPOINT = "/sideload";
@@ -27,8 +29,21 @@ static constexpr const char* FUSE_SIDELOAD_HOST_FILENAME = "package.zip";
 static constexpr const char* FUSE_SIDELOAD_HOST_PATHNAME = "/sideload/package.zip";
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_FLAG = "exit";
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_PATHNAME = "/sideload/exit";
+static constexpr const char* FUSE_SIDELOAD_HOST_VERIFIED_FLAG = "verified";
+static constexpr const char* FUSE_SIDELOAD_HOST_VERIFIED_PATHNAME = "/sideload/verified";
 
+// The default size in bytes of the cache for the blocks read from the provider.
+static constexpr size_t FUSE_SIDELOAD_DEFAULT_CACHE_SIZE = 8 * 1024 * 1024;
+
+// If |keys| is not empty and the package has a chunk manifest signed by one of them (see
+// verify_chunk_manifest()), every read of the signed part of the package is checked against the
+// manifest, and the FUSE_SIDELOAD_HOST_VERIFIED_FLAG file shows up next to the package.
+//
+// Up to |cache_size| bytes of the blocks read from the provider are cached, and the blocks ahead of
+// a sequential reader are prefetched in the background.
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      const std::vector<Certificate>& keys = {},
+                      size_t cache_size = FUSE_SIDELOAD_DEFAULT_CACHE_SIZE);
 
 #endif
@@ -140,7 +140,9 @@ static bool StartInstallPackageFuse(std::string_view path) {
     return false;
   }
 
-  return run_fuse_sideload(std::move(fuse_data_provider)) == 0;
+  // Let fuse_sideload check the package chunk by chunk if it has a signed chunk manifest.
+  std::vector<Certificate> keys = LoadKeysFromZipfile(CERTIFICATE_ZIP_FILE);
+  return run_fuse_sideload(std::move(fuse_data_provider), FUSE_SIDELOAD_HOST_MOUNTPOINT, keys) == 0;
 }
 
 InstallResult InstallWithFuseFromPath(std::string_view path, Device* device) {
@@ -222,7 +224,19 @@ InstallResult ApplyFromStorage(Device* device, VolumeInfo& vi) {
   ui->Print("\n-- Install %s ...\n", path.c_str());
   SetSdcardUpdateBootloaderMessage();
 
-  auto result = InstallWithFuseFromPath(path, device);
+  // A block map can be read straight from the block device, where that's permitted, without
+  // setting up the FUSE mount.
+  InstallResult result;
+  if (auto package =
+          path[0] == '@'
+              ? Package::CreateBlockMapPackage(
+                    path, std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1))
+              : nullptr;
+      package != nullptr) {
+    result = InstallPackage(package.get(), path, false, 0 /* retry_count */, device);
+  } else {
+    result = InstallWithFuseFromPath(path, device);
+  }
 
   VolumeManager::Instance()->volumeUnmount(vi.mId);
   return result;
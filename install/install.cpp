@@ -47,6 +47,7 @@
 #include <android-base/unique_fd.h>
 
 #include "bootloader_message/bootloader_message.h"
+#include "fuse_sideload.h"
 #include "install/snapshot_utils.h"
 #include "install/spl_check.h"
 #include "install/wipe_data.h"
@@ -752,7 +753,19 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
 }
 
 bool verify_package(Package* package, RecoveryUI* ui) {
-  static constexpr const char* CERTIFICATE_ZIP_FILE = "/system/etc/security/otacerts.zip";
+  // fuse_sideload checks every block of a package with a signed chunk manifest as it's read, so
+  // there's no need to hash the whole file up front. Only rely on that for A/B packages though: a
+  // tampered block fails the install midway, which must not leave the running system half-written.
+  if (package->GetPath() == FUSE_SIDELOAD_HOST_PATHNAME &&
+      access(FUSE_SIDELOAD_HOST_VERIFIED_PATHNAME, F_OK) == 0) {
+    std::map<std::string, std::string> metadata;
+    if (ReadMetadataFromPackage(package->GetZipArchiveHandle(), &metadata) &&
+        get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB)) {
+      ui->Print("Update package will be verified while installing.\n");
+      return true;
+    }
+  }
+
   std::vector<Certificate> loaded_keys = LoadKeysFromZipfile(CERTIFICATE_ZIP_FILE);
   if (loaded_keys.empty()) {
     LOG(ERROR) << "Failed to load keys";
@@ -763,7 +776,7 @@ bool verify_package(Package* package, RecoveryUI* ui) {
   // Verify package.
   ui->Print("Verifying update package...\n");
   auto t0 = std::chrono::system_clock::now();
-  int err = verify_file(package, loaded_keys);
+  int err = verify_file(package, loaded_keys, Paths::Get().verify_digest_cache());
   std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
   ui->Print("Update package verification took %.1f s (result %d).\n", duration.count(), err);
   if (err != VERIFY_SUCCESS) {
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "adb.h"
@@ -25,15 +26,105 @@
 
 bool FuseAdbDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                                                uint32_t start_block) const {
-  if (!WriteFdFmt(fd_, "%08u", start_block)) {
+  if (max_outstanding_ <= 1) {
+    if (!WriteFdFmt(fd_, "%08u", start_block)) {
+      fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+      return false;
+    }
+
+    if (!ReadFdExactly(fd_, buffer, fetch_size)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+      return false;
+    }
+
+    return true;
+  }
+
+  if (received_.count(start_block) == 0 && outstanding_.count(start_block) == 0) {
+    // Make room for the request if needed.
+    while (outstanding_.size() >= max_outstanding_) {
+      if (!ReceiveBlock()) {
+        return false;
+      }
+    }
+    if (!RequestBlock(start_block)) {
+      return false;
+    }
+  }
+  while (received_.count(start_block) == 0) {
+    if (!ReceiveBlock()) {
+      return false;
+    }
+  }
+
+  auto it = received_.find(start_block);
+  if (it->second.size() != fetch_size) {
+    fprintf(stderr, "unexpected fetch size %u for block %u\n", fetch_size, start_block);
+    return false;
+  }
+  memcpy(buffer, it->second.data(), fetch_size);
+  received_.erase(it);
+  return true;
+}
+
+void FuseAdbDataProvider::Prefetch(const std::vector<uint32_t>& blocks) const {
+  if (max_outstanding_ <= 1) {
+    return;
+  }
+  for (uint32_t block : blocks) {
+    if (outstanding_.size() >= max_outstanding_) {
+      break;
+    }
+    if (received_.count(block) != 0 || outstanding_.count(block) != 0) {
+      continue;
+    }
+    // Failures show up when the block is read.
+    if (!RequestBlock(block)) {
+      break;
+    }
+  }
+}
+
+bool FuseAdbDataProvider::RequestBlock(uint32_t block) const {
+  if (static_cast<uint64_t>(block) * fuse_block_size_ >= file_size_) {
+    fprintf(stderr, "block %u is past the end of the file\n", block);
+    return false;
+  }
+  if (!WriteFdFmt(fd_, "%08u", block)) {
     fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
     return false;
   }
+  outstanding_.insert(block);
+  return true;
+}
 
-  if (!ReadFdExactly(fd_, buffer, fetch_size)) {
+bool FuseAdbDataProvider::ReceiveBlock() const {
+  char header[9] = {};
+  if (!ReadFdExactly(fd_, header, 8)) {
+    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+    return false;
+  }
+  char* end;
+  unsigned long block = strtoul(header, &end, 10);
+  if (end != header + 8 || outstanding_.erase(block) == 0) {
+    fprintf(stderr, "unexpected reply from adb host: %s\n", header);
+    return false;
+  }
+
+  // The last block of the file is short.
+  uint64_t offset = static_cast<uint64_t>(block) * fuse_block_size_;
+  uint32_t fetch_size = std::min<uint64_t>(fuse_block_size_, file_size_ - offset);
+  std::vector<uint8_t> data(fetch_size);
+  if (!ReadFdExactly(fd_, data.data(), fetch_size)) {
     fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
     return false;
   }
 
+  // Blocks that were prefetched but never read (e.g. the reader jumped elsewhere) are dropped once
+  // there are too many; they'll be requested again if needed.
+  if (received_.size() >= max_outstanding_) {
+    received_.erase(received_.begin());
+  }
+  received_.emplace(block, std::move(data));
   return true;
 }
@@ -18,22 +18,55 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
 #include "fuse_provider.h"
 
 // This class reads data from adb server.
+//
+// In the original protocol, the device writes the block number as 8 decimal digits, and the host
+// replies with the block data; one block is in flight at a time. A host that has seen the
+// kMinadbdFeatureSideloadPipelined feature may append a third field to the sideload-host arguments
+// ("<file-size>:<block-size>:<max-outstanding>") to accept up to <max-outstanding> block requests
+// in flight. It may reply to them in any order, and prefixes each reply with the block number as 8
+// decimal digits.
 class FuseAdbDataProvider : public FuseDataProvider {
  public:
-  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size)
-      : FuseDataProvider(file_size, block_size), fd_(fd) {}
+  // The max number of block requests kept in flight, whatever the host accepts.
+  static constexpr uint32_t kMaxOutstandingRequests = 32;
+
+  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size,
+                      uint32_t max_outstanding = 1)
+      : FuseDataProvider(file_size, block_size),
+        fd_(fd),
+        max_outstanding_(std::min(max_outstanding, kMaxOutstandingRequests)) {}
 
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                             uint32_t start_block) const override;
 
+  void Prefetch(const std::vector<uint32_t>& blocks) const override;
+
   bool Valid() const override {
     return fd_ != -1;
   }
 
  private:
+  // Sends the request for |block| in the pipelined protocol.
+  bool RequestBlock(uint32_t block) const;
+
+  // Receives the reply to any of the outstanding requests into |received_|.
+  bool ReceiveBlock() const;
+
   // The underlying source to read data from (i.e. the one that talks to the host).
   int fd_;
+
+  // The number of block requests the host accepts in flight. One means the original protocol.
+  uint32_t max_outstanding_;
+  // The blocks requested from the host, but not received yet.
+  mutable std::set<uint32_t> outstanding_;
+  // The blocks received from the host, but not read yet.
+  mutable std::map<uint32_t, std::vector<uint8_t>> received_;
 };
@@ -83,3 +83,63 @@ TEST(fuse_adb_provider, read_block_adb_fail_write) {
   char buf[1];
   ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buf), 1, 0));
 }
+
+TEST(fuse_adb_provider, read_block_adb_pipelined) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  // Three blocks, with a short last one.
+  constexpr uint32_t kBlockSize = 4096;
+  FuseAdbDataProvider data(device_socket, kBlockSize * 3 - 100, kBlockSize, 4);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // Reply out of order, each reply tagged with the block number.
+  const std::string block0(kBlockSize, 'a');
+  const std::string block1(kBlockSize, 'b');
+  const std::string block2(kBlockSize - 100, 'c');
+  std::string replies = "00000002" + block2 + "00000000" + block0 + "00000001" + block1;
+  ASSERT_TRUE(WriteFdExactly(host_socket, replies.data(), replies.size()));
+
+  // All the requests go out before waiting for any reply.
+  data.Prefetch({ 0, 1, 2 });
+
+  std::string buffer(kBlockSize, '\0');
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buffer.data()), kBlockSize, 0));
+  ASSERT_EQ(block0, buffer);
+
+  buffer.resize(block2.size());
+  ASSERT_TRUE(
+      data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buffer.data()), block2.size(), 2));
+  ASSERT_EQ(block2, buffer);
+
+  buffer.resize(kBlockSize);
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buffer.data()), kBlockSize, 1));
+  ASSERT_EQ(block1, buffer);
+
+  char requests[25] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, requests, 24));
+  ASSERT_STREQ("000000000000000100000002", requests);
+
+  // Check that nothing else was written to the socket.
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_pipelined_unexpected_reply) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(device_socket, 4096 * 3, 4096, 4);
+
+  // A reply to a block that hasn't been requested.
+  std::string reply = "00000001" + std::string(4096, 'b');
+  ASSERT_TRUE(WriteFdExactly(host_socket, reply.data(), reply.size()));
+
+  std::string buffer(4096, '\0');
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buffer.data()), 4096, 0));
+}
@@ -24,6 +24,12 @@ constexpr size_t kMinadbdMessageSize = 8;
 constexpr char const kMinadbdCommandPrefix[] = "COMD";
 constexpr char const kMinadbdStatusPrefix[] = "STAT";
 
+// The features of the sideload services, as listed by the sideload-features service. Hosts check
+// them before using an extension; older devices don't have the service at all. With
+// "sideload_pipelined", sideload-host takes the max number of outstanding block requests as a third
+// argument (see FuseAdbDataProvider).
+constexpr char const kMinadbdFeatureSideloadPipelined[] = "sideload_pipelined";
+
 enum MinadbdErrorCode : int {
   kMinadbdSuccess = 0,
   kMinadbdArgumentsParsingError = 1,
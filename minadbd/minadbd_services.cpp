@@ -102,20 +102,32 @@ static MinadbdErrorCode RunAdbFuseSideload(int sfd, const std::string& args,
   auto pieces = android::base::Split(args, ":");
   int64_t file_size;
   int block_size;
-  if (pieces.size() != 2 || !android::base::ParseInt(pieces[0], &file_size) || file_size <= 0 ||
-      !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0) {
+  // Hosts that see kMinadbdFeatureSideloadPipelined pass the number of block requests they accept
+  // in flight as the third argument. Older devices exit on it as an argument error, so hosts must
+  // not send it without checking the feature first.
+  uint32_t max_outstanding = 1;
+  if ((pieces.size() != 2 && pieces.size() != 3) ||
+      !android::base::ParseInt(pieces[0], &file_size) || file_size <= 0 ||
+      !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0 ||
+      (pieces.size() == 3 &&
+       (!android::base::ParseUint(pieces[2], &max_outstanding) || max_outstanding == 0))) {
     LOG(ERROR) << "bad sideload-host arguments: " << args;
     return kMinadbdHostCommandArgumentError;
   }
 
-  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size;
+  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size
+            << ", max outstanding requests " << max_outstanding;
 
   if (!WriteCommandToFd(MinadbdCommand::kInstall, minadbd_socket)) {
     return kMinadbdSocketIOError;
   }
 
-  auto adb_data_reader = std::make_unique<FuseAdbDataProvider>(sfd, file_size, block_size);
-  if (int result = run_fuse_sideload(std::move(adb_data_reader), sideload_mount_point.c_str());
+  // Let fuse_sideload check the package chunk by chunk if it has a signed chunk manifest.
+  std::vector<Certificate> keys = LoadKeysFromZipfile(CERTIFICATE_ZIP_FILE);
+  auto adb_data_reader =
+      std::make_unique<FuseAdbDataProvider>(sfd, file_size, block_size, max_outstanding);
+  if (int result =
+          run_fuse_sideload(std::move(adb_data_reader), sideload_mount_point.c_str(), keys);
       result != 0) {
     LOG(ERROR) << "Failed to start fuse";
     return kMinadbdFuseStartError;
@@ -187,6 +199,15 @@ static void SideloadHostService(unique_fd sfd, const std::string& args) {
   exit(error);
 }
 
+// Lists the features of the sideload services, comma-separated and newline-terminated, so that the
+// host can check them before using a protocol extension.
+static void SideloadFeaturesHostService(unique_fd sfd) {
+  std::string features = std::string(kMinadbdFeatureSideloadPipelined) + "\n";
+  if (!android::base::WriteFully(sfd, features.data(), features.size())) {
+    exit(kMinadbdHostSocketIOError);
+  }
+}
+
 // Rescue service waits for the next command after an install command.
 static void RescueInstallHostService(unique_fd sfd, const std::string& args) {
   MinadbdCommandStatus status;
@@ -350,10 +371,12 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
     // (that supports sideload-host).
     exit(kMinadbdAdbVersionError);
   } else if (android::base::ConsumePrefix(&name, "sideload-host:")) {
-    // sideload-host:<file-size>:<block-size>
+    // sideload-host:<file-size>:<block-size>[:<max-outstanding-requests>]
     std::string args(name);
     return create_service_thread("sideload-host",
                                  std::bind(SideloadHostService, std::placeholders::_1, args));
+  } else if (name == "sideload-features") {
+    return create_service_thread("sideload-features", SideloadFeaturesHostService);
   }
   return unique_fd{};
 }
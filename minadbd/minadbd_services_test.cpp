@@ -125,6 +125,19 @@ TEST_F(MinadbdServicesTest, SideloadHostService_wrong_size_argument) {
               ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
 }
 
+TEST_F(MinadbdServicesTest, SideloadHostService_zero_max_outstanding) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:0"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
+TEST_F(MinadbdServicesTest, SideloadFeaturesHostService) {
+  unique_fd fd = daemon_service_to_fd("sideload-features", nullptr);
+  ASSERT_NE(-1, fd);
+  std::string features;
+  ASSERT_TRUE(android::base::ReadFdToString(fd, &features));
+  ASSERT_EQ(std::string(kMinadbdFeatureSideloadPipelined) + "\n", features);
+}
+
 TEST_F(MinadbdServicesTest, SideloadHostService_wrong_block_size) {
   ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:10:20"),
               ::testing::ExitedWithCode(kMinadbdFuseStartError), "");
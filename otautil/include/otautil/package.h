@@ -22,6 +22,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <ziparchive/zip_archive.h>
@@ -31,6 +32,15 @@
 enum class PackageType {
   kMemory,
   kFile,
+  kBlockMap,
+};
+
+// Hints on how a byte range of the package is about to be accessed.
+enum class PackageAccess {
+  kNormal,      // No particular pattern; restores the default read-ahead.
+  kSequential,  // Read once from start to end, e.g. the hash pass of verification.
+  kWillNeed,    // Read soon, e.g. a zip entry that is about to be extracted.
+  kDontNeed,    // Already consumed; the cached pages may be reclaimed first.
 };
 
 // This class serves as a wrapper for an OTA update package. It aims to provide the common
@@ -43,6 +53,11 @@ class Package : public VerifierInterface {
       std::vector<uint8_t> content, const std::function<void(float)>& set_progress);
   static std::unique_ptr<Package> CreateFilePackage(const std::string& path,
                                                     const std::function<void(float)>& set_progress);
+  // Creates a package from a block map path (e.g. "@/cache/recovery/block.map"), whose data is
+  // read with pread(2) straight from the block device. Returns nullptr if the path isn't a block
+  // map, or the blocks can't be accessed directly (e.g. not permitted by the SELinux policy).
+  static std::unique_ptr<Package> CreateBlockMapPackage(
+      const std::string& path, const std::function<void(float)>& set_progress);
 
   virtual ~Package() = default;
 
@@ -53,6 +68,14 @@ class Package : public VerifierInterface {
   // Opens the package as a zip file and returns the ZipArchiveHandle.
   virtual ZipArchiveHandle GetZipArchiveHandle() = 0;
 
+  // Passes the access hint for |length| bytes at |offset| down to the page cache. Hints are
+  // advisory only: failures are logged and otherwise ignored.
+  virtual void Advise(uint64_t offset, uint64_t length, PackageAccess access) = 0;
+
+  // Passes the access hint for the (compressed) data of the zip entry |name|. Returns false if the
+  // package can't be opened as a zip file, or the entry doesn't exist.
+  bool AdviseEntry(std::string_view name, PackageAccess access);
+
   // Updates the progress in fraction during package verification.
   void SetProgress(float progress) override;
 
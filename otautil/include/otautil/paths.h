@@ -83,6 +83,13 @@ class Paths {
     temporary_update_binary_ = update_binary;
   }
 
+  std::string verify_digest_cache() const {
+    return verify_digest_cache_;
+  }
+  void set_verify_digest_cache(const std::string& digest_cache) {
+    verify_digest_cache_ = digest_cache;
+  }
+
  private:
   Paths();
   DISALLOW_COPY_AND_ASSIGN(Paths);
@@ -113,6 +120,10 @@ class Paths {
 
   // Path to the temporary update binary while installing a non-A/B package.
   std::string temporary_update_binary_;
+
+  // Path to the cache of the package digest from the last successful verification. It lives on
+  // /cache so that it survives a reboot; verify_file() ignores it unless it's private to recovery.
+  std::string verify_digest_cache_;
 };
 
 #endif  // _OTAUTIL_PATHS_H_
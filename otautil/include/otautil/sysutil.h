@@ -18,8 +18,11 @@
 
 #include <sys/types.h>
 
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include "rangeset.h"
@@ -38,8 +41,27 @@ class BlockMapData {
   //
   // Each block range represents a half-open interval; the line "30 33" reprents the blocks
   // [30, 31, 32].
+  //
+  // The same data may also come in the binary format written by EncodeBinary(). uncrypt can write
+  // that as a separate file, with kBinarySuffix appended to the path of the text one; it's read
+  // instead of the text one if present and valid. Readers that predate the binary format, e.g. the
+  // updaters of older packages, keep reading the text one.
   static BlockMapData ParseBlockMapFile(const std::string& block_map_path);
 
+  // The suffix of the binary block map next to the text one.
+  static constexpr const char* kBinarySuffix = ".bin";
+
+  // Returns the binary block map, which is much smaller and faster to parse than the text one for
+  // a fragmented file. All integers are little-endian:
+  //
+  //   "BMAP" | version (4) | file size (8) | block size (4) | range count (4) |
+  //   block device path length (4) | block device path | ranges | CRC-32 of all the above (4)
+  //
+  // Each range is a varint of its start minus the end of the previous range (zigzag-encoded, as
+  // it may be negative), followed by a varint of its length in blocks.
+  static std::string EncodeBinary(const std::string& block_dev, uint64_t file_size,
+                                  uint32_t block_size, const RangeSet& ranges);
+
   explicit operator bool() const {
     return !path_.empty();
   }
@@ -60,6 +82,9 @@ class BlockMapData {
  private:
   BlockMapData() = default;
 
+  // Parses the block map in |block_map_path|, in either format.
+  static BlockMapData ParseFile(const std::string& block_map_path);
+
   BlockMapData(const std::string& path, uint64_t file_size, uint32_t block_size,
                RangeSet block_ranges)
       : path_(path),
@@ -79,13 +104,26 @@ class BlockMapData {
 class MemMapping {
  public:
   ~MemMapping();
+  // How far the prefault thread may get ahead of the reader.
+  static constexpr uint64_t kPrefaultWindow = 32 * 1024 * 1024;
+
   // Map a file into a private, read-only memory segment. If 'filename' begins with an '@'
   // character, it is a map of blocks to be mapped, otherwise it is treated as an ordinary file.
-  bool MapFile(const std::string& filename);
+  // If 'prefault' is true, a background thread faults the pages in from start to end, so that a
+  // sequential reader (e.g. the hash pass of package verification) mostly finds them mapped. The
+  // thread stays within kPrefaultWindow bytes of the position given to SetReadPosition().
+  bool MapFile(const std::string& filename, bool prefault = false);
+
+  // Tells the prefault thread that the sequential reader has consumed the data up to |offset|.
+  void SetReadPosition(uint64_t offset);
   size_t ranges() const {
     return ranges_.size();
   };
 
+  // Passes the madvise(2) |advice| for |length| bytes at |offset| of the mapped data. The range is
+  // clamped to the mapping and widened to page boundaries. Returns false if madvise fails.
+  bool Advise(uint64_t offset, uint64_t length, int advice) const;
+
   unsigned char* addr;  // start of data
   size_t length;        // length of data
 
@@ -98,7 +136,16 @@ class MemMapping {
   bool MapBlockFile(const std::string& filename);
   bool MapFD(int fd);
 
+  void StartPrefault();
+  void StopPrefault();
+
   std::vector<MappedRange> ranges_;
+
+  std::thread prefault_thread_;
+  std::mutex prefault_mutex_;
+  std::condition_variable prefault_cv_;
+  uint64_t read_position_ = 0;  // Guarded by |prefault_mutex_|, as is |stop_prefault_|.
+  bool stop_prefault_ = false;
 };
 
 // Reboots the device into the specified target, by additionally handling quiescent reboot mode.
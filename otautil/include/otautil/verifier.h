@@ -18,8 +18,10 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <openssl/ec_key.h>
@@ -28,7 +30,11 @@
 
 constexpr size_t MiB = 1024 * 1024;
 
+// The zip file that holds the certificates of the keys that can sign an OTA package.
+constexpr const char* CERTIFICATE_ZIP_FILE = "/system/etc/security/otacerts.zip";
+
 using HasherUpdateCallback = std::function<void(const uint8_t* addr, uint64_t size)>;
+using HashProgressCallback = std::function<void(uint64_t bytes_hashed)>;
 
 struct RSADeleter {
   void operator()(RSA* rsa) const {
@@ -69,9 +75,11 @@ class VerifierInterface {
   // Reads |byte_count| data starting from |offset|, and puts the result in |buffer|.
   virtual bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) = 0;
 
-  // Updates the hash contexts for |length| bytes data starting from |start|.
+  // Updates the hash contexts for |length| bytes data starting from |start|. Each hasher sees the
+  // data in order, but different hashers may be called concurrently from different threads. If
+  // set, |on_progress| is called on the calling thread with the number of bytes hashed so far.
   virtual bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                                  uint64_t length) = 0;
+                                  uint64_t length, const HashProgressCallback& on_progress) = 0;
 
   // Updates the progress in fraction during package verification.
   virtual void SetProgress(float progress) = 0;
@@ -80,7 +88,41 @@ class VerifierInterface {
 //  Looks for an RSA signature embedded in the .ZIP file comment given the path to the zip.
 //  Verifies that it matches one of the given public keys. Returns VERIFY_SUCCESS or
 //  VERIFY_FAILURE (if any error is encountered or no key matches the signature).
-int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys);
+//  If |digest_cache| is not empty, the digest and the matching key of a successfully verified
+//  package are saved to that file, together with a fingerprint of the package. A later
+//  verification of a package with the same fingerprint checks the signature against the cached
+//  digest instead of hashing the whole file. The cache file is only trusted if it's owned by us and
+//  not accessible to anyone else.
+int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys,
+                const std::string& digest_cache = "");
+
+// Per-chunk SHA-256 hashes of the signed part of a package, from the chunk manifest. Lets the
+// package be verified chunk by chunk as it's read, instead of hashing the whole file up front.
+struct ChunkManifest {
+  uint32_t chunk_size;
+  // The length of the data covered by the whole-file signature, i.e. everything but the archive
+  // comment and its length field. The last chunk may be shorter than |chunk_size|.
+  uint64_t signed_len;
+  // The offset of the chunk hashes in the package. They are the data of a stored (uncompressed)
+  // zip entry, "META-INF/com/android/chunk_hashes", so they are part of the signed data
+  // themselves; those bytes are hashed as zeroes.
+  uint64_t hashes_offset;
+  std::vector<std::array<uint8_t, SHA256_DIGEST_LENGTH>> hashes;
+};
+
+// Looks for a chunk manifest ahead of the whole-file signature in the archive comment, and
+// verifies its signature against the SHA-256 keys among |keys|. The signed part of the manifest
+// holds the SHA-256 of the chunk hashes, which are then read from the package and checked against
+// it. The footer and EOCD record get the same checks as in verify_file(). Returns VERIFY_SUCCESS
+// and fills in |manifest|, or VERIFY_FAILURE (including when the package has no chunk manifest).
+// Note that the chunks themselves are not checked here; that's up to whoever serves the package
+// data, with CheckChunk().
+int verify_chunk_manifest(VerifierInterface* package, const std::vector<Certificate>& keys,
+                          ChunkManifest* manifest);
+
+// Checks |data|, the content of chunk |index| of the package, against |manifest|. Any bytes of the
+// chunk hashes within the chunk must match |manifest.hashes|.
+bool CheckChunk(const ChunkManifest& manifest, size_t index, const uint8_t* data);
 
 // Checks that the RSA key has a modulus of 2048 or 4096 bits long, and public exponent is 3 or
 // 65537.
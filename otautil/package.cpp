@@ -16,17 +16,120 @@
 
 #include "otautil/package.h"
 
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 
 #include "otautil/error_code.h"
 #include "otautil/sysutil.h"
 
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+// The size of each read when hashing a FilePackage. Two buffers of this size are kept, so that
+// the next read overlaps with hashing the current one.
+static constexpr uint64_t kHashReadSize = 4 * MiB;
+
+// Feeds the data to all the hashers. The hash contexts are independent of each other, so when
+// there are several of them (e.g. SHA-1 and SHA-256), the first one runs on the calling thread and
+// the others on a single helper thread, which lives as long as this object, i.e. for the whole
+// range being hashed.
+class HasherPipeline {
+ public:
+  explicit HasherPipeline(const std::vector<HasherUpdateCallback>& hashers) : hashers_(hashers) {
+    if (hashers_.size() > 1) {
+      thread_ = std::thread(&HasherPipeline::Run, this);
+    }
+  }
+
+  ~HasherPipeline() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exit_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+    }
+  }
+
+  // Feeds |size| bytes at |data| to all the hashers, and returns once they're done with it.
+  void Update(const uint8_t* data, uint64_t size) {
+    if (hashers_.empty()) {
+      return;
+    }
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_ = data;
+        size_ = size;
+        pending_ = true;
+      }
+      cv_.notify_all();
+    }
+    hashers_[0](data, size);
+    if (thread_.joinable()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return !pending_; });
+    }
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return pending_ || exit_; });
+      if (!pending_) {
+        return;
+      }
+      lock.unlock();
+      for (size_t i = 1; i < hashers_.size(); i++) {
+        hashers_[i](data_, size_);
+      }
+      lock.lock();
+      pending_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  const std::vector<HasherUpdateCallback>& hashers_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  const uint8_t* data_ = nullptr;  // The data for the helper thread, while |pending_| is set.
+  uint64_t size_ = 0;
+  bool pending_ = false;
+  bool exit_ = false;
+
+  std::thread thread_;
+};
+
+// Returns whether hashing |length| bytes would sweep enough of the page cache to evict recovery's
+// own working set. If so, the hashed regions are dropped as soon as they are consumed; otherwise
+// they are kept, since the installer reads the package again right after verification.
+static bool ShouldDropHashedRegions(uint64_t length) {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) {
+    return false;
+  }
+  return length > static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size) / 4;
+}
+
 // This class wraps the package in memory, i.e. a memory mapped package, or a package loaded
 // to a string/vector.
 class MemoryPackage : public Package {
@@ -59,7 +162,9 @@ class MemoryPackage : public Package {
   ZipArchiveHandle GetZipArchiveHandle() override;
 
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                          uint64_t length) override;
+                          uint64_t length, const HashProgressCallback& on_progress) override;
+
+  void Advise(uint64_t offset, uint64_t length, PackageAccess access) override;
 
  private:
   const uint8_t* addr_;    // Start address of the package in memory.
@@ -72,11 +177,26 @@ class MemoryPackage : public Package {
   std::vector<uint8_t> package_content_;
   // The physical path to the package, empty if we create the class with the package content.
   std::string path_;
+  // Cleared once MADV_PAGEOUT fails, e.g. on a kernel that doesn't have it.
+  bool pageout_supported_ = true;
 
   // The ZipArchiveHandle of the package.
   ZipArchiveHandle zip_handle_;
 };
 
+bool Package::AdviseEntry(std::string_view name, PackageAccess access) {
+  ZipArchiveHandle zip = GetZipArchiveHandle();
+  if (!zip) {
+    return false;
+  }
+  ZipEntry64 entry;
+  if (FindEntry(zip, name, &entry) != 0) {
+    return false;
+  }
+  Advise(entry.offset, entry.compressed_length, access);
+  return true;
+}
+
 void Package::SetProgress(float progress) {
   if (set_progress_) {
     set_progress_(progress);
@@ -107,20 +227,83 @@ class FilePackage : public Package {
   ZipArchiveHandle GetZipArchiveHandle() override;
 
   bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
-                          uint64_t length) override;
+                          uint64_t length, const HashProgressCallback& on_progress) override;
 
- private:
+  void Advise(uint64_t offset, uint64_t length, PackageAccess access) override;
+
+ protected:
   android::base::unique_fd fd_;  // The underlying fd to the open package.
   uint64_t package_size_;
   std::string path_;  // The physical path to the package.
 
+ private:
+  // The read buffers for UpdateHashAtOffset(), reused across calls.
+  std::array<std::vector<uint8_t>, 2> hash_buffers_;
+
+  ZipArchiveHandle zip_handle_;
+};
+
+// A block map package, read from the raw blocks on the device that uncrypt listed in the block
+// map. The reads go straight to the block device, one pread(2) per run of consecutive blocks,
+// instead of through the /sideload FUSE mount. Hashing reuses the double-buffered reads of
+// FilePackage, with |fd_| being the block device.
+class BlockMapPackage : public FilePackage {
+ public:
+  BlockMapPackage(android::base::unique_fd&& fd, const BlockMapData& block_map,
+                  const std::string& path, const std::function<void(float)>& set_progress);
+
+  ~BlockMapPackage() override;
+
+  PackageType GetType() const override {
+    return PackageType::kBlockMap;
+  }
+
+  bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) override;
+
+  ZipArchiveHandle GetZipArchiveHandle() override;
+
+  void Advise(uint64_t offset, uint64_t length, PackageAccess access) override;
+
+ private:
+  // A run of consecutive package blocks that are also consecutive on the block device.
+  struct Extent {
+    uint64_t offset;         // Offset in the package.
+    uint64_t device_offset;  // Offset on the block device.
+    uint64_t length;
+  };
+
+  // Calls |fn|(device_offset, package_offset, length) for each piece of |length| bytes at |offset|
+  // of the package, as laid out on the block device. Stops and returns false once |fn| does.
+  template <typename Fn>
+  bool ForEachDeviceRange(uint64_t offset, uint64_t length, Fn fn) const;
+
+  // Reads |length| bytes at |offset| of the package into the same offset of |zip_data_|.
+  bool LoadZipRange(uint64_t offset, uint64_t length);
+
+  // Maps the pages of |zip_data_| that hold |length| bytes at |offset| of the package onto the
+  // block device, so that they are read in on demand, the first time they are touched.
+  bool MapZipRange(uint64_t offset, uint64_t length);
+
+  // Loads the zip records of the package into |zip_data_|: the end of central directory, the
+  // central directory, the local file headers, and the data of the smaller entries. The data of
+  // the other entries is mapped with MapZipRange().
+  bool LoadZipData();
+
+  std::vector<Extent> extents_;  // Sorted by |offset|, covering the whole package.
+
+  // libziparchive only reads an archive from a file or from memory, so the zip handle is opened on
+  // an anonymous mapping of the package size. LoadZipData() reads the zip records and the smaller
+  // entries into it up front, and maps the larger entries onto the block device; the data in
+  // between (e.g. the APK signing block) is never touched, and reads as zeroes.
+  uint8_t* zip_data_ = nullptr;
   ZipArchiveHandle zip_handle_;
 };
 
 std::unique_ptr<Package> Package::CreateMemoryPackage(
     const std::string& path, const std::function<void(float)>& set_progress) {
   std::unique_ptr<MemMapping> mmap = std::make_unique<MemMapping>();
-  if (!mmap->MapFile(path)) {
+  // Verification reads the whole package right away; fault it in just ahead of the hash pass.
+  if (!mmap->MapFile(path, true)) {
     LOG(ERROR) << "failed to map file";
     return nullptr;
   }
@@ -145,6 +328,33 @@ std::unique_ptr<Package> Package::CreateFilePackage(
   return std::make_unique<FilePackage>(std::move(fd), file_size, path, set_progress);
 }
 
+std::unique_ptr<Package> Package::CreateBlockMapPackage(
+    const std::string& path, const std::function<void(float)>& set_progress) {
+  if (path.empty() || path[0] != '@') {
+    LOG(ERROR) << path << " is not a block map";
+    return nullptr;
+  }
+
+  auto block_map = BlockMapData::ParseBlockMapFile(path.substr(1));
+  if (!block_map) {
+    return nullptr;
+  }
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_map.path().c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << block_map.path();
+    return nullptr;
+  }
+
+  auto package = std::make_unique<BlockMapPackage>(std::move(fd), block_map, path, set_progress);
+  // Open the zip archive up front, so that a package that can't be read is rejected here (and may
+  // be read some other way), rather than midway through the installation.
+  if (!package->GetZipArchiveHandle()) {
+    return nullptr;
+  }
+  return package;
+}
+
 std::unique_ptr<Package> Package::CreateMemoryPackage(
     std::vector<uint8_t> content, const std::function<void(float)>& set_progress) {
   return std::make_unique<MemoryPackage>(std::move(content), set_progress);
@@ -184,19 +394,56 @@ bool MemoryPackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint
 }
 
 bool MemoryPackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers,
-                                       uint64_t start, uint64_t length) {
+                                       uint64_t start, uint64_t length,
+                                       const HashProgressCallback& on_progress) {
   if (length > package_size_ || start > package_size_ - length) {
     LOG(ERROR) << "Out of bound read, offset: " << start << ", size: " << length
                << ", total package_size: " << package_size_;
     return false;
   }
 
-  for (const auto& hasher : hashers) {
-    hasher(addr_ + start, length);
+  Advise(start, length, PackageAccess::kSequential);
+  bool drop_hashed = ShouldDropHashedRegions(length);
+  HasherPipeline pipeline(hashers);
+  for (uint64_t so_far = 0; so_far < length;) {
+    uint64_t hash_size = std::min<uint64_t>(length - so_far, kHashReadSize);
+    pipeline.Update(addr_ + start + so_far, hash_size);
+    if (drop_hashed) {
+      Advise(start + so_far, hash_size, PackageAccess::kDontNeed);
+    }
+    so_far += hash_size;
+    if (map_) {
+      map_->SetReadPosition(start + so_far);
+    }
+    if (on_progress) {
+      on_progress(so_far);
+    }
   }
+  Advise(start, length, PackageAccess::kNormal);
   return true;
 }
 
+void MemoryPackage::Advise(uint64_t offset, uint64_t length, PackageAccess access) {
+  // Nothing to hint for a package that's loaded into memory as a whole.
+  if (!map_) {
+    return;
+  }
+  // The mapping is private and read-only, so MADV_DONTNEED would only unmap the pages and leave
+  // them in the page cache. MADV_PAGEOUT (Linux 5.4) reclaims them as well; on older kernels,
+  // unmapping them is the best we can do.
+  if (access == PackageAccess::kDontNeed) {
+    if (pageout_supported_ && !map_->Advise(offset, length, MADV_PAGEOUT)) {
+      pageout_supported_ = false;
+    }
+    if (!pageout_supported_) {
+      map_->Advise(offset, length, MADV_DONTNEED);
+    }
+    return;
+  }
+  static constexpr int kAdvice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_WILLNEED };
+  map_->Advise(offset, length, kAdvice[static_cast<int>(access)]);
+}
+
 ZipArchiveHandle MemoryPackage::GetZipArchiveHandle() {
   if (zip_handle_) {
     return zip_handle_;
@@ -240,37 +487,427 @@ bool FilePackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64
 }
 
 bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers,
-                                     uint64_t start, uint64_t length) {
+                                     uint64_t start, uint64_t length,
+                                     const HashProgressCallback& on_progress) {
   if (length > package_size_ || start > package_size_ - length) {
     LOG(ERROR) << "Out of bound read, offset: " << start << ", size: " << length
                << ", total package_size: " << package_size_;
     return false;
   }
 
-  uint64_t so_far = 0;
-  while (so_far < length) {
-    uint64_t read_size = std::min<uint64_t>(length - so_far, 16 * MiB);
-    std::vector<uint8_t> buffer(read_size);
-    if (!ReadFullyAtOffset(buffer.data(), read_size, start + so_far)) {
+  if (length == 0) {
+    return true;
+  }
+
+  Advise(start, length, PackageAccess::kSequential);
+  bool drop_hashed = ShouldDropHashedRegions(length);
+
+  // Double-buffered: a reader thread fills the buffers in turn, while the hashers consume the
+  // other one. Both threads live for the whole range.
+  uint64_t num_chunks = (length + kHashReadSize - 1) / kHashReadSize;
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t chunks_read = 0;
+  uint64_t chunks_hashed = 0;
+  bool read_failed = false;
+  bool stop = false;
+
+  std::thread reader([&] {
+    for (uint64_t n = 0; n < num_chunks; n++) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return stop || n < chunks_hashed + hash_buffers_.size(); });
+        if (stop) {
+          return;
+        }
+      }
+      uint64_t offset = n * kHashReadSize;
+      uint64_t read_size = std::min<uint64_t>(length - offset, kHashReadSize);
+      auto& buffer = hash_buffers_[n % hash_buffers_.size()];
+      if (buffer.size() < read_size) {
+        buffer.resize(read_size);
+      }
+      bool success = ReadFullyAtOffset(buffer.data(), read_size, start + offset);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (success) {
+          chunks_read = n + 1;
+        } else {
+          read_failed = true;
+        }
+      }
+      cv.notify_all();
+      if (!success) {
+        return;
+      }
+    }
+  });
+
+  HasherPipeline pipeline(hashers);
+  bool success = true;
+  for (uint64_t n = 0; n < num_chunks; n++) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return read_failed || n < chunks_read; });
+      if (n >= chunks_read) {
+        success = false;
+        break;
+      }
+    }
+    uint64_t offset = n * kHashReadSize;
+    uint64_t read_size = std::min<uint64_t>(length - offset, kHashReadSize);
+    pipeline.Update(hash_buffers_[n % hash_buffers_.size()].data(), read_size);
+    if (drop_hashed) {
+      Advise(start + offset, read_size, PackageAccess::kDontNeed);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      chunks_hashed = n + 1;
+    }
+    cv.notify_all();
+    if (on_progress) {
+      on_progress(offset + read_size);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  reader.join();
+
+  Advise(start, length, PackageAccess::kNormal);
+  return success;
+}
+
+void FilePackage::Advise(uint64_t offset, uint64_t length, PackageAccess access) {
+  // A zero length would apply the hint to the rest of the file.
+  if (length == 0) {
+    return;
+  }
+  static constexpr int kAdvice[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED,
+                                     POSIX_FADV_DONTNEED };
+  if (int err = posix_fadvise64(fd_.get(), offset, length, kAdvice[static_cast<int>(access)]);
+      err != 0) {
+    LOG(WARNING) << "posix_fadvise(" << offset << ", " << length << ") failed: " << strerror(err);
+  }
+}
+
+ZipArchiveHandle FilePackage::GetZipArchiveHandle() {
+  if (zip_handle_) {
+    return zip_handle_;
+  }
+
+  if (auto err = OpenArchiveFd(fd_.get(), path_.c_str(), &zip_handle_, false); err != 0) {
+    LOG(ERROR) << "Can't open package" << path_ << " : " << ErrorCodeString(err);
+    return nullptr;
+  }
+
+  return zip_handle_;
+}
+
+BlockMapPackage::BlockMapPackage(android::base::unique_fd&& fd, const BlockMapData& block_map,
+                                 const std::string& path,
+                                 const std::function<void(float)>& set_progress)
+    : FilePackage(std::move(fd), block_map.file_size(), path, set_progress), zip_handle_(nullptr) {
+  uint64_t block_size = block_map.block_size();
+  uint64_t offset = 0;
+  for (const auto& [start, end] : block_map.block_ranges()) {
+    uint64_t device_offset = static_cast<uint64_t>(start) * block_size;
+    uint64_t length = static_cast<uint64_t>(end - start) * block_size;
+    if (!extents_.empty() &&
+        extents_.back().device_offset + extents_.back().length == device_offset) {
+      extents_.back().length += length;
+    } else {
+      extents_.push_back(Extent{ offset, device_offset, length });
+    }
+    offset += length;
+  }
+}
+
+BlockMapPackage::~BlockMapPackage() {
+  // Close the archive before |zip_data_| goes away.
+  if (zip_handle_) {
+    CloseArchive(zip_handle_);
+  }
+  if (zip_data_) {
+    munmap(zip_data_, package_size_);
+  }
+}
+
+template <typename Fn>
+bool BlockMapPackage::ForEachDeviceRange(uint64_t offset, uint64_t length, Fn fn) const {
+  // Find the last extent that starts at or before |offset|.
+  auto it = std::upper_bound(extents_.begin(), extents_.end(), offset,
+                             [](uint64_t value, const Extent& e) { return value < e.offset; });
+  CHECK(it != extents_.begin());
+  --it;
+  while (length > 0) {
+    CHECK(it != extents_.end());
+    uint64_t skip = offset - it->offset;
+    uint64_t piece = std::min(length, it->length - skip);
+    if (!fn(it->device_offset + skip, offset, piece)) {
+      return false;
+    }
+    offset += piece;
+    length -= piece;
+    ++it;
+  }
+  return true;
+}
+
+bool BlockMapPackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) {
+  if (byte_count > package_size_ || offset > package_size_ - byte_count) {
+    LOG(ERROR) << "Out of bound read, offset: " << offset << ", size: " << byte_count
+               << ", total package_size: " << package_size_;
+    return false;
+  }
+
+  return ForEachDeviceRange(
+      offset, byte_count,
+      [this, buffer, offset](uint64_t device_offset, uint64_t package_offset, uint64_t length) {
+        if (!android::base::ReadFullyAtOffset(fd_.get(), buffer + (package_offset - offset),
+                                              length, device_offset)) {
+          PLOG(ERROR) << "Failed to read " << length << " bytes at offset " << device_offset
+                      << " of " << path_;
+          return false;
+        }
+        return true;
+      });
+}
+
+void BlockMapPackage::Advise(uint64_t offset, uint64_t length, PackageAccess access) {
+  // The hints apply to the device ranges that hold the package data, clamped to the package.
+  if (offset >= package_size_) {
+    return;
+  }
+  length = std::min(length, package_size_ - offset);
+  if (length == 0) {
+    return;
+  }
+  static constexpr int kAdvice[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED,
+                                     POSIX_FADV_DONTNEED };
+  ForEachDeviceRange(offset, length, [this, access](uint64_t device_offset, uint64_t,
+                                                    uint64_t piece) {
+    int advice = kAdvice[static_cast<int>(access)];
+    if (int err = posix_fadvise64(fd_.get(), device_offset, piece, advice); err != 0) {
+      LOG(WARNING) << "posix_fadvise(" << device_offset << ", " << piece
+                   << ") failed: " << strerror(err);
+      return false;
+    }
+    return true;
+  });
+}
+
+bool BlockMapPackage::LoadZipRange(uint64_t offset, uint64_t length) {
+  return ReadFullyAtOffset(zip_data_ + offset, length, offset);
+}
+
+bool BlockMapPackage::MapZipRange(uint64_t offset, uint64_t length) {
+  // The pages go onto the device as a whole, which needs both the package offsets and the device
+  // offsets of the extents to be page aligned.
+  static const uint64_t kPageSize = sysconf(_SC_PAGESIZE);
+  uint64_t begin = offset / kPageSize * kPageSize;
+  uint64_t end = std::min(package_size_, offset + length);
+  return ForEachDeviceRange(
+      begin, end - begin,
+      [this](uint64_t device_offset, uint64_t package_offset, uint64_t piece) {
+        if (device_offset % kPageSize != 0 || package_offset % kPageSize != 0) {
+          LOG(ERROR) << "Block map of " << path_ << " isn't aligned to the page size " << kPageSize;
+          return false;
+        }
+        if (mmap(zip_data_ + package_offset, piece, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd_.get(),
+                 device_offset) == MAP_FAILED) {
+          PLOG(ERROR) << "Failed to map " << piece << " bytes at offset " << device_offset
+                      << " of " << path_;
+          return false;
+        }
+        return true;
+      });
+}
+
+bool BlockMapPackage::LoadZipData() {
+  using android::base::get_unaligned;
+
+  // Find the end of central directory record, which is followed by a comment of up to 64 KiB.
+  static constexpr uint32_t kEocdSignature = 0x06054b50;
+  static constexpr uint64_t kEocdSize = 22;
+  if (package_size_ < kEocdSize) {
+    LOG(ERROR) << path_ << " is too small to be a zip archive";
+    return false;
+  }
+  uint64_t tail_offset = package_size_ - std::min<uint64_t>(package_size_, kEocdSize + UINT16_MAX);
+  if (!LoadZipRange(tail_offset, package_size_ - tail_offset)) {
+    return false;
+  }
+  uint64_t eocd = package_size_ - kEocdSize;
+  while (get_unaligned<uint32_t>(zip_data_ + eocd) != kEocdSignature) {
+    if (eocd == tail_offset) {
+      LOG(ERROR) << "Failed to find the end of central directory in " << path_;
+      return false;
+    }
+    eocd--;
+  }
+  uint64_t cd_size = get_unaligned<uint32_t>(zip_data_ + eocd + 12);
+  uint64_t cd_offset = get_unaligned<uint32_t>(zip_data_ + eocd + 16);
+
+  // A Zip64 archive has the real values in the Zip64 end of central directory record, which is
+  // found through the locator just before the end of central directory.
+  if (cd_size == UINT32_MAX || cd_offset == UINT32_MAX) {
+    static constexpr uint32_t kZip64LocatorSignature = 0x07064b50;
+    static constexpr uint32_t kZip64EocdSignature = 0x06064b50;
+    static constexpr uint64_t kZip64LocatorSize = 20;
+    static constexpr uint64_t kZip64EocdSize = 56;
+    uint64_t locator = eocd - kZip64LocatorSize;
+    if (eocd < kZip64LocatorSize + kZip64EocdSize || !LoadZipRange(locator, kZip64LocatorSize) ||
+        get_unaligned<uint32_t>(zip_data_ + locator) != kZip64LocatorSignature) {
+      LOG(ERROR) << "Failed to find the Zip64 locator in " << path_;
       return false;
     }
+    uint64_t zip64_eocd = get_unaligned<uint64_t>(zip_data_ + locator + 8);
+    if (zip64_eocd > locator - kZip64EocdSize ||
+        !LoadZipRange(zip64_eocd, kZip64EocdSize) ||
+        get_unaligned<uint32_t>(zip_data_ + zip64_eocd) != kZip64EocdSignature) {
+      LOG(ERROR) << "Invalid Zip64 end of central directory in " << path_;
+      return false;
+    }
+    cd_size = get_unaligned<uint64_t>(zip_data_ + zip64_eocd + 40);
+    cd_offset = get_unaligned<uint64_t>(zip_data_ + zip64_eocd + 48);
+  }
+  if (cd_offset > eocd || cd_size > eocd - cd_offset || !LoadZipRange(cd_offset, cd_size)) {
+    LOG(ERROR) << "Invalid central directory of " << cd_size << " bytes at " << cd_offset << " in "
+               << path_;
+    return false;
+  }
+
+  // Load the local file header of each entry, which libziparchive checks when looking the entry
+  // up. libziparchive validates the central directory itself when opening the archive; here the
+  // parsing only stops at what would make the reads go wrong.
+  static constexpr uint32_t kCdEntrySignature = 0x02014b50;
+  static constexpr uint32_t kLocalHeaderSignature = 0x04034b50;
+  static constexpr uint64_t kCdEntrySize = 46;
+  static constexpr uint64_t kLocalHeaderSize = 30;
+  std::vector<std::pair<uint64_t, uint64_t>> entries;  // The compressed size and data offset.
+  const uint8_t* cd = zip_data_ + cd_offset;
+  for (uint64_t pos = 0; pos + kCdEntrySize <= cd_size;) {
+    if (get_unaligned<uint32_t>(cd + pos) != kCdEntrySignature) {
+      break;
+    }
+    uint64_t compressed_size = get_unaligned<uint32_t>(cd + pos + 20);
+    uint32_t uncompressed_size = get_unaligned<uint32_t>(cd + pos + 24);
+    uint16_t name_length = get_unaligned<uint16_t>(cd + pos + 28);
+    uint16_t extra_length = get_unaligned<uint16_t>(cd + pos + 30);
+    uint16_t comment_length = get_unaligned<uint16_t>(cd + pos + 32);
+    uint64_t header_offset = get_unaligned<uint32_t>(cd + pos + 42);
+    uint64_t next = pos + kCdEntrySize + name_length + extra_length + comment_length;
+    if (next > cd_size) {
+      break;
+    }
 
-    for (const auto& hasher : hashers) {
-      hasher(buffer.data(), read_size);
+    // The Zip64 extended information has the 64-bit values of the fields that are all ones, in
+    // this order.
+    const uint8_t* extra = cd + pos + kCdEntrySize + name_length;
+    for (uint16_t i = 0; i + 4 <= extra_length;) {
+      uint16_t id = get_unaligned<uint16_t>(extra + i);
+      uint16_t size = get_unaligned<uint16_t>(extra + i + 2);
+      if (i + 4 + size > extra_length) {
+        break;
+      }
+      if (id == 0x0001) {
+        uint16_t field = i + 4;
+        auto take = [&](uint64_t* value) {
+          if (field + 8 <= i + 4 + size) {
+            *value = get_unaligned<uint64_t>(extra + field);
+            field += 8;
+          }
+        };
+        uint64_t unused;
+        if (uncompressed_size == UINT32_MAX) {
+          take(&unused);
+        }
+        if (compressed_size == UINT32_MAX) {
+          take(&compressed_size);
+        }
+        if (header_offset == UINT32_MAX) {
+          take(&header_offset);
+        }
+        break;
+      }
+      i += 4 + size;
+    }
+    pos = next;
+
+    if (header_offset > cd_offset || kLocalHeaderSize > cd_offset - header_offset ||
+        !LoadZipRange(header_offset, kLocalHeaderSize) ||
+        get_unaligned<uint32_t>(zip_data_ + header_offset) != kLocalHeaderSignature) {
+      LOG(ERROR) << "Invalid local file header at " << header_offset << " in " << path_;
+      return false;
     }
-    so_far += read_size;
+    uint64_t data_offset = header_offset + kLocalHeaderSize +
+                           get_unaligned<uint16_t>(zip_data_ + header_offset + 26) +
+                           get_unaligned<uint16_t>(zip_data_ + header_offset + 28);
+    if (data_offset > cd_offset || compressed_size > cd_offset - data_offset ||
+        !LoadZipRange(header_offset + kLocalHeaderSize, data_offset - header_offset -
+                                                            kLocalHeaderSize)) {
+      LOG(ERROR) << "Invalid entry data at " << data_offset << " in " << path_;
+      return false;
+    }
+    entries.emplace_back(compressed_size, data_offset);
   }
 
+  // Load the data of the entries, smallest first, up to kMaxZipDataLoadSize. That covers most of
+  // what is extracted through the zip handle during the installation (the metadata, the payload
+  // properties). The data of the remaining entries, such as the payload, is mapped instead, and
+  // only read from the block device if the entry gets extracted. Each entry comes with the 24
+  // bytes after it, for a possible data descriptor.
+  static constexpr uint64_t kMaxZipDataLoadSize = 64 * MiB;
+  static constexpr uint64_t kDataDescriptorSize = 24;
+  std::sort(entries.begin(), entries.end());
+  uint64_t loaded = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> unloaded;  // The data offset and length.
+  for (const auto& [compressed_size, data_offset] : entries) {
+    uint64_t length = std::min(compressed_size + kDataDescriptorSize, cd_offset - data_offset);
+    if (length > kMaxZipDataLoadSize - loaded) {
+      unloaded.emplace_back(data_offset, length);
+      continue;
+    }
+    if (!LoadZipRange(data_offset, length)) {
+      return false;
+    }
+    loaded += length;
+  }
+  // The mappings come last: they are read-only, and the pages they share with the loaded ranges
+  // then hold the same bytes, read from the device.
+  for (const auto& [data_offset, length] : unloaded) {
+    if (!MapZipRange(data_offset, length)) {
+      return false;
+    }
+  }
   return true;
 }
 
-ZipArchiveHandle FilePackage::GetZipArchiveHandle() {
+ZipArchiveHandle BlockMapPackage::GetZipArchiveHandle() {
   if (zip_handle_) {
     return zip_handle_;
   }
 
-  if (auto err = OpenArchiveFd(fd_.get(), path_.c_str(), &zip_handle_, false); err != 0) {
+  if (!zip_data_) {
+    void* addr = mmap(nullptr, package_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to reserve " << package_size_ << " bytes for " << path_;
+      return nullptr;
+    }
+    zip_data_ = static_cast<uint8_t*>(addr);
+  }
+  if (!LoadZipData()) {
+    return nullptr;
+  }
+  if (auto err = OpenArchiveFromMemory(zip_data_, package_size_, path_.c_str(), &zip_handle_);
+      err != 0) {
     LOG(ERROR) << "Can't open package" << path_ << " : " << ErrorCodeString(err);
+    zip_handle_ = nullptr;
     return nullptr;
   }
 
@@ -24,6 +24,7 @@ constexpr const char kDefaultStashDirectoryBase[] = "/cache/recovery";
 constexpr const char kDefaultTemporaryInstallFile[] = "/tmp/last_install";
 constexpr const char kDefaultTemporaryLogFile[] = "/tmp/recovery.log";
 constexpr const char kDefaultTemporaryUpdateBinary[] = "/tmp/update-binary";
+constexpr const char kDefaultVerifyDigestCache[] = "/cache/recovery/verify_digests";
 
 Paths& Paths::Get() {
   static Paths paths;
@@ -38,4 +39,5 @@ Paths::Paths()
       stash_directory_base_(kDefaultStashDirectoryBase),
       temporary_install_file_(kDefaultTemporaryInstallFile),
       temporary_log_file_(kDefaultTemporaryLogFile),
-      temporary_update_binary_(kDefaultTemporaryUpdateBinary) {}
+      temporary_update_binary_(kDefaultTemporaryUpdateBinary),
+      verify_digest_cache_(kDefaultVerifyDigestCache) {}
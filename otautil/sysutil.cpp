@@ -19,11 +19,15 @@
 #include <errno.h>  // TEMP_FAILURE_RETRY
 #include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <limits>
 #include <string>
 #include <vector>
@@ -34,57 +38,220 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <cutils/android_reboot.h>
+#include <zlib.h>
 
-BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path) {
-  std::string content;
-  if (!android::base::ReadFileToString(block_map_path, &content)) {
-    PLOG(ERROR) << "Failed to read " << block_map_path;
-    return {};
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// The binary block map format; see BlockMapData::EncodeBinary().
+static constexpr std::string_view kBinaryBlockMapMagic = "BMAP";
+static constexpr uint32_t kBinaryBlockMapVersion = 1;
+
+template <typename T>
+static void PutFixed(T value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool GetFixed(std::string_view* in, T* value) {
+  if (in->size() < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, in->data(), sizeof(T));
+  in->remove_prefix(sizeof(T));
+  return true;
+}
+
+static void PutVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static bool GetVarint(std::string_view* in, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && !in->empty(); shift += 7) {
+    uint8_t byte = in->front();
+    in->remove_prefix(1);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string BlockMapData::EncodeBinary(const std::string& block_dev, uint64_t file_size,
+                                       uint32_t block_size, const RangeSet& ranges) {
+  std::string out(kBinaryBlockMapMagic);
+  PutFixed(kBinaryBlockMapVersion, &out);
+  PutFixed(file_size, &out);
+  PutFixed(block_size, &out);
+  PutFixed(static_cast<uint32_t>(ranges.size()), &out);
+  PutFixed(static_cast<uint32_t>(block_dev.size()), &out);
+  out += block_dev;
+
+  uint64_t previous_end = 0;
+  for (const auto& [start, end] : ranges) {
+    // Zigzag-encode the distance, since a range may come before the previous one on the device.
+    int64_t delta = static_cast<int64_t>(start) - static_cast<int64_t>(previous_end);
+    PutVarint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63), &out);
+    PutVarint(end - start, &out);
+    previous_end = end;
   }
 
+  PutFixed(static_cast<uint32_t>(
+               crc32(0, reinterpret_cast<const Bytef*>(out.data()), static_cast<uInt>(out.size()))),
+           &out);
+  return out;
+}
+
+// Parses the text block map in |content|. The ranges are checked by the caller.
+static bool ParseTextBlockMap(const std::string& content, std::string* block_dev,
+                              uint64_t* file_size, uint32_t* blksize,
+                              std::vector<std::pair<uint64_t, uint64_t>>* ranges) {
   std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
   if (lines.size() < 4) {
     LOG(ERROR) << "Block map file is too short: " << lines.size();
-    return {};
+    return false;
   }
 
-  const std::string& block_dev = lines[0];
+  *block_dev = lines[0];
 
-  uint64_t file_size;
-  uint32_t blksize;
-  if (sscanf(lines[1].c_str(), "%" SCNu64 "%" SCNu32, &file_size, &blksize) != 2) {
+  if (sscanf(lines[1].c_str(), "%" SCNu64 "%" SCNu32, file_size, blksize) != 2) {
     LOG(ERROR) << "Failed to parse file size and block size: " << lines[1];
+    return false;
+  }
+
+  size_t range_count;
+  if (sscanf(lines[2].c_str(), "%zu", &range_count) != 1) {
+    LOG(ERROR) << "Failed to parse block map header: " << lines[2];
+    return false;
+  }
+
+  if (lines.size() != 3 + range_count) {
+    LOG(ERROR) << "Invalid data in block map file: range_count " << range_count << ", lines "
+               << lines.size();
+    return false;
+  }
+
+  for (size_t i = 0; i < range_count; ++i) {
+    const std::string& line = lines[i + 3];
+    uint64_t start, end;
+    if (sscanf(line.c_str(), "%" SCNu64 "%" SCNu64, &start, &end) != 2) {
+      LOG(ERROR) << "failed to parse range " << i << ": " << line;
+      return false;
+    }
+    ranges->emplace_back(start, end);
+  }
+  return true;
+}
+
+// Parses the binary block map in |content|. The ranges are checked by the caller.
+static bool ParseBinaryBlockMap(std::string_view content, std::string* block_dev,
+                                uint64_t* file_size, uint32_t* blksize,
+                                std::vector<std::pair<uint64_t, uint64_t>>* ranges) {
+  uint32_t crc;
+  if (content.size() < kBinaryBlockMapMagic.size() + sizeof(crc)) {
+    LOG(ERROR) << "Binary block map is too short: " << content.size();
+    return false;
+  }
+  memcpy(&crc, content.data() + content.size() - sizeof(crc), sizeof(crc));
+  content.remove_suffix(sizeof(crc));
+  if (uint32_t actual = crc32(0, reinterpret_cast<const Bytef*>(content.data()),
+                              static_cast<uInt>(content.size()));
+      actual != crc) {
+    LOG(ERROR) << "Binary block map checksum mismatch: " << std::hex << actual << " vs " << crc;
+    return false;
+  }
+  content.remove_prefix(kBinaryBlockMapMagic.size());
+
+  uint32_t version, range_count, path_size;
+  if (!GetFixed(&content, &version) || version != kBinaryBlockMapVersion) {
+    LOG(ERROR) << "Unsupported binary block map version";
+    return false;
+  }
+  if (!GetFixed(&content, file_size) || !GetFixed(&content, blksize) ||
+      !GetFixed(&content, &range_count) || !GetFixed(&content, &path_size) ||
+      content.size() < path_size) {
+    LOG(ERROR) << "Failed to parse binary block map header";
+    return false;
+  }
+  *block_dev = content.substr(0, path_size);
+  content.remove_prefix(path_size);
+
+  // Each range takes at least two bytes, which bounds the reservation below.
+  if (range_count > content.size() / 2) {
+    LOG(ERROR) << "Invalid range count in binary block map: " << range_count;
+    return false;
+  }
+  ranges->reserve(range_count);
+  uint64_t previous_end = 0;
+  for (uint32_t i = 0; i < range_count; i++) {
+    uint64_t zigzag, length;
+    if (!GetVarint(&content, &zigzag) || !GetVarint(&content, &length)) {
+      LOG(ERROR) << "Failed to parse range " << i << " of binary block map";
+      return false;
+    }
+    int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+    uint64_t start = previous_end + static_cast<uint64_t>(delta);
+    ranges->emplace_back(start, start + length);
+    previous_end = start + length;
+  }
+  if (!content.empty()) {
+    LOG(ERROR) << "Trailing data in binary block map: " << content.size() << " bytes";
+    return false;
+  }
+  return true;
+}
+
+BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path) {
+  std::string binary_path = block_map_path + kBinarySuffix;
+  if (access(binary_path.c_str(), F_OK) == 0) {
+    if (auto block_map = ParseFile(binary_path); block_map) {
+      return block_map;
+    }
+    LOG(WARNING) << "Falling back to " << block_map_path;
+  }
+  return ParseFile(block_map_path);
+}
+
+BlockMapData BlockMapData::ParseFile(const std::string& block_map_path) {
+  std::string content;
+  if (!android::base::ReadFileToString(block_map_path, &content)) {
+    PLOG(ERROR) << "Failed to read " << block_map_path;
     return {};
   }
 
-  if (file_size == 0 || blksize == 0) {
-    LOG(ERROR) << "Invalid size in block map file: size " << file_size << ", blksize " << blksize;
+  std::string block_dev;
+  uint64_t file_size;
+  uint32_t blksize;
+  std::vector<std::pair<uint64_t, uint64_t>> parsed_ranges;
+  bool parsed = android::base::StartsWith(content, kBinaryBlockMapMagic)
+                    ? ParseBinaryBlockMap(content, &block_dev, &file_size, &blksize, &parsed_ranges)
+                    : ParseTextBlockMap(content, &block_dev, &file_size, &blksize, &parsed_ranges);
+  if (!parsed) {
     return {};
   }
 
-  size_t range_count;
-  if (sscanf(lines[2].c_str(), "%zu", &range_count) != 1) {
-    LOG(ERROR) << "Failed to parse block map header: " << lines[2];
+  if (file_size == 0 || blksize == 0) {
+    LOG(ERROR) << "Invalid size in block map file: size " << file_size << ", blksize " << blksize;
     return {};
   }
 
   uint64_t blocks = ((file_size - 1) / blksize) + 1;
-  if (blocks > std::numeric_limits<uint32_t>::max() || range_count == 0 ||
-      lines.size() != 3 + range_count) {
+  if (blocks > std::numeric_limits<uint32_t>::max() || parsed_ranges.empty()) {
     LOG(ERROR) << "Invalid data in block map file: size " << file_size << ", blksize " << blksize
-               << ", range_count " << range_count << ", lines " << lines.size();
+               << ", range_count " << parsed_ranges.size();
     return {};
   }
 
   RangeSet ranges;
   uint64_t remaining_blocks = blocks;
-  for (size_t i = 0; i < range_count; ++i) {
-    const std::string& line = lines[i + 3];
-    uint64_t start, end;
-    if (sscanf(line.c_str(), "%" SCNu64 "%" SCNu64, &start, &end) != 2) {
-      LOG(ERROR) << "failed to parse range " << i << ": " << line;
-      return {};
-    }
+  for (const auto& [start, end] : parsed_ranges) {
     uint64_t range_blocks = end - start;
     if (end <= start || range_blocks > remaining_blocks) {
       LOG(ERROR) << "Invalid range: " << start << " " << end;
@@ -150,11 +317,23 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
     return false;
   }
 
+  // uncrypt emits one range per extent, and a fragmented file often has extents that continue
+  // right where the previous one ends. Such ranges are mapped with a single mmap.
+  std::vector<std::pair<size_t, size_t>> coalesced;
+  for (const auto& [start, end] : block_map_data.block_ranges()) {
+    if (!coalesced.empty() && coalesced.back().second == start) {
+      coalesced.back().second = end;
+    } else {
+      coalesced.emplace_back(start, end);
+    }
+  }
+
   ranges_.clear();
 
+  auto map_start = std::chrono::steady_clock::now();
   auto next = static_cast<unsigned char*>(reserve);
   size_t remaining_size = blocks * blksize;
-  for (const auto& [start, end] : block_map_data.block_ranges()) {
+  for (const auto& [start, end] : coalesced) {
     size_t range_size = (end - start) * blksize;
     void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
                              static_cast<off_t>(start) * blksize);
@@ -177,12 +356,104 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
   addr = static_cast<unsigned char*>(reserve);
   length = block_map_data.file_size();
 
-  LOG(INFO) << "mmapped " << block_map_data.block_ranges().size() << " ranges";
+  std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - map_start;
+  LOG(INFO) << "mmapped " << block_map_data.block_ranges().size() << " ranges as "
+            << coalesced.size() << " in " << duration.count() << " ms";
+
+  return true;
+}
 
+bool MemMapping::Advise(uint64_t offset, uint64_t length, int advice) const {
+  if (ranges_.empty() || offset >= this->length || length == 0) {
+    return true;
+  }
+  length = std::min<uint64_t>(length, this->length - offset);
+
+  // The ranges of a block map file are mapped back to back into one reserved region, so the
+  // requested range is always contiguous in memory.
+  uintptr_t page_size = getpagesize();
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr) + offset;
+  uintptr_t end = start + length;
+  start &= ~(page_size - 1);
+  end = (end + page_size - 1) & ~(page_size - 1);
+  if (madvise(reinterpret_cast<void*>(start), end - start, advice) == -1) {
+    PLOG(WARNING) << "madvise(" << offset << ", " << length << ", " << advice << ") failed";
+    return false;
+  }
   return true;
 }
 
-bool MemMapping::MapFile(const std::string& fn) {
+void MemMapping::SetReadPosition(uint64_t offset) {
+  {
+    std::lock_guard<std::mutex> lock(prefault_mutex_);
+    read_position_ = offset;
+  }
+  prefault_cv_.notify_all();
+}
+
+void MemMapping::StartPrefault() {
+  stop_prefault_ = false;
+  read_position_ = 0;
+  prefault_thread_ = std::thread([this, data = addr, size = length]() {
+    auto start = std::chrono::steady_clock::now();
+    // Populate in chunks, so that StopPrefault() doesn't have to wait for the whole file.
+    static constexpr size_t kPrefaultChunkSize = 1024 * 1024;
+    size_t page_size = getpagesize();
+    size_t offset = 0;
+    bool populate = true;
+    while (offset < size) {
+      {
+        // Pages faulted in too far ahead would only be evicted again, or crowd out recovery's own.
+        std::unique_lock<std::mutex> lock(prefault_mutex_);
+        prefault_cv_.wait(lock, [this, offset]() {
+          return stop_prefault_ || offset < read_position_ + kPrefaultWindow;
+        });
+        if (stop_prefault_) {
+          break;
+        }
+      }
+      size_t chunk_size = std::min(size - offset, kPrefaultChunkSize);
+      // MADV_POPULATE_READ (Linux 5.14) maps the whole chunk in one go. On older kernels, touch
+      // one byte per page instead. Any other failure (e.g. an I/O error) is left for the reader
+      // to hit and report.
+      if (populate && madvise(data + offset, (chunk_size + page_size - 1) & ~(page_size - 1),
+                              MADV_POPULATE_READ) == -1) {
+        if (errno != EINVAL) {
+          PLOG(WARNING) << "Failed to prefault at offset " << offset;
+          break;
+        }
+        populate = false;
+      }
+      if (!populate) {
+        for (size_t i = 0; i < chunk_size; i += page_size) {
+          static_cast<void>(*static_cast<volatile const unsigned char*>(data + offset + i));
+        }
+      }
+      offset += chunk_size;
+    }
+
+    struct rusage usage = {};
+    getrusage(RUSAGE_THREAD, &usage);
+    std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+    LOG(INFO) << "Prefaulted " << offset << " bytes in " << duration.count() << " ms ("
+              << usage.ru_minflt << " minor faults, " << usage.ru_majflt << " major faults)";
+  });
+}
+
+void MemMapping::StopPrefault() {
+  if (prefault_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(prefault_mutex_);
+      stop_prefault_ = true;
+    }
+    prefault_cv_.notify_all();
+    prefault_thread_.join();
+  }
+}
+
+bool MemMapping::MapFile(const std::string& fn, bool prefault) {
+  StopPrefault();
+
   if (fn.empty()) {
     LOG(ERROR) << "Empty filename";
     return false;
@@ -207,10 +478,15 @@ bool MemMapping::MapFile(const std::string& fn) {
       return false;
     }
   }
+
+  if (prefault) {
+    StartPrefault();
+  }
   return true;
 }
 
 MemMapping::~MemMapping() {
+  StopPrefault();
   for (const auto& range : ranges_) {
     if (munmap(range.addr, range.length) == -1) {
       PLOG(ERROR) << "Failed to munmap(" << range.addr << ", " << range.length << ")";
@@ -16,23 +16,34 @@
 
 #include "otautil/verifier.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/memory.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <openssl/bio.h>
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/evp.h>
 #include <openssl/obj_mac.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <ziparchive/zip_archive.h>
 
@@ -110,10 +121,144 @@ static bool read_pkcs7(const uint8_t* pkcs7_der, size_t pkcs7_der_len,
   return true;
 }
 
-int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys) {
-  CHECK(package);
-  package->SetProgress(0.0);
+// The digest cache lets verify_file() skip the whole-file hash pass when the same package gets
+// verified again, e.g. on an install retry or a repeated sideload. The cache holds a single entry
+// for the last verified package:
+//
+//   <salt> <fingerprint> <key index> <digest>
+//
+// The fingerprint is a SHA-256 over the salt, the package size, the signed length, the EOCD
+// (including the archive comment with the signature and the footer), the first and last blocks of
+// the signed data, and kFingerprintSamples blocks at offsets derived from the salt. The salt is
+// random for each entry and only readable by us, so whoever supplies the package (e.g. the
+// sideload host) can't predict which blocks are sampled. <digest> is the full digest that the
+// signature was verified against, with the key at <key index>. On a fingerprint match, the cached
+// digest still has to verify against that key.
+static constexpr size_t kFingerprintSamples = 16;
+static constexpr size_t kFingerprintSampleSize = 4096;
+static constexpr size_t kFingerprintSaltSize = 32;
+
+struct DigestCacheEntry {
+  std::vector<uint8_t> salt;
+  std::string fingerprint;
+  size_t key_index;
+  std::vector<uint8_t> digest;
+};
+
+static bool ComputeFingerprint(VerifierInterface* package, const std::vector<uint8_t>& salt,
+                               uint64_t signed_len, const std::vector<uint8_t>& eocd,
+                               std::string* fingerprint) {
+  uint64_t package_size = package->GetPackageSize();
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, salt.data(), salt.size());
+  SHA256_Update(&ctx, &package_size, sizeof(package_size));
+  SHA256_Update(&ctx, &signed_len, sizeof(signed_len));
+  SHA256_Update(&ctx, eocd.data(), eocd.size());
+
+  // signed_len is at least EOCD_HEADER_SIZE - 2, so it's never zero.
+  std::vector<uint64_t> offsets = { 0, signed_len - std::min<uint64_t>(signed_len,
+                                                                      kFingerprintSampleSize) };
+  for (uint32_t i = 0; i < kFingerprintSamples; i++) {
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256_CTX offset_ctx;
+    SHA256_Init(&offset_ctx);
+    SHA256_Update(&offset_ctx, salt.data(), salt.size());
+    SHA256_Update(&offset_ctx, &i, sizeof(i));
+    SHA256_Final(hash, &offset_ctx);
+    offsets.push_back(android::base::get_unaligned<uint64_t>(hash) % signed_len /
+                      kFingerprintSampleSize * kFingerprintSampleSize);
+  }
+
+  std::vector<uint8_t> sample(kFingerprintSampleSize);
+  for (uint64_t offset : offsets) {
+    uint64_t size = std::min<uint64_t>(signed_len - offset, kFingerprintSampleSize);
+    if (!package->ReadFullyAtOffset(sample.data(), size, offset)) {
+      return false;
+    }
+    SHA256_Update(&ctx, sample.data(), size);
+  }
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  *fingerprint = print_hex(digest, SHA256_DIGEST_LENGTH);
+  return true;
+}
+
+static bool ParseHex(const std::string& str, std::vector<uint8_t>* bytes) {
+  if (str.empty() || str.size() % 2 != 0) {
+    return false;
+  }
+  bytes->clear();
+  for (size_t i = 0; i < str.size(); i += 2) {
+    if (!isxdigit(str[i]) || !isxdigit(str[i + 1])) {
+      return false;
+    }
+    bytes->push_back(static_cast<uint8_t>(std::stoul(str.substr(i, 2), nullptr, 16)));
+  }
+  return true;
+}
+
+// Reads the entry from |cache_file|. The file is ignored unless it's a regular file owned by us,
+// with no access for group or others: anyone else who could write it could forge an entry, and
+// anyone who could read it would learn the salt.
+static bool ReadDigestCache(const std::string& cache_file, DigestCacheEntry* entry) {
+  android::base::unique_fd fd(open(cache_file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+  if (fd == -1) {
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd.get(), &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_uid != getuid() ||
+      (sb.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    LOG(WARNING) << "Ignoring untrusted digest cache " << cache_file;
+    return false;
+  }
+
+  std::string content;
+  if (!android::base::ReadFdToString(fd.get(), &content)) {
+    return false;
+  }
+  std::vector<std::string> fields = android::base::Split(android::base::Trim(content), " ");
+  if (fields.size() != 4 || !ParseHex(fields[0], &entry->salt) ||
+      entry->salt.size() != kFingerprintSaltSize ||
+      !android::base::ParseUint(fields[2], &entry->key_index) ||
+      !ParseHex(fields[3], &entry->digest)) {
+    LOG(WARNING) << "Ignoring malformed digest cache " << cache_file;
+    return false;
+  }
+  entry->fingerprint = fields[1];
+  return true;
+}
+
+// Replaces |cache_file| with the given entry. The old file is removed rather than truncated, so
+// that the new one is always created by us with mode 0600.
+static void WriteDigestCache(const std::string& cache_file, const DigestCacheEntry& entry) {
+  if (unlink(cache_file.c_str()) == -1 && errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << cache_file;
+    return;
+  }
+  android::base::unique_fd fd(
+      open(cache_file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to create digest cache " << cache_file;
+    return;
+  }
+  std::string content = print_hex(entry.salt.data(), entry.salt.size()) + " " +
+                        entry.fingerprint + " " + std::to_string(entry.key_index) + " " +
+                        print_hex(entry.digest.data(), entry.digest.size()) + "\n";
+  if (!android::base::WriteStringToFd(content, fd.get()) || fsync(fd.get()) == -1) {
+    PLOG(WARNING) << "Failed to write digest cache " << cache_file;
+    fd.reset();
+    unlink(cache_file.c_str());
+  }
+}
 
+// Reads and checks the footer and the EOCD record (including the archive comment) at the end of
+// |package|. On success, |signed_len| is the length of the data covered by the whole-file
+// signature, |eocd| holds the EOCD record and |signature_start| is the offset of the signature
+// from the end of the file.
+static bool ReadSignatureFooter(VerifierInterface* package, uint64_t* signed_len,
+                                std::vector<uint8_t>* eocd, size_t* signature_start) {
   // An archive with a whole-file signature will end in six bytes:
   //
   //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -127,34 +272,34 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
 
   if (length < FOOTER_SIZE) {
     LOG(ERROR) << "not big enough to contain footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   uint8_t footer[FOOTER_SIZE];
   if (!package->ReadFullyAtOffset(footer, FOOTER_SIZE, length - FOOTER_SIZE)) {
     LOG(ERROR) << "Failed to read footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   if (footer[2] != 0xff || footer[3] != 0xff) {
     LOG(ERROR) << "footer is wrong";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   size_t comment_size = footer[4] + (footer[5] << 8);
-  size_t signature_start = footer[0] + (footer[1] << 8);
-  LOG(INFO) << "comment is " << comment_size << " bytes; signature is " << signature_start
+  *signature_start = footer[0] + (footer[1] << 8);
+  LOG(INFO) << "comment is " << comment_size << " bytes; signature is " << *signature_start
             << " bytes from end";
 
-  if (signature_start > comment_size) {
-    LOG(ERROR) << "signature start: " << signature_start
+  if (*signature_start > comment_size) {
+    LOG(ERROR) << "signature start: " << *signature_start
                << " is larger than comment size: " << comment_size;
-    return VERIFY_FAILURE;
+    return false;
   }
 
-  if (signature_start <= FOOTER_SIZE) {
+  if (*signature_start <= FOOTER_SIZE) {
     LOG(ERROR) << "Signature start is in the footer";
-    return VERIFY_FAILURE;
+    return false;
   }
 
 #define EOCD_HEADER_SIZE 22
@@ -164,36 +309,121 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
 
   if (length < eocd_size) {
     LOG(ERROR) << "not big enough to contain EOCD";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   // Determine how much of the file is covered by the signature. This is everything except the
   // signature data and length, which includes all of the EOCD except for the comment length field
   // (2 bytes) and the comment data.
-  uint64_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
+  *signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-  uint8_t eocd[eocd_size];
-  if (!package->ReadFullyAtOffset(eocd, eocd_size, length - eocd_size)) {
+  eocd->resize(eocd_size);
+  if (!package->ReadFullyAtOffset(eocd->data(), eocd_size, length - eocd_size)) {
     LOG(ERROR) << "Failed to read EOCD of " << eocd_size << " bytes";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   // If this is really is the EOCD record, it will begin with the magic number $50 $4b $05 $06.
-  if (eocd[0] != 0x50 || eocd[1] != 0x4b || eocd[2] != 0x05 || eocd[3] != 0x06) {
+  const uint8_t* data = eocd->data();
+  if (data[0] != 0x50 || data[1] != 0x4b || data[2] != 0x05 || data[3] != 0x06) {
     LOG(ERROR) << "signature length doesn't match EOCD marker";
-    return VERIFY_FAILURE;
+    return false;
   }
 
   for (size_t i = 4; i < eocd_size - 3; ++i) {
-    if (eocd[i] == 0x50 && eocd[i + 1] == 0x4b && eocd[i + 2] == 0x05 && eocd[i + 3] == 0x06) {
+    if (data[i] == 0x50 && data[i + 1] == 0x4b && data[i + 2] == 0x05 && data[i + 3] == 0x06) {
       // If the sequence $50 $4b $05 $06 appears anywhere after the real one, libziparchive will
       // find the later (wrong) one, which could be exploitable. Fail the verification if this
       // sequence occurs anywhere after the real one.
       LOG(ERROR) << "EOCD marker occurs after start of EOCD";
-      return VERIFY_FAILURE;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Checks |sig_der| against the key at |index| in |keys|, using the digest that matches the hash
+// length of the key. A null |sha1| or |sha256| skips the keys of that kind. |what| names the
+// signature in the logs.
+static bool VerifyWithKey(const std::vector<Certificate>& keys, size_t index, const uint8_t* sha1,
+                          const uint8_t* sha256, const std::vector<uint8_t>& sig_der,
+                          const char* what) {
+  const auto& key = keys[index];
+  const uint8_t* hash;
+  int hash_nid;
+  switch (key.hash_len) {
+    case SHA_DIGEST_LENGTH:
+      if (sha1 == nullptr) {
+        return false;
+      }
+      hash = sha1;
+      hash_nid = NID_sha1;
+      break;
+    case SHA256_DIGEST_LENGTH:
+      if (sha256 == nullptr) {
+        return false;
+      }
+      hash = sha256;
+      hash_nid = NID_sha256;
+      break;
+    default:
+      return false;
+  }
+
+  if (key.key_type == Certificate::KEY_TYPE_RSA) {
+    if (!RSA_verify(hash_nid, hash, key.hash_len, sig_der.data(), sig_der.size(),
+                    key.rsa.get())) {
+      LOG(INFO) << "failed to verify against RSA key " << index;
+      return false;
+    }
+
+    LOG(INFO) << what << " signature verified against RSA key " << index;
+    return true;
+  } else if (key.key_type == Certificate::KEY_TYPE_EC && key.hash_len == SHA256_DIGEST_LENGTH) {
+    if (!ECDSA_verify(0, hash, key.hash_len, sig_der.data(), sig_der.size(), key.ec.get())) {
+      LOG(INFO) << "failed to verify against EC key " << index;
+      return false;
+    }
+
+    LOG(INFO) << what << " signature verified against EC key " << index;
+    return true;
+  }
+
+  LOG(INFO) << "Unknown key type " << key.key_type;
+  return false;
+}
+
+// Checks |sig_der| against each of the |keys| (see VerifyWithKey()). Returns the index of the first
+// matching key, or -1 if none matches.
+static int FindMatchingKey(const std::vector<Certificate>& keys, const uint8_t* sha1,
+                           const uint8_t* sha256, const std::vector<uint8_t>& sig_der,
+                           const char* what) {
+  // Check to make sure at least one of the keys matches the signature. Since any key can match,
+  // we need to try each before determining a verification failure has happened.
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (VerifyWithKey(keys, i, sha1, sha256, sig_der, what)) {
+      return static_cast<int>(i);
     }
   }
 
+  return -1;
+}
+
+int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys,
+                const std::string& digest_cache) {
+  CHECK(package);
+  package->SetProgress(0.0);
+
+  uint64_t length = package->GetPackageSize();
+  uint64_t signed_len;
+  std::vector<uint8_t> eocd;
+  size_t signature_start;
+  if (!ReadSignatureFooter(package, &signed_len, &eocd, &signature_start)) {
+    return VERIFY_FAILURE;
+  }
+  size_t eocd_size = eocd.size();
+
   bool need_sha1 = false;
   bool need_sha256 = false;
   for (const auto& key : keys) {
@@ -207,6 +437,41 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
     }
   }
 
+  const uint8_t* signature = eocd.data() + eocd_size - signature_start;
+  // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that the signing tool appends
+  // after the signature itself.
+  size_t signature_size = signature_start - FOOTER_SIZE;
+
+  LOG(INFO) << "signature (offset: " << std::hex << (length - signature_start)
+            << ", length: " << signature_size << "): " << print_hex(signature, signature_size);
+
+  std::vector<uint8_t> sig_der;
+  if (!read_pkcs7(signature, signature_size, &sig_der)) {
+    LOG(ERROR) << "Could not find signature DER block";
+    return VERIFY_FAILURE;
+  }
+
+  // Try the cached digest first. It's only trusted if the fingerprint matches, and the signature
+  // still verifies against the same key.
+  DigestCacheEntry entry;
+  if (!digest_cache.empty() && ReadDigestCache(digest_cache, &entry)) {
+    std::string fingerprint;
+    if (ComputeFingerprint(package, entry.salt, signed_len, eocd, &fingerprint) &&
+        fingerprint == entry.fingerprint && entry.key_index < keys.size() &&
+        entry.digest.size() == keys[entry.key_index].hash_len) {
+      const uint8_t* digest = entry.digest.data();
+      bool is_sha1 = entry.digest.size() == SHA_DIGEST_LENGTH;
+      if (VerifyWithKey(keys, entry.key_index, is_sha1 ? digest : nullptr,
+                        is_sha1 ? nullptr : digest, sig_der, "whole-file (cached digest)")) {
+        package->SetProgress(1.0);
+        return VERIFY_SUCCESS;
+      }
+    }
+    // A stale entry must not fail a good package; drop it and do the full hash pass.
+    LOG(INFO) << "Digest cache " << digest_cache << " doesn't match the package";
+    unlink(digest_cache.c_str());
+  }
+
   SHA_CTX sha1_ctx;
   SHA256_CTX sha256_ctx;
   SHA1_Init(&sha1_ctx);
@@ -222,20 +487,19 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
         std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2));
   }
 
+  // The whole signed range is hashed in one go, so that the package keeps its reads and hashers
+  // going from start to end.
   double frac = -1.0;
-  uint64_t so_far = 0;
-  while (so_far < signed_len) {
-    // On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a 1196MiB full OTA and
-    // 60% for an 89MiB incremental OTA. http://b/28135231.
-    uint64_t read_size = std::min<uint64_t>(signed_len - so_far, 16 * MiB);
-    package->UpdateHashAtOffset(hashers, so_far, read_size);
-    so_far += read_size;
-
+  auto on_progress = [package, signed_len, &frac](uint64_t so_far) {
     double f = so_far / static_cast<double>(signed_len);
-    if (f > frac + 0.02 || read_size == so_far) {
+    if (f > frac + 0.02 || so_far == signed_len) {
       package->SetProgress(f);
       frac = f;
     }
+  };
+  if (!package->UpdateHashAtOffset(hashers, 0, signed_len, on_progress)) {
+    LOG(ERROR) << "Failed to hash " << signed_len << " bytes";
+    return VERIFY_FAILURE;
   }
 
   uint8_t sha1[SHA_DIGEST_LENGTH];
@@ -243,59 +507,22 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
   uint8_t sha256[SHA256_DIGEST_LENGTH];
   SHA256_Final(sha256, &sha256_ctx);
 
-  const uint8_t* signature = eocd + eocd_size - signature_start;
-  size_t signature_size = signature_start - FOOTER_SIZE;
-
-  LOG(INFO) << "signature (offset: " << std::hex << (length - signature_start)
-            << ", length: " << signature_size << "): " << print_hex(signature, signature_size);
-
-  std::vector<uint8_t> sig_der;
-  if (!read_pkcs7(signature, signature_size, &sig_der)) {
-    LOG(ERROR) << "Could not find signature DER block";
-    return VERIFY_FAILURE;
-  }
-
-  // Check to make sure at least one of the keys matches the signature. Since any key can match,
-  // we need to try each before determining a verification failure has happened.
-  for (size_t i = 0; i < keys.size(); i++) {
-    const auto& key = keys[i];
-    const uint8_t* hash;
-    int hash_nid;
-    switch (key.hash_len) {
-      case SHA_DIGEST_LENGTH:
-        hash = sha1;
-        hash_nid = NID_sha1;
-        break;
-      case SHA256_DIGEST_LENGTH:
-        hash = sha256;
-        hash_nid = NID_sha256;
-        break;
-      default:
-        continue;
-    }
-
-    // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that the signing tool appends
-    // after the signature itself.
-    if (key.key_type == Certificate::KEY_TYPE_RSA) {
-      if (!RSA_verify(hash_nid, hash, key.hash_len, sig_der.data(), sig_der.size(),
-                      key.rsa.get())) {
-        LOG(INFO) << "failed to verify against RSA key " << i;
-        continue;
+  int key_index = FindMatchingKey(keys, sha1, sha256, sig_der, "whole-file");
+  if (key_index != -1) {
+    if (!digest_cache.empty()) {
+      entry.salt.resize(kFingerprintSaltSize);
+      entry.key_index = key_index;
+      if (keys[key_index].hash_len == SHA_DIGEST_LENGTH) {
+        entry.digest.assign(sha1, sha1 + SHA_DIGEST_LENGTH);
+      } else {
+        entry.digest.assign(sha256, sha256 + SHA256_DIGEST_LENGTH);
       }
-
-      LOG(INFO) << "whole-file signature verified against RSA key " << i;
-      return VERIFY_SUCCESS;
-    } else if (key.key_type == Certificate::KEY_TYPE_EC && key.hash_len == SHA256_DIGEST_LENGTH) {
-      if (!ECDSA_verify(0, hash, key.hash_len, sig_der.data(), sig_der.size(), key.ec.get())) {
-        LOG(INFO) << "failed to verify against EC key " << i;
-        continue;
+      if (RAND_bytes(entry.salt.data(), entry.salt.size()) == 1 &&
+          ComputeFingerprint(package, entry.salt, signed_len, eocd, &entry.fingerprint)) {
+        WriteDigestCache(digest_cache, entry);
       }
-
-      LOG(INFO) << "whole-file signature verified against EC key " << i;
-      return VERIFY_SUCCESS;
-    } else {
-      LOG(INFO) << "Unknown key type " << key.key_type;
     }
+    return VERIFY_SUCCESS;
   }
 
   if (need_sha1) {
@@ -308,6 +535,135 @@ int verify_file(VerifierInterface* package, const std::vector<Certificate>& keys
   return VERIFY_FAILURE;
 }
 
+// The chunk manifest sits in the archive comment, right before the whole-file signature:
+//
+//   chunk_size (4) | signed_len (8) | hashes_offset (8) | hash_count (4) | hashes_digest (32) |
+//   signature_size (4) | signature (signature_size) | manifest_size (4) | "CHUNKMF1"
+//
+// All integers are little-endian. The signature is a PKCS#7 block like the whole-file one, over
+// the SHA-256 of everything before signature_size. manifest_size counts the bytes from chunk_size
+// through the signature.
+//
+// The chunk hashes don't fit in the comment, which is limited to 64 KiB, so they live in the
+// package instead: hash_count SHA-256 hashes at hashes_offset, whose SHA-256 is hashes_digest.
+// hashes[i] is the SHA-256 of bytes [i * chunk_size, min((i + 1) * chunk_size, signed_len)) of the
+// package, with the bytes of the hashes themselves taken as zeroes.
+static constexpr char kChunkManifestMagic[] = "CHUNKMF1";
+static constexpr size_t kChunkManifestMagicSize = 8;
+static constexpr size_t kChunkManifestSignedSize = 24 + SHA256_DIGEST_LENGTH;
+
+int verify_chunk_manifest(VerifierInterface* package, const std::vector<Certificate>& keys,
+                          ChunkManifest* manifest) {
+  CHECK(package);
+  CHECK(manifest);
+
+  uint64_t signed_len;
+  std::vector<uint8_t> eocd;
+  size_t signature_start;
+  if (!ReadSignatureFooter(package, &signed_len, &eocd, &signature_start)) {
+    return VERIFY_FAILURE;
+  }
+
+  // The trailer ends where the whole-file signature begins; neither can overlap the EOCD header.
+  size_t trailer_end = eocd.size() - signature_start;
+  if (trailer_end < EOCD_HEADER_SIZE + 4 + kChunkManifestMagicSize ||
+      memcmp(eocd.data() + trailer_end - kChunkManifestMagicSize, kChunkManifestMagic,
+             kChunkManifestMagicSize) != 0) {
+    LOG(INFO) << "No chunk manifest in package";
+    return VERIFY_FAILURE;
+  }
+  size_t manifest_size = android::base::get_unaligned<uint32_t>(
+      eocd.data() + trailer_end - kChunkManifestMagicSize - 4);
+  size_t manifest_end = trailer_end - kChunkManifestMagicSize - 4;
+  if (manifest_size > manifest_end - EOCD_HEADER_SIZE ||
+      manifest_size < kChunkManifestSignedSize + 4) {
+    LOG(ERROR) << "Invalid chunk manifest size " << manifest_size;
+    return VERIFY_FAILURE;
+  }
+  const uint8_t* data = eocd.data() + manifest_end - manifest_size;
+  size_t manifest_signature_size =
+      android::base::get_unaligned<uint32_t>(data + kChunkManifestSignedSize);
+  if (manifest_signature_size != manifest_size - kChunkManifestSignedSize - 4) {
+    LOG(ERROR) << "Invalid chunk manifest signature size " << manifest_signature_size;
+    return VERIFY_FAILURE;
+  }
+
+  std::vector<uint8_t> sig_der;
+  if (!read_pkcs7(data + kChunkManifestSignedSize + 4, manifest_signature_size, &sig_der)) {
+    LOG(ERROR) << "Could not find chunk manifest signature DER block";
+    return VERIFY_FAILURE;
+  }
+  uint8_t sha256[SHA256_DIGEST_LENGTH];
+  SHA256(data, kChunkManifestSignedSize, sha256);
+  if (FindMatchingKey(keys, nullptr, sha256, sig_der, "chunk manifest") == -1) {
+    LOG(ERROR) << "failed to verify chunk manifest signature";
+    return VERIFY_FAILURE;
+  }
+
+  uint32_t chunk_size = android::base::get_unaligned<uint32_t>(data);
+  uint64_t manifest_signed_len = android::base::get_unaligned<uint64_t>(data + 4);
+  uint64_t hashes_offset = android::base::get_unaligned<uint64_t>(data + 12);
+  uint32_t hash_count = android::base::get_unaligned<uint32_t>(data + 20);
+  uint64_t hashes_size = static_cast<uint64_t>(hash_count) * SHA256_DIGEST_LENGTH;
+  if (chunk_size == 0 || manifest_signed_len != signed_len ||
+      hash_count != (signed_len + chunk_size - 1) / chunk_size || hashes_offset > signed_len ||
+      hashes_size > signed_len - hashes_offset) {
+    LOG(ERROR) << "Chunk manifest doesn't match the package: chunk size " << chunk_size
+               << ", signed length " << manifest_signed_len << " (expected " << signed_len
+               << "), " << hash_count << " hashes at offset " << hashes_offset;
+    return VERIFY_FAILURE;
+  }
+
+  static_assert(sizeof(ChunkManifest::hashes[0]) == SHA256_DIGEST_LENGTH);
+  manifest->hashes.resize(hash_count);
+  auto hashes = reinterpret_cast<uint8_t*>(manifest->hashes.data());
+  if (!package->ReadFullyAtOffset(hashes, hashes_size, hashes_offset)) {
+    LOG(ERROR) << "Failed to read " << hash_count << " chunk hashes at offset " << hashes_offset;
+    return VERIFY_FAILURE;
+  }
+  SHA256(hashes, hashes_size, sha256);
+  if (memcmp(sha256, data + 24, SHA256_DIGEST_LENGTH) != 0) {
+    LOG(ERROR) << "Chunk hashes don't match the chunk manifest";
+    return VERIFY_FAILURE;
+  }
+
+  manifest->chunk_size = chunk_size;
+  manifest->signed_len = signed_len;
+  manifest->hashes_offset = hashes_offset;
+  return VERIFY_SUCCESS;
+}
+
+bool CheckChunk(const ChunkManifest& manifest, size_t index, const uint8_t* data) {
+  CHECK_LT(index, manifest.hashes.size());
+  uint64_t start = static_cast<uint64_t>(index) * manifest.chunk_size;
+  uint64_t end = std::min<uint64_t>(start + manifest.chunk_size, manifest.signed_len);
+
+  // The part of the chunk that holds the chunk hashes, if any.
+  uint64_t hashes_end = manifest.hashes_offset + manifest.hashes.size() * SHA256_DIGEST_LENGTH;
+  uint64_t overlap_start = std::clamp(manifest.hashes_offset, start, end);
+  uint64_t overlap_end = std::clamp(hashes_end, start, end);
+
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, data, overlap_start - start);
+  if (overlap_start < overlap_end) {
+    auto hashes = reinterpret_cast<const uint8_t*>(manifest.hashes.data());
+    if (memcmp(data + (overlap_start - start), hashes + (overlap_start - manifest.hashes_offset),
+               overlap_end - overlap_start) != 0) {
+      return false;
+    }
+    static constexpr uint8_t kZeroes[4096] = {};
+    for (uint64_t pos = overlap_start; pos < overlap_end; pos += sizeof(kZeroes)) {
+      SHA256_Update(&ctx, kZeroes, std::min<uint64_t>(overlap_end - pos, sizeof(kZeroes)));
+    }
+  }
+  SHA256_Update(&ctx, data + (overlap_end - start), end - overlap_end);
+
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, &ctx);
+  return memcmp(hash, manifest.hashes[index].data(), SHA256_DIGEST_LENGTH) == 0;
+}
+
 static std::vector<Certificate> IterateZipEntriesAndSearchForKeys(const ZipArchiveHandle& handle) {
   void* cookie{};
 
@@ -18,9 +18,16 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <utime.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
@@ -33,6 +40,119 @@
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+// The number of threads inflating the entries, and the number of files created ahead of them.
+static constexpr size_t EXTRACT_THREADS = 4;
+static constexpr size_t MAX_PENDING_FILES = 16;
+
+namespace {
+
+// Inflates the queued entries into their files on a pool of threads. The entries only need the
+// zip handle to read from, which libziparchive does with pread (or from memory), so they can be
+// extracted concurrently.
+class ExtractWorkers {
+ public:
+  ExtractWorkers(ZipArchiveHandle zip, const struct utimbuf* timestamp)
+      : zip_(zip), timestamp_(timestamp) {
+    for (size_t i = 0; i < EXTRACT_THREADS; i++) {
+      threads_.emplace_back(&ExtractWorkers::Run, this);
+    }
+  }
+
+  // Abandons the entries not started yet, and waits for the ones in progress.
+  ~ExtractWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.clear();
+      done_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // Queues |entry| to be inflated into |fd|, which is open for |path|, waiting while too many files
+  // are pending. Returns false if an earlier entry has failed.
+  bool Add(const ZipEntry& entry, std::string path, android::base::unique_fd fd) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return failed_ || queue_.size() < MAX_PENDING_FILES; });
+    if (failed_) {
+      return false;
+    }
+    queue_.push_back(Job{ entry, std::move(path), std::move(fd) });
+    cv_.notify_all();
+    return true;
+  }
+
+  // Waits for all the queued entries. Returns false if any of them failed.
+  bool Finish() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return failed_ || (queue_.empty() && busy_ == 0); });
+    return !failed_;
+  }
+
+ private:
+  struct Job {
+    ZipEntry entry;
+    std::string path;
+    android::base::unique_fd fd;
+  };
+
+  bool Extract(Job* job) {
+    int err = ExtractEntryToFile(zip_, &job->entry, job->fd);
+    if (err != 0) {
+      LOG(ERROR) << "Error extracting \"" << job->path << "\" : " << ErrorCodeString(err);
+      return false;
+    }
+
+    if (timestamp_ != nullptr && utime(job->path.c_str(), timestamp_)) {
+      PLOG(ERROR) << "Error touching \"" << job->path << "\"";
+      return false;
+    }
+
+    LOG(INFO) << "Extracted file \"" << job->path << "\"";
+    return true;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return done_ || !queue_.empty(); });
+      if (done_) {
+        return;
+      }
+      Job job = std::move(queue_.front());
+      queue_.pop_front();
+      busy_++;
+      lock.unlock();
+
+      bool success = Extract(&job);
+      job.fd.reset();
+
+      lock.lock();
+      busy_--;
+      if (!success) {
+        failed_ = true;
+        queue_.clear();
+      }
+      cv_.notify_all();
+    }
+  }
+
+  ZipArchiveHandle zip_;
+  const struct utimbuf* timestamp_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  size_t busy_ = 0;
+  bool failed_ = false;
+  bool done_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
                              struct selabel_handle* sehnd) {
@@ -62,6 +182,11 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
   }
 
   std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+  // The files are created here, one at a time, since the SELinux context to create them with is a
+  // per-thread state; only the inflating is left to the workers. The directories that have been
+  // created (or found) are remembered, so that the files in the same directory don't check again.
+  ExtractWorkers workers(zip, timestamp);
+  std::unordered_set<std::string> created_dirs;
   ZipEntry entry;
   std::string name;
   int extractCount = 0;
@@ -73,9 +198,13 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
       continue;
     }
 
-    if (mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
-      LOG(ERROR) << "failed to create dir for " << path;
-      return false;
+    std::string dir = path.substr(0, path.rfind('/'));
+    if (created_dirs.count(dir) == 0) {
+      if (mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
+        LOG(ERROR) << "failed to create dir for " << path;
+        return false;
+      }
+      created_dirs.insert(std::move(dir));
     }
 
     char* secontext = NULL;
@@ -93,24 +222,24 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
       setfscreatecon(NULL);
     }
 
-    int err = ExtractEntryToFile(zip, &entry, fd);
-    if (err != 0) {
-      LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
+    if (!workers.Add(entry, std::move(path), std::move(fd))) {
       return false;
     }
+    ++extractCount;
+  }
 
-    if (fsync(fd) != 0) {
-      PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
-      return false;
-    }
+  if (!workers.Finish()) {
+    return false;
+  }
 
-    if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-      PLOG(ERROR) << "Error touching \"" << path << "\"";
+  // Sync all the files at once, rather than one by one as they get extracted. With nothing
+  // extracted, |dest_path| may not even exist.
+  if (extractCount > 0) {
+    android::base::unique_fd dir_fd(open(target_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd == -1 || syncfs(dir_fd) != 0) {
+      PLOG(ERROR) << "Error syncing the files extracted to \"" << dest_path << "\"";
       return false;
     }
-
-    LOG(INFO) << "Extracted file \"" << path << "\"";
-    ++extractCount;
   }
 
   LOG(INFO) << "Extracted " << extractCount << " file(s)";
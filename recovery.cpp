@@ -941,25 +941,43 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
       }
 
       bool should_use_fuse = false;
+      auto set_progress = std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1);
       if (!SetupPackageMount(update_package, &should_use_fuse)) {
         LOG(INFO) << "Failed to set up the package access, skipping installation";
         status = INSTALL_ERROR;
-      } else if (install_with_fuse || should_use_fuse) {
-        LOG(INFO) << "Installing package " << update_package << " with fuse";
-        status = InstallWithFuseFromPath(update_package, device);
-      } else if (auto memory_package = Package::CreateMemoryPackage(
-                     update_package,
-                     std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
-                 memory_package != nullptr) {
-        status = InstallPackage(memory_package.get(), update_package, should_wipe_cache,
-                                retry_count, device);
       } else {
-        // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size.
-        // In such cases, we will try to install the package with fuse. This is not the default
-        // installation method because it introduces a layer of indirection from the kernel space.
-        LOG(WARNING) << "Failed to memory map package " << update_package
-                     << "; falling back to install with fuse";
-        status = InstallWithFuseFromPath(update_package, device);
+        // A block map from uncrypt is read straight from the block device, in large reads rather
+        // than page faults, even where FUSE has been asked for.
+        bool use_fuse = install_with_fuse || should_use_fuse;
+        std::unique_ptr<Package> package;
+        if (update_package[0] == '@') {
+          package = Package::CreateBlockMapPackage(update_package, set_progress);
+          if (package == nullptr) {
+            LOG(WARNING) << "Failed to read block map package " << update_package
+                         << " from the block device";
+          }
+        }
+        if (package == nullptr && !use_fuse) {
+          package = Package::CreateMemoryPackage(update_package, set_progress);
+          if (package == nullptr) {
+            LOG(WARNING) << "Failed to memory map package " << update_package;
+          }
+        }
+
+        if (package != nullptr) {
+          status = InstallPackage(package.get(), update_package, should_wipe_cache, retry_count,
+                                  device);
+        } else if (use_fuse) {
+          LOG(INFO) << "Installing package " << update_package << " with fuse";
+          status = InstallWithFuseFromPath(update_package, device);
+        } else {
+          // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size,
+          // or be denied direct access to the block device for a block map. In such cases, we
+          // will try to install the package with fuse. This is not the default installation
+          // method because it introduces a layer of indirection from the kernel space.
+          LOG(WARNING) << "Falling back to install " << update_package << " with fuse";
+          status = InstallWithFuseFromPath(update_package, device);
+        }
       }
       if (status != INSTALL_SUCCESS) {
         ui->Print("Installation aborted.\n");
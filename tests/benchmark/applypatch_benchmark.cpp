@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for patch generation (imgdiff, bsdiff) and application (ApplyImagePatch,
+// ApplyBSDiffPatch) over generated corpora. Besides the timing, each benchmark reports the
+// throughput, the patch ratio (patch size / target size) and its own peak RSS.
+//
+// Machine-readable output can be obtained with the standard google-benchmark flags, e.g.
+//   $ applypatch_benchmark --benchmark_format=json --benchmark_out=result.json
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <applypatch/applypatch.h>
+#include <applypatch/deflate_backend.h>
+#include <applypatch/imgdiff.h>
+#include <applypatch/imgpatch.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <ziparchive/zip_writer.h>
+#include <zlib.h>
+
+#include "edify/expr.h"
+
+// The kinds of generated source/target pairs.
+enum class Corpus {
+  kZipSmallEntries,  // A zip with many small deflated entries.
+  kGzipKernel,       // A single large gzipped blob, e.g. a kernel.
+  kBootImage,        // A header page, followed by a gzipped kernel and a gzipped ramdisk.
+  kRandom,           // Incompressible data.
+};
+
+struct CorpusData {
+  std::string src;
+  std::string tgt;
+  bool zip_mode;
+};
+
+// Returns |len| bytes of compressible, text-like data.
+static std::string GenerateCompressible(std::mt19937* rng, size_t len) {
+  static constexpr const char* kWords[] = {
+    "android", "recovery", "update", "partition", "system", "vendor", "boot", "kernel",
+    "ramdisk", "0x00000000", "\n", " ", "{", "}", "return", "if", "int", "static",
+  };
+  std::uniform_int_distribution<size_t> dist(0, sizeof(kWords) / sizeof(kWords[0]) - 1);
+  std::string result;
+  result.reserve(len + 16);
+  while (result.size() < len) {
+    result += kWords[dist(*rng)];
+  }
+  result.resize(len);
+  return result;
+}
+
+static std::string GenerateRandom(std::mt19937* rng, size_t len) {
+  std::string result(len, '\0');
+  for (auto& c : result) {
+    c = static_cast<char>((*rng)() & 0xff);
+  }
+  return result;
+}
+
+// Modifies about |percent| percent of |data|, in small runs, to simulate a new build.
+static void Mutate(std::mt19937* rng, std::string* data, size_t percent) {
+  if (data->empty()) return;
+  std::uniform_int_distribution<size_t> pos_dist(0, data->size() - 1);
+  size_t runs = data->size() * percent / 100 / 16;
+  for (size_t i = 0; i < runs; i++) {
+    size_t pos = pos_dist(*rng);
+    for (size_t j = pos; j < pos + 16 && j < data->size(); j++) {
+      (*data)[j] = static_cast<char>((*rng)() & 0xff);
+    }
+  }
+}
+
+// Returns the gzip'd |data|, with a plain 10-byte header that imgdiff can recognize.
+static std::string Gzip(const std::string& data) {
+  z_stream strm = {};
+  CHECK_EQ(Z_OK, deflateInit2(&strm, 6, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY));
+  std::string result(deflateBound(&strm, data.size()), '\0');
+  strm.next_in = reinterpret_cast<const uint8_t*>(data.data());
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<uint8_t*>(result.data());
+  strm.avail_out = result.size();
+  CHECK_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  result.resize(strm.total_out);
+  deflateEnd(&strm);
+  return result;
+}
+
+static std::string MakeZip(const std::map<std::string, std::string>& entries) {
+  TemporaryFile temp_file;
+  FILE* fp = fdopen(temp_file.release(), "wb");
+  CHECK(fp != nullptr);
+  ZipWriter writer(fp);
+  for (const auto& [name, content] : entries) {
+    CHECK_EQ(0, writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    CHECK_EQ(0, writer.WriteBytes(content.data(), content.size()));
+    CHECK_EQ(0, writer.FinishEntry());
+  }
+  CHECK_EQ(0, writer.Finish());
+  CHECK_EQ(0, fclose(fp));
+
+  std::string result;
+  CHECK(android::base::ReadFileToString(temp_file.path, &result));
+  return result;
+}
+
+static std::string MakeBootImage(const std::string& kernel, const std::string& ramdisk) {
+  std::string header = "ANDROID!" + std::string(4096 - 8, '\0');
+  std::string image = header + Gzip(kernel) + Gzip(ramdisk);
+  image.resize((image.size() + 4095) / 4096 * 4096, '\0');
+  return image;
+}
+
+// Returns the generated corpus. Only the last one is kept around, so that the others don't add
+// up in the RSS of the benchmarks that follow.
+static const CorpusData& GetCorpus(Corpus corpus) {
+  static std::map<Corpus, CorpusData> cache;
+  auto it = cache.find(corpus);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  cache.clear();
+
+  std::mt19937 rng(static_cast<uint32_t>(corpus));
+  CorpusData data{};
+  switch (corpus) {
+    case Corpus::kZipSmallEntries: {
+      std::map<std::string, std::string> src_entries;
+      std::map<std::string, std::string> tgt_entries;
+      for (size_t i = 0; i < 500; i++) {
+        std::string name = android::base::StringPrintf("res/raw/entry_%04zu", i);
+        std::string content = GenerateCompressible(&rng, 2048 + (rng() % 8192));
+        src_entries[name] = content;
+        if (i % 10 == 0) Mutate(&rng, &content, 5);
+        tgt_entries[name] = content;
+      }
+      data.src = MakeZip(src_entries);
+      data.tgt = MakeZip(tgt_entries);
+      data.zip_mode = true;
+      break;
+    }
+    case Corpus::kGzipKernel: {
+      std::string kernel = GenerateCompressible(&rng, 16 * 1024 * 1024);
+      data.src = Gzip(kernel);
+      Mutate(&rng, &kernel, 2);
+      data.tgt = Gzip(kernel);
+      break;
+    }
+    case Corpus::kBootImage: {
+      std::string kernel = GenerateCompressible(&rng, 12 * 1024 * 1024);
+      std::string ramdisk = GenerateCompressible(&rng, 4 * 1024 * 1024);
+      data.src = MakeBootImage(kernel, ramdisk);
+      Mutate(&rng, &kernel, 2);
+      Mutate(&rng, &ramdisk, 1);
+      data.tgt = MakeBootImage(kernel, ramdisk);
+      break;
+    }
+    case Corpus::kRandom: {
+      data.src = GenerateRandom(&rng, 8 * 1024 * 1024);
+      data.tgt = data.src;
+      Mutate(&rng, &data.tgt, 5);
+      break;
+    }
+  }
+  return cache.emplace(corpus, std::move(data)).first->second;
+}
+
+static std::string MakeImgdiffPatch(const CorpusData& corpus) {
+  TemporaryFile src_file;
+  TemporaryFile tgt_file;
+  TemporaryFile patch_file;
+  CHECK(android::base::WriteStringToFile(corpus.src, src_file.path));
+  CHECK(android::base::WriteStringToFile(corpus.tgt, tgt_file.path));
+  std::vector<const char*> args = { "imgdiff" };
+  if (corpus.zip_mode) args.push_back("-z");
+  args.insert(args.end(), { src_file.path, tgt_file.path, patch_file.path });
+  CHECK_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+  return patch;
+}
+
+static std::string MakeBSDiffPatch(const CorpusData& corpus) {
+  TemporaryFile patch_file;
+  CHECK_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(corpus.src.data()), corpus.src.size(),
+                             reinterpret_cast<const uint8_t*>(corpus.tgt.data()), corpus.tgt.size(),
+                             patch_file.path, nullptr));
+  std::string patch;
+  CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+  return patch;
+}
+
+// Returns the value in KiB of |field| (e.g. "VmHWM") in /proc/self/status, or -1.
+static int64_t ReadStatusKb(const std::string& field) {
+  std::string status;
+  if (!android::base::ReadFileToString("/proc/self/status", &status)) {
+    return -1;
+  }
+  for (const auto& line : android::base::Split(status, "\n")) {
+    if (android::base::StartsWith(line, field + ":")) {
+      // For example "VmHWM:\t  123456 kB".
+      std::string value_kb = android::base::Trim(line.substr(field.size() + 1));
+      int64_t value;
+      if (android::base::ParseInt(value_kb.substr(0, value_kb.find(' ')), &value)) {
+        return value;
+      }
+    }
+  }
+  return -1;
+}
+
+// Measures the peak RSS of a single benchmark run, from its construction. The high-water mark from
+// getrusage() covers the whole process, i.e. the largest benchmark so far; instead the kernel's
+// VmHWM is reset to the current RSS through /proc/self/clear_refs.
+class PeakRssMeter {
+ public:
+  PeakRssMeter()
+      : reset_(android::base::WriteStringToFile("5", "/proc/self/clear_refs")),
+        start_kb_(ReadStatusKb("VmRSS")) {}
+
+  // Reports the peak RSS, and how much the run added to the RSS it started with, which leaves out
+  // the corpus.
+  void Report(benchmark::State& state) const {
+    int64_t peak_kb = ReadStatusKb("VmHWM");
+    if (!reset_ || peak_kb < 0 || start_kb_ < 0) {
+      return;
+    }
+    state.counters["peak_rss_kb"] = peak_kb;
+    state.counters["peak_rss_growth_kb"] = peak_kb - start_kb_;
+  }
+
+ private:
+  bool reset_;
+  int64_t start_kb_;
+};
+
+// Reports the throughput over the target size, the patch ratio and the peak RSS.
+static void ReportCounters(benchmark::State& state, const CorpusData& corpus, size_t patch_size,
+                           const PeakRssMeter& rss_meter) {
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * corpus.tgt.size());
+  state.counters["patch_ratio"] = static_cast<double>(patch_size) / corpus.tgt.size();
+  state.counters["patch_bytes"] = patch_size;
+  rss_meter.Report(state);
+}
+
+static void BM_Imgdiff(benchmark::State& state, Corpus corpus_type) {
+  const CorpusData& corpus = GetCorpus(corpus_type);
+  size_t patch_size = 0;
+  PeakRssMeter rss_meter;
+  for (auto _ : state) {
+    patch_size = MakeImgdiffPatch(corpus).size();
+  }
+  ReportCounters(state, corpus, patch_size, rss_meter);
+}
+
+static void BM_ApplyImagePatch(benchmark::State& state, Corpus corpus_type) {
+  const CorpusData& corpus = GetCorpus(corpus_type);
+  Value patch(Value::Type::BLOB, MakeImgdiffPatch(corpus));
+  PeakRssMeter rss_meter;
+  for (auto _ : state) {
+    size_t written = 0;
+    int result = ApplyImagePatch(reinterpret_cast<const unsigned char*>(corpus.src.data()),
+                                 corpus.src.size(), patch,
+                                 [&written](const unsigned char* /* data */, size_t len) {
+                                   written += len;
+                                   return len;
+                                 },
+                                 nullptr);
+    if (result != 0 || written != corpus.tgt.size()) {
+      state.SkipWithError("Failed to apply imgdiff patch");
+      return;
+    }
+  }
+  ReportCounters(state, corpus, patch.data.size(), rss_meter);
+}
+
+static void BM_BSDiff(benchmark::State& state, Corpus corpus_type) {
+  const CorpusData& corpus = GetCorpus(corpus_type);
+  size_t patch_size = 0;
+  PeakRssMeter rss_meter;
+  for (auto _ : state) {
+    patch_size = MakeBSDiffPatch(corpus).size();
+  }
+  ReportCounters(state, corpus, patch_size, rss_meter);
+}
+
+static void BM_ApplyBSDiffPatch(benchmark::State& state, Corpus corpus_type) {
+  const CorpusData& corpus = GetCorpus(corpus_type);
+  Value patch(Value::Type::BLOB, MakeBSDiffPatch(corpus));
+  PeakRssMeter rss_meter;
+  for (auto _ : state) {
+    size_t written = 0;
+    int result = ApplyBSDiffPatch(reinterpret_cast<const unsigned char*>(corpus.src.data()),
+                                  corpus.src.size(), patch, 0,
+                                  [&written](const unsigned char* /* data */, size_t len) {
+                                    written += len;
+                                    return len;
+                                  });
+    if (result != 0 || written != corpus.tgt.size()) {
+      state.SkipWithError("Failed to apply bsdiff patch");
+      return;
+    }
+  }
+  ReportCounters(state, corpus, patch.data.size(), rss_meter);
+}
+
+// Measures a deflate backend with the parameters that imgdiff records for deflate chunks. It's
+// registered once per available backend (see main()), so that the backends can be compared.
+static void BM_DeflateBackend(benchmark::State& state, const DeflateBackend* backend) {
+
+  std::mt19937 rng(0);
+  const std::string input = GenerateCompressible(&rng, 16 * 1024 * 1024);
+  const DeflateParams params{ static_cast<int>(state.range(0)), Z_DEFLATED, -15, 8,
+                              Z_DEFAULT_STRATEGY };
+  if (!backend->MatchesZlib(params)) {
+    state.SkipWithError("Backend doesn't match zlib for the given parameters");
+    return;
+  }
+
+  std::vector<uint8_t> buffer;
+  size_t compressed_size = 0;
+  for (auto _ : state) {
+    std::unique_ptr<DeflateStream> stream = backend->CreateStream(params);
+    compressed_size = 0;
+    if (!stream ||
+        !stream->Deflate(reinterpret_cast<const uint8_t*>(input.data()), input.size(), true,
+                         &buffer, [&compressed_size](const uint8_t* /* data */, size_t len) {
+                           compressed_size += len;
+                           return true;
+                         })) {
+      state.SkipWithError("Failed to deflate");
+      return;
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * input.size());
+  state.counters["ratio"] = static_cast<double>(compressed_size) / input.size();
+}
+
+#define CORPUS_BENCHMARKS(fn)                                                          \
+  BENCHMARK_CAPTURE(fn, zip_small_entries, Corpus::kZipSmallEntries)                   \
+      ->Unit(benchmark::kMillisecond);                                                 \
+  BENCHMARK_CAPTURE(fn, gzip_kernel, Corpus::kGzipKernel)->Unit(benchmark::kMillisecond); \
+  BENCHMARK_CAPTURE(fn, boot_image, Corpus::kBootImage)->Unit(benchmark::kMillisecond);   \
+  BENCHMARK_CAPTURE(fn, random, Corpus::kRandom)->Unit(benchmark::kMillisecond)
+
+CORPUS_BENCHMARKS(BM_Imgdiff);
+CORPUS_BENCHMARKS(BM_ApplyImagePatch);
+CORPUS_BENCHMARKS(BM_BSDiff);
+CORPUS_BENCHMARKS(BM_ApplyBSDiffPatch);
+
+
+int main(int argc, char** argv) {
+  // imgdiff is chatty at INFO level, which would interfere with the benchmark output.
+  android::base::InitLogging(argv);
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  for (const DeflateBackend* backend : GetDeflateBackends()) {
+    benchmark::RegisterBenchmark(
+        android::base::StringPrintf("BM_DeflateBackend/%s", backend->Name()).c_str(),
+        BM_DeflateBackend, backend)
+        ->Arg(6)
+        ->Arg(9)
+        ->Unit(benchmark::kMillisecond);
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
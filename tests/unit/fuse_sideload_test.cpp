@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -23,7 +25,9 @@
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
 
+#include "fuse_block_cache.h"
 #include "fuse_provider.h"
 #include "fuse_sideload.h"
 
@@ -110,3 +114,166 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload_large_reads) {
+  // 2.5 MiB, so that reads of the max size (1 MiB) span many blocks.
+  std::string content(2560 * 1024 + 100, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.path));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  struct stat sb;
+  for (int i = 0; stat(package.c_str(), &sb) != 0; i++) {
+    ASSERT_LT(i, 10) << "Timed out waiting for the fuse-provided package.";
+    sleep(1);
+  }
+
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY | O_DIRECT));
+  ASSERT_NE(-1, fd);
+  // Direct reads reach us at the size requested, up to max_read. Unaligned ones go through the
+  // page cache, and still span many blocks.
+  for (auto [offset, size] : std::vector<std::pair<size_t, size_t>>{
+           { 0, 1024 * 1024 }, { 1024 * 1024, 1536 * 1024 + 100 }, { 12345, 1000000 } }) {
+    std::string buffer(size, '\0');
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), size, offset));
+    ASSERT_EQ(content.substr(offset, size), buffer);
+  }
+  fd.reset();
+
+  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
+// Serves blocks of a string, and counts the reads.
+class FuseStringDataProvider : public FuseDataProvider {
+ public:
+  FuseStringDataProvider(const std::string& content, uint32_t block_size)
+      : FuseDataProvider(content.size(), block_size), content_(content) {}
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    // The cache must never read from two threads at once.
+    EXPECT_FALSE(busy_.exchange(true));
+    reads_++;
+    memcpy(buffer, content_.data() + static_cast<size_t>(start_block) * fuse_block_size_,
+           fetch_size);
+    busy_ = false;
+    return true;
+  }
+
+  bool Valid() const override {
+    return true;
+  }
+
+  size_t reads() const {
+    return reads_;
+  }
+
+ private:
+  std::string content_;
+  mutable std::atomic<bool> busy_{ false };
+  mutable std::atomic<size_t> reads_{ 0 };
+};
+
+TEST(FuseBlockCacheTest, Get_lru) {
+  // 3.5 blocks.
+  std::string content(4096 * 3 + 2048, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i / 4096 + 'a');
+  }
+  FuseStringDataProvider provider(content, 4096);
+  std::vector<uint32_t> validated;
+  FuseBlockCache cache(&provider, 2, 0,
+                       [&validated](uint32_t block, const uint8_t*, const FuseBlockCache::Digest&) {
+                         validated.push_back(block);
+                         return block != 2;
+                       });
+
+  FuseBlockCache::BlockData data = cache.Get(0);
+  ASSERT_NE(nullptr, data);
+  ASSERT_EQ(content.substr(0, 4096), std::string(data->begin(), data->end()));
+  FuseBlockCache::BlockData block1 = cache.Get(1);
+  ASSERT_NE(nullptr, block1);
+  ASSERT_NE(nullptr, cache.Get(0));
+  ASSERT_EQ(2U, provider.reads());
+
+  // Block 3 evicts block 1, the least recently used one. It reads as zero-padded.
+  data = cache.Get(3);
+  ASSERT_NE(nullptr, data);
+  ASSERT_EQ(content.substr(4096 * 3) + std::string(2048, '\0'),
+            std::string(data->begin(), data->end()));
+  // The evicted data stays valid while referenced.
+  ASSERT_EQ(content.substr(4096, 4096), std::string(block1->begin(), block1->end()));
+  ASSERT_NE(nullptr, cache.Get(0));
+  ASSERT_NE(nullptr, cache.Get(1));
+  ASSERT_EQ(4U, provider.reads());
+
+  // Blocks that fail the validation are not returned, nor cached.
+  ASSERT_EQ(nullptr, cache.Get(2));
+  ASSERT_EQ(nullptr, cache.Get(2));
+  ASSERT_EQ((std::vector<uint32_t>{ 0, 1, 3, 1, 2, 2 }), validated);
+
+  // Blocks past the end read as zeroes.
+  data = cache.Get(4);
+  ASSERT_NE(nullptr, data);
+  ASSERT_EQ(std::string(4096, '\0'), std::string(data->begin(), data->end()));
+
+  FuseBlockCache::Stats stats = cache.stats();
+  ASSERT_EQ(2U, stats.hits);
+  ASSERT_EQ(6U, stats.misses);
+  ASSERT_EQ(0U, stats.prefetch_hits);
+
+  // Everything is read again after Clear().
+  cache.Clear();
+  ASSERT_NE(nullptr, cache.Get(0));
+  ASSERT_EQ(7U, provider.reads());
+}
+
+TEST(FuseBlockCacheTest, Get_sequential_prefetch) {
+  constexpr size_t kBlocks = 256;
+  std::string content(4096 * kBlocks, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 13 + i / 4096);
+  }
+  FuseStringDataProvider provider(content, 4096);
+  size_t validated = 0;
+  FuseBlockCache cache(&provider, 16, 8,
+                       [&validated](uint32_t, const uint8_t* data,
+                                    const FuseBlockCache::Digest& digest) {
+                         // The digest is computed ahead of time for the prefetched blocks.
+                         FuseBlockCache::Digest expected;
+                         SHA256(data, 4096, expected.data());
+                         EXPECT_EQ(expected, digest);
+                         validated++;
+                         return true;
+                       });
+
+  for (uint32_t block = 0; block < kBlocks; block++) {
+    FuseBlockCache::BlockData data = cache.Get(block);
+    ASSERT_NE(nullptr, data);
+    ASSERT_EQ(content.substr(block * 4096, 4096), std::string(data->begin(), data->end()));
+  }
+
+  // Each block is validated exactly once, whether it was prefetched or not.
+  ASSERT_EQ(kBlocks, validated);
+  FuseBlockCache::Stats stats = cache.stats();
+  ASSERT_EQ(kBlocks, stats.misses + stats.prefetch_hits);
+  ASSERT_EQ(kBlocks, provider.reads());
+  ASSERT_EQ(0U, stats.prefetch_wasted);
+}
@@ -17,6 +17,7 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -25,18 +26,24 @@
 #include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <applypatch/applypatch.h>
+#include <applypatch/deflate_backend.h>
 #include <applypatch/imgdiff.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
 #include <gtest/gtest.h>
 #include <ziparchive/zip_writer.h>
+#include <zlib.h>
 
 #include "common/test_constants.h"
+#include "edify/expr.h"
 
 using android::base::get_unaligned;
 
-static void verify_patch_header(const std::string& patch, size_t* num_normal, size_t* num_raw,
-                                size_t* num_deflate) {
+static void verify_patch_header(
+    const std::string& patch, size_t* num_normal, size_t* num_raw, size_t* num_deflate,
+    size_t* num_copy = nullptr,
+    std::vector<std::vector<uint32_t>>* deflate_dictionaries = nullptr) {
   const size_t size = patch.size();
   const char* data = patch.data();
 
@@ -49,6 +56,8 @@ static void verify_patch_header(const std::string& patch, size_t* num_normal, si
   size_t normal = 0;
   size_t raw = 0;
   size_t deflate = 0;
+  size_t copy = 0;
+  std::vector<std::vector<uint32_t>> dictionaries;
 
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
@@ -70,6 +79,23 @@ static void verify_patch_header(const std::string& patch, size_t* num_normal, si
       pos += 60;
       ASSERT_LE(pos, size);
       deflate++;
+      dictionaries.emplace_back();
+    } else if (type == CHUNK_DEFLATE_DICT) {
+      pos += 60;
+      ASSERT_LE(pos + 4, size);
+      size_t dictionary_count = get_unaligned<uint32_t>(data + pos);
+      pos += 4;
+      ASSERT_LE(pos + dictionary_count * 4, size);
+      std::vector<uint32_t> indices;
+      for (size_t k = 0; k < dictionary_count; k++, pos += 4) {
+        indices.push_back(get_unaligned<uint32_t>(data + pos));
+      }
+      deflate++;
+      dictionaries.push_back(std::move(indices));
+    } else if (type == CHUNK_COPY) {
+      pos += 16;
+      ASSERT_LE(pos, size);
+      copy++;
     } else {
       FAIL() << "Invalid patch type: " << type;
     }
@@ -78,6 +104,23 @@ static void verify_patch_header(const std::string& patch, size_t* num_normal, si
   if (num_normal != nullptr) *num_normal = normal;
   if (num_raw != nullptr) *num_raw = raw;
   if (num_deflate != nullptr) *num_deflate = deflate;
+  if (num_copy != nullptr) *num_copy = copy;
+  if (deflate_dictionaries != nullptr) *deflate_dictionaries = std::move(dictionaries);
+}
+
+// Compresses |data| into a gzip stream that imgdiff can reconstruct (level 6, default parameters).
+static std::string gzip_string(const std::string& data) {
+  z_stream strm = {};
+  EXPECT_EQ(Z_OK, deflateInit2(&strm, 6, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY));
+  std::string result(deflateBound(&strm, data.size()) + GZIP_HEADER_LEN + GZIP_FOOTER_LEN, '\0');
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<Bytef*>(result.data());
+  strm.avail_out = result.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  result.resize(strm.total_out);
+  deflateEnd(&strm);
+  return result;
 }
 
 static void GenerateTarget(const std::string& src, const std::string& patch, std::string* patched) {
@@ -383,6 +426,116 @@ TEST(ImgdiffTest, image_mode_simple) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, image_mode_with_dictionaries) {
+  // Two gzipped chunks. Each target chunk adds a random block that only appears in one of the
+  // dictionaries.
+  std::string random0;
+  generate_n(back_inserter(random0), 8192, []() { return rand() % 256; });
+  std::string random1;
+  generate_n(back_inserter(random1), 8192, []() { return rand() % 256; });
+  const std::string text0(20000, 'a');
+  const std::string text1(20000, 'b');
+
+  const std::string src = "abcdefg" + gzip_string(text0) + "hijklmn" + gzip_string(text1);
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  const std::string tgt =
+      "abcdefg" + gzip_string(text0 + random1) + "hijklmn" + gzip_string(random0 + text1);
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile dict0_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(random0, dict0_file.path));
+  TemporaryFile dict1_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(random1, dict1_file.path));
+
+  // Dictionaries can't be used together with the bonus file.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-b", dict0_file.path, "--dict", dict1_file.path,
+    src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(2, imgdiff(args.size(), args.data()));
+
+  args = {
+    "imgdiff", "--dict", dict0_file.path, "--dict", dict1_file.path,
+    src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  // Each chunk only refers to the dictionary that it uses.
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  size_t num_deflate;
+  std::vector<std::vector<uint32_t>> dictionaries;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate, nullptr, &dictionaries);
+  ASSERT_EQ(2U, num_deflate);
+  ASSERT_EQ((std::vector<std::vector<uint32_t>>{ { 1 }, { 0 } }), dictionaries);
+
+  Value patch_value(Value::Type::BLOB, patch);
+  Value dict0_value(Value::Type::BLOB, random0);
+  Value dict1_value(Value::Type::BLOB, random1);
+  std::string patched;
+  auto sink = [&patched](const unsigned char* data, size_t len) {
+    patched.append(reinterpret_cast<const char*>(data), len);
+    return len;
+  };
+  ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                               patch_value, sink,
+                               std::vector<const Value*>{ &dict0_value, &dict1_value }));
+  ASSERT_EQ(tgt, patched);
+
+  // Missing dictionary.
+  ASSERT_EQ(-1, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                                patch_value, sink, std::vector<const Value*>{ &dict0_value }));
+
+  // Dictionaries in the wrong order won't give the target.
+  patched.clear();
+  int result = ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                               patch_value, sink,
+                               std::vector<const Value*>{ &dict1_value, &dict0_value });
+  ASSERT_TRUE(result != 0 || patched != tgt);
+}
+
+TEST(ImgdiffTest, image_mode_content_defined_chunking) {
+  // Printable bytes only, so that no gzip magic shows up in the image.
+  std::string src(4 * 1024 * 1024, '\0');
+  uint32_t seed = 12345;
+  for (auto& c : src) {
+    seed = seed * 1103515245 + 12345;
+    c = static_cast<char>(0x20 + (seed >> 16) % 0x5f);
+  }
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  // Insert, modify and delete a few ranges; everything else is shifted but unchanged.
+  std::string tgt = src;
+  tgt.insert(512 * 1024, "inserted bytes that shift the rest of the image");
+  tgt.replace(1536 * 1024, 4096, std::string(4096, 'x'));
+  tgt.erase(3 * 1024 * 1024, 10000);
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "--cdc", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  ASSERT_LT(patch.size(), tgt.size() / 4);
+
+  // The unchanged pieces should be carried over as CHUNK_COPY entries.
+  size_t num_deflate;
+  size_t num_copy;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate, &num_copy);
+  ASSERT_EQ(0U, num_deflate);
+  ASSERT_LE(2U, num_copy);
+
+  verify_patched_image(src, patch, tgt);
+}
+
 TEST(ImgdiffTest, image_mode_bad_gzip) {
   // Modify the uncompressed length in the gzip footer.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
@@ -677,6 +830,84 @@ TEST(ImgpatchTest, image_mode_patch_corruption) {
                                 [](const unsigned char* /*data*/, size_t len) { return len; }));
 }
 
+// A deflate backend that delegates to stock zlib, while counting the streams it creates.
+class CountingDeflateBackend : public DeflateBackend {
+ public:
+  explicit CountingDeflateBackend(bool matches_zlib) : matches_zlib_(matches_zlib) {}
+
+  const char* Name() const override {
+    return "counting";
+  }
+
+  bool MatchesZlib(const DeflateParams& /* params */) const override {
+    return matches_zlib_;
+  }
+
+  std::unique_ptr<DeflateStream> CreateStream(const DeflateParams& params) const override {
+    streams_created_++;
+    return GetZlibDeflateBackend()->CreateStream(params);
+  }
+
+  size_t streams_created() const {
+    return streams_created_;
+  }
+
+ private:
+  bool matches_zlib_;
+  mutable size_t streams_created_{ 0 };
+};
+
+TEST(ImgpatchTest, accelerated_deflate_backend) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  const std::string src = "abcdefg" + gzipped_source;
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+  const std::string tgt = "abcdefgxyz" + gzipped_target;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // The accelerated backend is used when it matches stock zlib.
+  CountingDeflateBackend matching_backend(true);
+  SetAcceleratedDeflateBackend(&matching_backend);
+  verify_patched_image(src, patch, tgt);
+  ASSERT_EQ(1U, matching_backend.streams_created());
+
+  // But not when the caller asks for stock zlib.
+  Value patch_value(Value::Type::BLOB, patch);
+  std::string patched;
+  ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                               patch_value,
+                               [&](const unsigned char* data, size_t len) {
+                                 patched.append(reinterpret_cast<const char*>(data), len);
+                                 return len;
+                               },
+                               nullptr, false));
+  ASSERT_EQ(tgt, patched);
+  ASSERT_EQ(1U, matching_backend.streams_created());
+
+  // Nor when the backend doesn't match stock zlib for the chunk parameters.
+  CountingDeflateBackend mismatching_backend(false);
+  SetAcceleratedDeflateBackend(&mismatching_backend);
+  verify_patched_image(src, patch, tgt);
+  ASSERT_EQ(0U, mismatching_backend.streams_created());
+
+  SetAcceleratedDeflateBackend(nullptr);
+}
+
 static void construct_store_entry(const std::vector<std::tuple<std::string, size_t, char>>& info,
                                   ZipWriter* writer) {
   for (auto& t : info) {
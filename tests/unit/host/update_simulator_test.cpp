@@ -154,10 +154,9 @@ TEST_F(DISABLED_UpdateSimulatorTest, TargetFile_ExtractImage) {
   TargetFile target_file(zip_file.path, false);
   ASSERT_TRUE(target_file.Open());
 
-  TemporaryDir temp_dir;
   TemporaryFile raw_image;
-  ASSERT_TRUE(target_file.ExtractImage(
-      "IMAGES/system.img", FstabInfo("/dev/system", "system", "ext4"), temp_dir.path, &raw_image));
+  ASSERT_TRUE(target_file.ExtractImage("IMAGES/system.img",
+                                       FstabInfo("/dev/system", "system", "ext4"), &raw_image));
 
   // Check the raw image has expected contents.
   string content;
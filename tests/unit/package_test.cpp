@@ -15,28 +15,39 @@
  */
 
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <gtest/gtest.h>
 #include <openssl/sha.h>
 #include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
+#include "fuse_provider.h"
+#include "fuse_sideload.h"
 #include "otautil/package.h"
 
 class PackageTest : public ::testing::Test {
  protected:
   void SetUp() override;
 
-  // A list of package classes for test, including MemoryPackage and FilePackage.
+  // A list of package classes for test, including MemoryPackage, FilePackage and
+  // BlockMapPackage.
   std::vector<std::unique_ptr<Package>> packages_;
 
   TemporaryFile temp_file_;   // test package file.
   std::string file_content_;  // actual bytes of the package file.
+  TemporaryFile block_map_;   // block map of the package file, as if it were a block device.
 };
 
 void PackageTest::SetUp() {
@@ -59,6 +70,15 @@ void PackageTest::SetUp() {
   auto file_package = Package::CreateFilePackage(temp_file_.path, nullptr);
   ASSERT_TRUE(file_package);
   packages_.emplace_back(std::move(file_package));
+
+  std::string block_map = android::base::StringPrintf(
+      "%s\n%zu 4096\n1\n0 %zu\n", temp_file_.path, file_content_.size(),
+      (file_content_.size() + 4095) / 4096);
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map, block_map_.path));
+  auto block_map_package =
+      Package::CreateBlockMapPackage("@" + std::string(block_map_.path), nullptr);
+  ASSERT_TRUE(block_map_package);
+  packages_.emplace_back(std::move(block_map_package));
 }
 
 TEST_F(PackageTest, ReadFullyAtOffset_success) {
@@ -91,7 +111,7 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
     SHA1_Init(&ctx);
     std::vector<HasherUpdateCallback> hashers{ std::bind(&SHA1_Update, &ctx, std::placeholders::_1,
                                                          std::placeholders::_2) };
-    package->UpdateHashAtOffset(hashers, 0, hash_size);
+    package->UpdateHashAtOffset(hashers, 0, hash_size, nullptr);
 
     std::vector<uint8_t> calculated_sha(SHA_DIGEST_LENGTH);
     SHA1_Final(calculated_sha.data(), &ctx);
@@ -99,6 +119,56 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   }
 }
 
+TEST_F(PackageTest, UpdateHashAtOffset_multiple_hashers) {
+  // A package larger than a single read, to cover the chunk boundaries in FilePackage.
+  std::string content(10 * MiB + 12345, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 7 + (i >> 9));
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  uint64_t offset = 3;
+  uint64_t hash_size = content.size() - 5;
+  std::vector<uint8_t> expected_sha1(SHA_DIGEST_LENGTH);
+  SHA1(reinterpret_cast<uint8_t*>(content.data()) + offset, hash_size, expected_sha1.data());
+  std::vector<uint8_t> expected_sha256(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<uint8_t*>(content.data()) + offset, hash_size, expected_sha256.data());
+
+  std::vector<std::unique_ptr<Package>> packages;
+  packages.emplace_back(Package::CreateMemoryPackage(temp_file.path, nullptr));
+  packages.emplace_back(Package::CreateFilePackage(temp_file.path, nullptr));
+  for (const auto& package : packages) {
+    ASSERT_TRUE(package);
+    SHA_CTX sha1_ctx;
+    SHA1_Init(&sha1_ctx);
+    SHA256_CTX sha256_ctx;
+    SHA256_Init(&sha256_ctx);
+    std::vector<HasherUpdateCallback> hashers{
+      std::bind(&SHA1_Update, &sha1_ctx, std::placeholders::_1, std::placeholders::_2),
+      std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2),
+    };
+    std::vector<uint64_t> progress;
+    ASSERT_TRUE(package->UpdateHashAtOffset(hashers, offset, hash_size,
+                                            [&progress](uint64_t so_far) {
+                                              progress.push_back(so_far);
+                                            }));
+    ASSERT_FALSE(progress.empty());
+    ASSERT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+    ASSERT_EQ(hash_size, progress.back());
+
+    std::vector<uint8_t> calculated_sha1(SHA_DIGEST_LENGTH);
+    SHA1_Final(calculated_sha1.data(), &sha1_ctx);
+    ASSERT_EQ(expected_sha1, calculated_sha1);
+    std::vector<uint8_t> calculated_sha256(SHA256_DIGEST_LENGTH);
+    SHA256_Final(calculated_sha256.data(), &sha256_ctx);
+    ASSERT_EQ(expected_sha256, calculated_sha256);
+
+    // Out of bound read.
+    ASSERT_FALSE(package->UpdateHashAtOffset(hashers, offset, content.size(), nullptr));
+  }
+}
+
 TEST_F(PackageTest, GetZipArchiveHandle_extract_entry) {
   for (const auto& package : packages_) {
     ZipArchiveHandle zip = package->GetZipArchiveHandle();
@@ -114,3 +184,161 @@ TEST_F(PackageTest, GetZipArchiveHandle_extract_entry) {
     ASSERT_EQ(entry_name, std::string(extracted.begin(), extracted.end()));
   }
 }
+
+TEST_F(PackageTest, AdviseEntry) {
+  for (const auto& package : packages_) {
+    ASSERT_TRUE(package->AdviseEntry("dir1/file3.txt", PackageAccess::kWillNeed));
+    ASSERT_FALSE(package->AdviseEntry("dir1/file4.txt", PackageAccess::kWillNeed));
+
+    // Hints never change what's read back, even for pages that have been dropped.
+    package->Advise(0, file_content_.size(), PackageAccess::kDontNeed);
+    std::vector<uint8_t> buffer(file_content_.size());
+    ASSERT_TRUE(package->ReadFullyAtOffset(buffer.data(), buffer.size(), 0));
+    ASSERT_EQ(file_content_, std::string(buffer.begin(), buffer.end()));
+  }
+}
+
+// Returns the SHA-256 of the whole |package|.
+static std::vector<uint8_t> HashPackage(Package* package) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  std::vector<HasherUpdateCallback> hashers{ std::bind(&SHA256_Update, &ctx, std::placeholders::_1,
+                                                       std::placeholders::_2) };
+  std::vector<uint8_t> digest(SHA256_DIGEST_LENGTH);
+  if (package->UpdateHashAtOffset(hashers, 0, package->GetPackageSize(), nullptr)) {
+    SHA256_Final(digest.data(), &ctx);
+  }
+  return digest;
+}
+
+// Returns the bytes read by |pid| so far, i.e. the rchar in /proc/<pid>/io.
+static uint64_t GetReadBytes(pid_t pid) {
+  std::string content;
+  if (!android::base::ReadFileToString(android::base::StringPrintf("/proc/%d/io", pid),
+                                       &content)) {
+    return 0;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    uint64_t value;
+    if (android::base::StartsWith(line, "rchar: ") &&
+        android::base::ParseUint(line.substr(7), &value)) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+TEST(BlockMapPackageTest, compare_with_fuse) {
+  // A package spanning several hash reads.
+  std::string entry_data(20 * MiB, '\0');
+  for (size_t i = 0; i < entry_data.size(); i++) {
+    entry_data[i] = static_cast<char>(i * 13 + (i >> 12));
+  }
+  TemporaryFile temp_file;
+  FILE* file_ptr = fdopen(temp_file.release(), "wb");
+  ZipWriter writer(file_ptr);
+  ASSERT_EQ(0, writer.StartEntry("payload.bin", 0));
+  ASSERT_EQ(0, writer.WriteBytes(entry_data.data(), entry_data.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(file_ptr));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+
+  // Scatter the package blocks over a fake block device in three ranges, two of which are
+  // adjacent: [tail] [gap] [head] [middle].
+  constexpr size_t kBlockSize = 4096;
+  size_t blocks = (content.size() + kBlockSize - 1) / kBlockSize;
+  std::string padded = content + std::string(blocks * kBlockSize - content.size(), '\0');
+  size_t head = blocks / 3;
+  size_t middle = blocks / 3;
+  size_t tail = blocks - head - middle;
+  std::string device = padded.substr((head + middle) * kBlockSize) +
+                       std::string(5 * kBlockSize, 'x') +
+                       padded.substr(0, (head + middle) * kBlockSize);
+  TemporaryFile device_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(device, device_file.path));
+
+  TemporaryFile block_map_file;
+  std::string block_map = android::base::StringPrintf(
+      "%s\n%zu %zu\n3\n%zu %zu\n%zu %zu\n0 %zu\n", device_file.path, content.size(), kBlockSize,
+      tail + 5, tail + 5 + head, tail + 5 + head, tail + 5 + head + middle, tail);
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map, block_map_file.path));
+  std::string package_path = "@" + std::string(block_map_file.path);
+
+  std::vector<uint8_t> expected(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<const uint8_t*>(content.data()), content.size(), expected.data());
+
+  // Read straight from the (fake) block device.
+  auto package = Package::CreateBlockMapPackage(package_path, nullptr);
+  ASSERT_TRUE(package);
+  ASSERT_EQ(PackageType::kBlockMap, package->GetType());
+  ASSERT_EQ(content.size(), package->GetPackageSize());
+  std::vector<uint8_t> buffer(content.size());
+  ASSERT_TRUE(package->ReadFullyAtOffset(buffer.data(), buffer.size(), 0));
+  ASSERT_EQ(content, std::string(buffer.begin(), buffer.end()));
+  uint64_t read_bytes = GetReadBytes(getpid());
+  ASSERT_EQ(expected, HashPackage(package.get()));
+  uint64_t block_map_read_bytes = GetReadBytes(getpid()) - read_bytes;
+
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(package->GetZipArchiveHandle(), "payload.bin", &entry));
+  ASSERT_EQ(entry_data.size(), entry.uncompressed_length);
+  std::string extracted(entry_data.size(), '\0');
+  ASSERT_EQ(0, ExtractToMemory(package->GetZipArchiveHandle(), &entry,
+                               reinterpret_cast<uint8_t*>(extracted.data()), extracted.size()));
+  ASSERT_EQ(entry_data, extracted);
+
+  // Read the same package through the FUSE mount, as InstallWithFuseFromPath() does.
+  auto provider = FuseBlockDataProvider::CreateFromBlockMap(block_map_file.path, 65536);
+  ASSERT_TRUE(provider);
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.path));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string fuse_path = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(fuse_path.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  // The FUSE path reads the package twice: the provider reads it from the block device, and this
+  // process reads it back from the mount.
+  uint64_t provider_read_bytes = GetReadBytes(pid);
+  read_bytes = GetReadBytes(getpid());
+  auto fuse_package = Package::CreateFilePackage(fuse_path, nullptr);
+  ASSERT_TRUE(fuse_package);
+  ASSERT_EQ(expected, HashPackage(fuse_package.get()));
+  fuse_package.reset();
+  uint64_t fuse_read_bytes = GetReadBytes(getpid()) - read_bytes;
+  provider_read_bytes = GetReadBytes(pid) - provider_read_bytes;
+
+  // Hashing the block map package reads each byte of the package once, straight from the device
+  // (plus the read of /proc/self/io itself).
+  ASSERT_GE(block_map_read_bytes, content.size());
+  ASSERT_LT(block_map_read_bytes, content.size() + kBlockSize);
+  ASSERT_GE(fuse_read_bytes, content.size());
+  ASSERT_GE(provider_read_bytes, content.size());
+  ASSERT_LT(block_map_read_bytes, fuse_read_bytes + provider_read_bytes);
+
+  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
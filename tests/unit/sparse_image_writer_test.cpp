@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "updater/sparse_image_writer.h"
+#include "updater/sparse_writer.h"
+
+static constexpr uint32_t kBlockSize = 4096;
+
+template <typename T>
+static void Append(std::string* image, T value) {
+  image->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Returns the sparse image header, optionally with |extra| bytes after it and after each chunk
+// header.
+static std::string FileHeader(uint32_t total_blocks, uint32_t total_chunks, uint16_t extra = 0) {
+  std::string header;
+  Append<uint32_t>(&header, 0xed26ff3a);
+  Append<uint16_t>(&header, 1);
+  Append<uint16_t>(&header, 0);
+  Append<uint16_t>(&header, 28 + extra);
+  Append<uint16_t>(&header, 12 + extra);
+  Append<uint32_t>(&header, kBlockSize);
+  Append<uint32_t>(&header, total_blocks);
+  Append<uint32_t>(&header, total_chunks);
+  Append<uint32_t>(&header, 0);
+  header.append(extra, 'x');
+  return header;
+}
+
+static std::string Chunk(uint16_t type, uint32_t blocks, const std::string& data,
+                         uint16_t extra = 0) {
+  std::string chunk;
+  Append<uint16_t>(&chunk, type);
+  Append<uint16_t>(&chunk, 0);
+  Append<uint32_t>(&chunk, blocks);
+  Append<uint32_t>(&chunk, 12 + extra + data.size());
+  chunk.append(extra, 'x');
+  return chunk + data;
+}
+
+static std::string Fill(uint32_t blocks, uint32_t value, uint16_t extra = 0) {
+  std::string data;
+  Append<uint32_t>(&data, value);
+  return Chunk(0xCAC2, blocks, data, extra);
+}
+
+// Writes |image| in pieces of |piece_size| bytes, and returns whether it has been accepted.
+static bool WriteImage(const std::string& image, size_t piece_size, TemporaryFile* temp_file) {
+  SparseWriter writer(temp_file->fd);
+  SparseImageWriter image_writer(&writer);
+  auto data = reinterpret_cast<const uint8_t*>(image.data());
+  for (size_t offset = 0; offset < image.size(); offset += piece_size) {
+    if (!image_writer.Write(data + offset, std::min(piece_size, image.size() - offset))) {
+      return false;
+    }
+  }
+  return image_writer.Finish() && writer.Finish();
+}
+
+static void WriteAndCheck(const std::string& image, const std::string& expected) {
+  for (size_t piece_size : { 1, 7, 4096, 65536 }) {
+    TemporaryFile temp_file;
+    ASSERT_TRUE(WriteImage(image, piece_size, &temp_file)) << piece_size;
+    std::string written;
+    ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &written));
+    ASSERT_EQ(expected, written) << piece_size;
+  }
+}
+
+TEST(SparseImageWriterTest, chunk_types) {
+  std::string raw(2 * kBlockSize, '\0');
+  for (size_t i = 0; i < raw.size(); i++) {
+    raw[i] = static_cast<char>(i * 7);
+  }
+  std::string filled;
+  for (size_t i = 0; i < 3 * kBlockSize / 4; i++) {
+    Append<uint32_t>(&filled, 0x12345678);
+  }
+
+  // 2 blocks of raw data, 3 filled, 2 zeroes, 2 don't care, a CRC, 1 raw, and 2 past the last
+  // chunk.
+  std::string image = FileHeader(12, 6) + Chunk(0xCAC1, 2, raw) + Fill(3, 0x12345678) +
+                      Fill(2, 0) + Chunk(0xCAC3, 2, "") + Chunk(0xCAC4, 0, "abcd") +
+                      Chunk(0xCAC1, 1, std::string(kBlockSize, 'z'));
+  std::string expected = raw + filled + std::string(4 * kBlockSize, '\0') +
+                         std::string(kBlockSize, 'z') + std::string(2 * kBlockSize, '\0');
+  WriteAndCheck(image, expected);
+}
+
+TEST(SparseImageWriterTest, large_fill) {
+  // Larger than the fill buffer, and not a multiple of it.
+  std::string image = FileHeader(600, 1) + Fill(600, 0xdeadbeef);
+  std::string expected;
+  for (size_t i = 0; i < 600 * kBlockSize / 4; i++) {
+    Append<uint32_t>(&expected, 0xdeadbeef);
+  }
+  WriteAndCheck(image, expected);
+}
+
+TEST(SparseImageWriterTest, larger_headers) {
+  std::string image = FileHeader(3, 2, 4) + Chunk(0xCAC1, 1, std::string(kBlockSize, 'a'), 4) +
+                      Fill(2, 0x61616161, 4);
+  WriteAndCheck(image, std::string(3 * kBlockSize, 'a'));
+}
+
+TEST(SparseImageWriterTest, empty_image) {
+  WriteAndCheck(FileHeader(0, 0), "");
+  WriteAndCheck(FileHeader(2, 0), std::string(2 * kBlockSize, '\0'));
+}
+
+TEST(SparseImageWriterTest, invalid_images) {
+  std::string raw(kBlockSize, 'a');
+  std::string image = FileHeader(2, 2) + Chunk(0xCAC1, 1, raw) + Fill(1, 1);
+  TemporaryFile temp_file;
+  ASSERT_TRUE(WriteImage(image, 4096, &temp_file));
+
+  // Bad magic.
+  std::string bad_magic = image;
+  bad_magic[0] = 0;
+  ASSERT_FALSE(WriteImage(bad_magic, 4096, &temp_file));
+
+  // Truncated, or with trailing data.
+  ASSERT_FALSE(WriteImage(image.substr(0, image.size() - 1), 4096, &temp_file));
+  ASSERT_FALSE(WriteImage(image + "x", 4096, &temp_file));
+
+  // A chunk past the end of the image.
+  ASSERT_FALSE(WriteImage(FileHeader(1, 2) + Chunk(0xCAC1, 1, raw) + Fill(1, 1), 4096,
+                          &temp_file));
+
+  // A chunk whose size doesn't match its type.
+  ASSERT_FALSE(WriteImage(FileHeader(2, 1) + Chunk(0xCAC1, 2, raw), 4096, &temp_file));
+  ASSERT_FALSE(WriteImage(FileHeader(2, 1) + Chunk(0xCAC3, 2, "abcd"), 4096, &temp_file));
+
+  // An unknown chunk type.
+  ASSERT_FALSE(WriteImage(FileHeader(2, 1) + Chunk(0xCAC5, 2, ""), 4096, &temp_file));
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "updater/sparse_writer.h"
+
+// Writes |content| in pieces of |piece_size| bytes, and checks what ends up in the file.
+static void WriteAndCheck(const std::string& content, size_t piece_size,
+                          uint64_t expected_skipped) {
+  TemporaryFile temp_file;
+  SparseWriter writer(temp_file.fd);
+  auto data = reinterpret_cast<const uint8_t*>(content.data());
+  for (size_t offset = 0; offset < content.size(); offset += piece_size) {
+    ASSERT_TRUE(writer.Write(data + offset, std::min(piece_size, content.size() - offset)));
+  }
+  ASSERT_TRUE(writer.Finish());
+  ASSERT_EQ(content.size(), writer.size());
+  ASSERT_EQ(expected_skipped, writer.skipped());
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &written));
+  ASSERT_EQ(content, written);
+}
+
+TEST(SparseWriterTest, regular_file) {
+  // data (4096 + 100) | zeroes (the rest of the block + 3 blocks) | data (1 byte) |
+  // zeroes (the rest of the block + 2 blocks)
+  std::string content(4096 + 100, 'a');
+  content += std::string(4096 - 100 + 3 * 4096, '\0');
+  content += "b";
+  content += std::string(4095 + 2 * 4096, '\0');
+
+  // Only the aligned blocks of zeroes are skipped.
+  WriteAndCheck(content, content.size(), 3 * 4096 + 2 * 4096);
+  WriteAndCheck(content, 1000, 3 * 4096 + 2 * 4096);
+  WriteAndCheck(content, 4096, 3 * 4096 + 2 * 4096);
+
+  // A partial block of zeroes at the end is written.
+  WriteAndCheck(content + std::string(100, '\0'), 4096, 3 * 4096 + 2 * 4096);
+  WriteAndCheck(std::string(10 * 4096, '\0'), 3000, 10 * 4096);
+  WriteAndCheck("", 4096, 0);
+}
+
+TEST(SparseWriterTest, WriteZeroes_and_Discard) {
+  TemporaryFile temp_file;
+  SparseWriter writer(temp_file.fd);
+  // Neither needs to start or end at a block boundary.
+  std::string content(100, 'a');
+  ASSERT_TRUE(writer.Write(reinterpret_cast<const uint8_t*>(content.data()), content.size()));
+  ASSERT_TRUE(writer.WriteZeroes(3 * 4096));
+  ASSERT_TRUE(writer.Discard(2 * 4096 + 50));
+  ASSERT_TRUE(writer.Write(reinterpret_cast<const uint8_t*>(content.data()), content.size()));
+  ASSERT_TRUE(writer.Finish());
+  content += std::string(5 * 4096 + 50, '\0') + content;
+  ASSERT_EQ(content.size(), writer.size());
+  // Only the whole blocks are skipped; a discard in a regular file is a hole.
+  ASSERT_EQ(4 * 4096u, writer.skipped());
+  ASSERT_EQ(0u, writer.discarded());
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &written));
+  ASSERT_EQ(content, written);
+}
+
+TEST(SparseWriterTest, pipe) {
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+  android::base::unique_fd read_fd(pipe_fds[0]);
+  android::base::unique_fd write_fd(pipe_fds[1]);
+
+  // Zeroes can't be skipped in a pipe.
+  std::string content = std::string(8192, '\0') + "abc";
+  SparseWriter writer(write_fd);
+  ASSERT_TRUE(writer.Write(reinterpret_cast<const uint8_t*>(content.data()), content.size()));
+  ASSERT_TRUE(writer.WriteZeroes(5000));
+  ASSERT_TRUE(writer.Discard(100));
+  ASSERT_TRUE(writer.Finish());
+  content += std::string(5100, '\0');
+  ASSERT_EQ(0u, writer.skipped());
+  write_fd.reset();
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFdToString(read_fd, &written));
+  ASSERT_EQ(content, written);
+}
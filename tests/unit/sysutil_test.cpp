@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <unistd.h>
+
 #include <string>
 
 #include <android-base/file.h>
@@ -89,6 +91,72 @@ TEST(SysUtilTest, ParseBlockMapFile_invalid_size) {
   ASSERT_FALSE(too_many_blocks);
 }
 
+TEST(SysUtilTest, ParseBlockMapFile_binary) {
+  RangeSet ranges(std::vector<Range>{
+      { 1000, 1008 },
+      { 2100, 2102 },
+      { 30, 33 },
+  });
+  std::string content = BlockMapData::EncodeBinary("/dev/abc", 49652, 4096, ranges);
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto block_map_data = BlockMapData::ParseBlockMapFile(temp_file.path);
+  ASSERT_EQ("/dev/abc", block_map_data.path());
+  ASSERT_EQ(49652, block_map_data.file_size());
+  ASSERT_EQ(4096, block_map_data.block_size());
+  ASSERT_EQ(ranges, block_map_data.block_ranges());
+}
+
+TEST(SysUtilTest, ParseBlockMapFile_binary_corrupted) {
+  RangeSet ranges(std::vector<Range>{ { 1000, 1008 }, { 30, 33 } });
+  std::string content = BlockMapData::EncodeBinary("/dev/abc", 40000, 4096, ranges);
+  TemporaryFile temp_file;
+
+  // Any flipped bit fails the checksum.
+  for (size_t i = 0; i < content.size(); i++) {
+    std::string corrupted = content;
+    corrupted[i] ^= 0x10;
+    ASSERT_TRUE(android::base::WriteStringToFile(corrupted, temp_file.path));
+    ASSERT_FALSE(BlockMapData::ParseBlockMapFile(temp_file.path)) << "byte " << i;
+  }
+
+  // Truncated.
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(content.substr(0, content.size() - 1), temp_file.path));
+  ASSERT_FALSE(BlockMapData::ParseBlockMapFile(temp_file.path));
+
+  // Ranges that don't cover the file.
+  content = BlockMapData::EncodeBinary("/dev/abc", 49652, 4096, ranges);
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  ASSERT_FALSE(BlockMapData::ParseBlockMapFile(temp_file.path));
+}
+
+TEST(SysUtilTest, ParseBlockMapFile_prefers_binary) {
+  TemporaryDir temp_dir;
+  std::string block_map_path = std::string(temp_dir.path) + "/block.map";
+  std::string binary_path = block_map_path + BlockMapData::kBinarySuffix;
+  std::string text = "/dev/text\n49652 4096\n3\n1000 1008\n2100 2102\n30 33\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(text, block_map_path));
+  ASSERT_EQ("/dev/text", BlockMapData::ParseBlockMapFile(block_map_path).path());
+
+  RangeSet ranges(std::vector<Range>{ { 500, 513 } });
+  std::string binary = BlockMapData::EncodeBinary("/dev/binary", 49652, 4096, ranges);
+  ASSERT_TRUE(android::base::WriteStringToFile(binary, binary_path));
+  auto block_map_data = BlockMapData::ParseBlockMapFile(block_map_path);
+  ASSERT_EQ("/dev/binary", block_map_data.path());
+  ASSERT_EQ(ranges, block_map_data.block_ranges());
+
+  // An invalid binary map falls back to the text one.
+  binary.back() ^= 1;
+  ASSERT_TRUE(android::base::WriteStringToFile(binary, binary_path));
+  ASSERT_EQ("/dev/text", BlockMapData::ParseBlockMapFile(block_map_path).path());
+
+  ASSERT_EQ(0, unlink(binary_path.c_str()));
+  ASSERT_EQ(0, unlink(block_map_path.c_str()));
+}
+
 TEST(SysUtilTest, MapFileRegularFile) {
   TemporaryFile temp_file1;
   std::string content = "abc";
@@ -139,12 +207,69 @@ TEST(SysUtilTest, MapFileBlockMap) {
   ASSERT_EQ(1U, mapping.ranges());
 
   // Multiple ranges.
-  block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n3 5\n5 10\n";
+  block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n5 7\n12 17\n";
   ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
 
   ASSERT_TRUE(mapping.MapFile(filename));
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(3U, mapping.ranges());
+
+  // Adjacent ranges are coalesced.
+  block_map_content = std::string(package.path) + "\n40960 4096\n4\n0 3\n3 5\n7 9\n9 12\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(file_size, mapping.length);
+  ASSERT_EQ(2U, mapping.ranges());
+}
+
+TEST(SysUtilTest, MapFileBlockMapManyRanges) {
+  TemporaryFile package;
+  TemporaryFile block_map_file;
+  std::string filename = std::string("@") + block_map_file.path;
+
+  // Every other block, so that no ranges can be coalesced. There's no limit on the number of
+  // ranges.
+  size_t range_count = 10000;
+  std::string block_map_content = std::string(package.path) + "\n" +
+                                  std::to_string(range_count * 4096) + " 4096\n" +
+                                  std::to_string(range_count) + "\n";
+  for (size_t i = 0; i < range_count; i++) {
+    block_map_content += std::to_string(i * 2) + " " + std::to_string(i * 2 + 1) + "\n";
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(range_count, mapping.ranges());
+}
+
+TEST(SysUtilTest, MapFilePrefault) {
+  TemporaryFile package;
+  std::string content(4096 * 1000, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 31);
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package.path));
+
+  TemporaryFile block_map_file;
+  std::string block_map_content = std::string(package.path) + "\n" +
+                                  std::to_string(content.size()) + " 4096\n2\n500 1000\n0 500\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  for (const auto& filename :
+       { std::string(package.path), std::string("@") + block_map_file.path }) {
+    MemMapping mapping;
+    ASSERT_TRUE(mapping.MapFile(filename, true));
+    ASSERT_EQ(content.size(), mapping.length);
+  }
+
+  // The data reads the same while the prefault thread is still running.
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(std::string("@") + block_map_file.path, true));
+  ASSERT_EQ(content.substr(500 * 4096), std::string(mapping.addr, mapping.addr + 500 * 4096));
+  ASSERT_EQ(content.substr(0, 500 * 4096),
+            std::string(mapping.addr + 500 * 4096, mapping.addr + mapping.length));
 }
 
 TEST(SysUtilTest, MapFileBlockMapInvalidBlockMap) {
@@ -16,9 +16,13 @@
 
 #include <update_verifier/update_verifier.h>
 
+#include <unistd.h>
+
 #include <functional>
+#include <map>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -40,8 +44,10 @@ class UpdateVerifierTest : public ::testing::Test {
     care_map_prefix_ = care_map_dir_.path + "/care_map"s;
     care_map_pb_ = care_map_dir_.path + "/care_map.pb"s;
     care_map_txt_ = care_map_dir_.path + "/care_map.txt"s;
-    // Overrides the the care_map_prefix.
+    checkpoint_ = care_map_dir_.path + "/care_map.checkpoint"s;
+    // Overrides the the care_map_prefix and the checkpoint path.
     verifier_.set_care_map_prefix(care_map_prefix_);
+    verifier_.set_checkpoint_path(checkpoint_);
 
     property_id_ = "ro.build.fingerprint";
     fingerprint_ = android::base::GetProperty(property_id_, "");
@@ -55,6 +61,7 @@ class UpdateVerifierTest : public ::testing::Test {
   void TearDown() override {
     unlink(care_map_pb_.c_str());
     unlink(care_map_txt_.c_str());
+    unlink(checkpoint_.c_str());
   }
 
   // Returns a serialized string of the proto3 message according to the given partition info.
@@ -82,6 +89,28 @@ class UpdateVerifierTest : public ::testing::Test {
     return result.SerializeAsString();
   }
 
+  bool ReadBlocks(const std::vector<std::pair<std::string, RangeSet>>& block_devices,
+                  size_t read_threads, size_t read_size) {
+    std::vector<UpdateVerifier::PartitionBlocks> partitions;
+    for (const auto& [block_device, ranges] : block_devices) {
+      std::string name = "partition" + std::to_string(partitions.size());
+      partitions.push_back({ name, block_device, ranges });
+    }
+    verifier_.set_read_options(read_threads, read_size);
+    return verifier_.ReadBlocks(partitions);
+  }
+
+  // Reads |ranges| of |block_device| as partition "system", skipping the |verified| ones.
+  bool ResumeReadBlocks(const std::string& block_device, const RangeSet& ranges,
+                        const RangeSet& verified) {
+    verifier_.set_read_options(4, 4 * 4096);
+    return verifier_.ReadBlocks({ { "system", block_device, ranges, "fingerprint", verified } });
+  }
+
+  std::map<std::string, RangeSet> LoadCheckpoint() {
+    return verifier_.LoadCheckpoint();
+  }
+
   bool verity_supported;
   UpdateVerifier verifier_;
 
@@ -89,6 +118,7 @@ class UpdateVerifierTest : public ::testing::Test {
   std::string care_map_prefix_;
   std::string care_map_pb_;
   std::string care_map_txt_;
+  std::string checkpoint_;
 
   std::string property_id_;
   std::string fingerprint_;
@@ -217,3 +247,92 @@ TEST_F(UpdateVerifierTest, verify_image_protobuf_fingerprint_mismatch) {
   ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
   ASSERT_FALSE(verifier_.ParseCareMap());
 }
+
+TEST_F(UpdateVerifierTest, ReadBlocks_smoke) {
+  TemporaryFile temp_file;
+  ASSERT_EQ(0, ftruncate(temp_file.fd, 300 * 4096));
+
+  // Unsorted ranges, read in extents of 3 blocks by 4 threads.
+  ASSERT_TRUE(
+      ReadBlocks({ { temp_file.path, RangeSet::Parse("6,200,300,0,10,150,151") } }, 4, 3 * 4096));
+
+  // A single thread, with reads larger than the ranges.
+  ASSERT_TRUE(ReadBlocks({ { temp_file.path, RangeSet::Parse("6,200,300,0,10,150,151") } }, 1,
+                         1024 * 4096));
+}
+
+TEST_F(UpdateVerifierTest, ReadBlocks_multiple_partitions) {
+  TemporaryFile system;
+  ASSERT_EQ(0, ftruncate(system.fd, 300 * 4096));
+  TemporaryFile vendor;
+  ASSERT_EQ(0, ftruncate(vendor.fd, 20 * 4096));
+
+  ASSERT_TRUE(ReadBlocks({ { system.path, RangeSet::Parse("2,0,300") },
+                           { vendor.path, RangeSet::Parse("4,10,20,0,5") } },
+                         3, 4 * 4096));
+
+  // A failure on any partition fails the verification.
+  ASSERT_FALSE(ReadBlocks({ { system.path, RangeSet::Parse("2,0,300") },
+                            { vendor.path, RangeSet::Parse("2,15,21") } },
+                          3, 4 * 4096));
+  ASSERT_FALSE(ReadBlocks({ { system.path, RangeSet::Parse("2,0,300") },
+                            { "/doesntexist", RangeSet::Parse("2,0,1") } },
+                          3, 4 * 4096));
+}
+
+TEST_F(UpdateVerifierTest, ReadBlocks_past_end) {
+  TemporaryFile temp_file;
+  ASSERT_EQ(0, ftruncate(temp_file.fd, 300 * 4096));
+
+  ASSERT_FALSE(ReadBlocks({ { temp_file.path, RangeSet::Parse("4,0,10,295,301") } }, 4, 3 * 4096));
+  ASSERT_FALSE(ReadBlocks({ { "/doesntexist", RangeSet::Parse("2,0,1") } }, 4, 3 * 4096));
+}
+
+TEST_F(UpdateVerifierTest, LoadCheckpoint) {
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "2,0,100" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+    },
+    {
+        { "name", "vendor" },
+        { "ranges", "2,0,100" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+    },
+  };
+  ASSERT_TRUE(android::base::WriteStringToFile(ConstructProto(partitions), care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+
+  ASSERT_TRUE(LoadCheckpoint().empty());
+
+  // The checkpoint of another build is ignored.
+  std::string checkpoint = "system " + fingerprint_ + " 4,0,10,20,30\n" +
+                           "vendor old_fingerprint 2,0,100\n" + "product " + fingerprint_ +
+                           " 2,0,100\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(checkpoint, checkpoint_));
+  std::map<std::string, RangeSet> expected = {
+    { "system", RangeSet::Parse("4,0,10,20,30") },
+  };
+  ASSERT_EQ(expected, LoadCheckpoint());
+
+  // A malformed checkpoint is ignored as a whole.
+  checkpoint = "system " + fingerprint_ + " 3,0,10\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(checkpoint, checkpoint_));
+  ASSERT_TRUE(LoadCheckpoint().empty());
+}
+
+TEST_F(UpdateVerifierTest, ReadBlocks_checkpoint) {
+  TemporaryFile temp_file;
+  ASSERT_EQ(0, ftruncate(temp_file.fd, 100 * 4096));
+
+  // The blocks past the end would fail the read, had they not been verified by an earlier run.
+  ASSERT_TRUE(ResumeReadBlocks(temp_file.path, RangeSet::Parse("4,0,50,60,200"),
+                               RangeSet::Parse("4,20,40,100,200")));
+
+  std::string checkpoint;
+  ASSERT_TRUE(android::base::ReadFileToString(checkpoint_, &checkpoint));
+  ASSERT_EQ("system fingerprint 4,0,50,60,200\n", checkpoint);
+}
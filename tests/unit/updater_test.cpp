@@ -547,9 +547,11 @@ TEST_F(UpdaterTest, package_extract_dir) {
 
 // TODO: Test extracting to block device.
 TEST_F(UpdaterTest, package_extract_file) {
-  // package_extract_file expects 1 or 2 arguments.
+  // package_extract_file expects 1 to 3 arguments, the third one being a known format.
   expect(nullptr, "package_extract_file()", kArgsParsingFailure);
   expect(nullptr, "package_extract_file(\"arg1\", \"arg2\", \"arg3\")", kArgsParsingFailure);
+  expect(nullptr, "package_extract_file(\"arg1\", \"arg2\", \"raw\", \"arg4\")",
+         kArgsParsingFailure);
 
   std::string zip_path = from_testdata_base("ziptest_valid.zip");
   ZipArchiveHandle handle;
@@ -596,6 +598,114 @@ TEST_F(UpdaterTest, package_extract_file) {
   expect(nullptr, script, kPackageExtractFileFailure, &updater_);
 }
 
+TEST_F(UpdaterTest, package_extract_file_large_entries) {
+  // Spans a few writes, and doesn't end on a write boundary.
+  std::string content(3 * 1024 * 1024 + 1234, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>((i * 7) ^ (i >> 12));
+  }
+
+  TemporaryFile stored_file;
+  TemporaryFile deflated_file;
+  std::string script = "package_extract_file(\"stored\", \""s + stored_file.path +
+                       "\") && package_extract_file(\"deflated\", \"" + deflated_file.path +
+                       "\")";
+
+  // The stored entry is written from the mapped package, the deflated one as it gets inflated.
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter zip_writer(zip_file_ptr);
+  ASSERT_EQ(0, zip_writer.StartEntry("stored", 0));
+  ASSERT_EQ(0, zip_writer.WriteBytes(content.data(), content.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.StartEntry("deflated", ZipWriter::kCompress));
+  ASSERT_EQ(0, zip_writer.WriteBytes(content.data(), content.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.StartEntry("META-INF/com/google/android/updater-script", 0));
+  ASSERT_EQ(0, zip_writer.WriteBytes(script.data(), script.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  TemporaryFile temp_pipe;
+  ASSERT_TRUE(updater_.Init(temp_pipe.release(), zip_file.path, false));
+  ASSERT_TRUE(updater_.RunUpdate());
+  ASSERT_EQ("t", updater_.GetResult());
+
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(stored_file.path, &data));
+  ASSERT_EQ(content, data);
+  ASSERT_TRUE(android::base::ReadFileToString(deflated_file.path, &data));
+  ASSERT_EQ(content, data);
+}
+
+TEST_F(UpdaterTest, package_extract_file_sparse_image) {
+  // A sparse image of 4 blocks of 4096 bytes: 1 raw block, 2 filled with "abcd", and 1 don't care.
+  std::string image;
+  auto append = [&image](auto value) {
+    image.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  append(uint32_t{ 0xed26ff3a });
+  append(uint16_t{ 1 });   // major_version
+  append(uint16_t{ 0 });   // minor_version
+  append(uint16_t{ 28 });  // file_hdr_sz
+  append(uint16_t{ 12 });  // chunk_hdr_sz
+  append(uint32_t{ 4096 });
+  append(uint32_t{ 4 });  // total_blks
+  append(uint32_t{ 3 });  // total_chunks
+  append(uint32_t{ 0 });  // image_checksum
+  std::string raw_block(4096, 'r');
+  append(uint16_t{ 0xCAC1 });
+  append(uint16_t{ 0 });
+  append(uint32_t{ 1 });
+  append(uint32_t{ 12 + 4096 });
+  image += raw_block;
+  append(uint16_t{ 0xCAC2 });
+  append(uint16_t{ 0 });
+  append(uint32_t{ 2 });
+  append(uint32_t{ 12 + 4 });
+  image += "abcd";
+  append(uint16_t{ 0xCAC3 });
+  append(uint16_t{ 0 });
+  append(uint32_t{ 1 });
+  append(uint32_t{ 12 });
+
+  TemporaryFile raw_file;
+  TemporaryFile sparse_file;
+  std::string script = "package_extract_file(\"system.img\", \""s + raw_file.path +
+                       "\", \"sparse\") && package_extract_file(\"system.img\", \"" +
+                       sparse_file.path + "\")";
+
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter zip_writer(zip_file_ptr);
+  ASSERT_EQ(0, zip_writer.StartEntry("system.img", ZipWriter::kCompress));
+  ASSERT_EQ(0, zip_writer.WriteBytes(image.data(), image.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.StartEntry("META-INF/com/google/android/updater-script", 0));
+  ASSERT_EQ(0, zip_writer.WriteBytes(script.data(), script.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  TemporaryFile temp_pipe;
+  ASSERT_TRUE(updater_.Init(temp_pipe.release(), zip_file.path, false));
+  ASSERT_TRUE(updater_.RunUpdate());
+  ASSERT_EQ("t", updater_.GetResult());
+
+  // The don't care block reads as zeroes in a regular file. Without the format, the image is
+  // extracted as is.
+  std::string filled;
+  for (size_t i = 0; i < 2 * 4096 / 4; i++) {
+    filled += "abcd";
+  }
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(raw_file.path, &data));
+  ASSERT_EQ(raw_block + filled + std::string(4096, '\0'), data);
+  ASSERT_TRUE(android::base::ReadFileToString(sparse_file.path, &data));
+  ASSERT_EQ(image, data);
+}
+
 TEST_F(UpdaterTest, read_file) {
   // read_file() expects one argument.
   expect(nullptr, "read_file()", kArgsParsingFailure);
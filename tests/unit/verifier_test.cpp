@@ -20,18 +20,23 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 #include <openssl/bn.h>
 #include <openssl/ec.h>
+#include <openssl/evp.h>
 #include <openssl/nid.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
 #include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
@@ -40,6 +45,7 @@
 #include "otautil/sysutil.h"
 
 using namespace std::string_literals;
+using android::base::get_unaligned;
 
 static void LoadKeyFromFile(const std::string& file_name, Certificate* cert) {
   std::string testkey_string;
@@ -274,6 +280,212 @@ class VerifierSuccessTest : public VerifierTest {
 class VerifierFailureTest : public VerifierTest {
 };
 
+// Signs |data| with testkey_v3, and returns the PKCS#7 block of the whole-file signature of
+// |package| with its signature value replaced. The last 256 bytes of that block are the RSA-2048
+// signature value.
+static void SignWithTestKey(const std::string& package, const std::string& data,
+                            std::string* pkcs7) {
+  std::string pk8;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("testkey_v3.pk8"), &pk8));
+  const uint8_t* pk8_data = reinterpret_cast<const uint8_t*>(pk8.data());
+  std::unique_ptr<PKCS8_PRIV_KEY_INFO, decltype(&PKCS8_PRIV_KEY_INFO_free)> p8(
+      d2i_PKCS8_PRIV_KEY_INFO(nullptr, &pk8_data, pk8.size()), PKCS8_PRIV_KEY_INFO_free);
+  ASSERT_NE(nullptr, p8);
+  std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> pkey(EVP_PKCS82PKEY(p8.get()),
+                                                           EVP_PKEY_free);
+  ASSERT_NE(nullptr, pkey);
+  std::unique_ptr<RSA, RSADeleter> rsa(EVP_PKEY_get1_RSA(pkey.get()));
+  ASSERT_NE(nullptr, rsa);
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  std::vector<uint8_t> sig(RSA_size(rsa.get()));
+  unsigned int sig_len;
+  ASSERT_EQ(1, RSA_sign(NID_sha256, digest, sizeof(digest), sig.data(), &sig_len, rsa.get()));
+  ASSERT_EQ(256U, sig_len);
+
+  const size_t signature_start = get_unaligned<uint16_t>(package.data() + package.size() - 6);
+  *pkcs7 = package.substr(package.size() - signature_start, signature_start - 6);
+  pkcs7->replace(pkcs7->size() - sig_len, sig_len, reinterpret_cast<const char*>(sig.data()),
+                 sig_len);
+}
+
+// Adds a chunk manifest for |package| (signed with testkey_v3), with the chunk hashes written over
+// the package data at |hashes_offset|. Real packages keep them in a zip entry of their own. The
+// package is then signed again, so that it still verifies as a whole.
+static void AddChunkManifest(uint32_t chunk_size, uint64_t hashes_offset, std::string* package) {
+  const size_t comment_size = get_unaligned<uint16_t>(package->data() + package->size() - 2);
+  const size_t signed_len = package->size() - comment_size - 2;
+
+  // The chunks are hashed with the bytes of the hashes taken as zeroes.
+  uint32_t hash_count = (signed_len + chunk_size - 1) / chunk_size;
+  ASSERT_LE(hashes_offset + hash_count * SHA256_DIGEST_LENGTH, signed_len);
+  package->replace(hashes_offset, hash_count * SHA256_DIGEST_LENGTH,
+                   hash_count * SHA256_DIGEST_LENGTH, '\0');
+  std::string hashes;
+  for (size_t offset = 0; offset < signed_len; offset += chunk_size) {
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(package->data()) + offset,
+           std::min<size_t>(chunk_size, signed_len - offset), hash);
+    hashes.append(reinterpret_cast<const char*>(hash), SHA256_DIGEST_LENGTH);
+  }
+  package->replace(hashes_offset, hashes.size(), hashes);
+
+  std::string whole_file_pkcs7;
+  ASSERT_NO_FATAL_FAILURE(
+      SignWithTestKey(*package, package->substr(0, signed_len), &whole_file_pkcs7));
+  package->replace(package->size() - 6 - whole_file_pkcs7.size(), whole_file_pkcs7.size(),
+                   whole_file_pkcs7);
+
+  std::string manifest;
+  manifest.append(reinterpret_cast<const char*>(&chunk_size), 4);
+  uint64_t signed_len64 = signed_len;
+  manifest.append(reinterpret_cast<const char*>(&signed_len64), 8);
+  manifest.append(reinterpret_cast<const char*>(&hashes_offset), 8);
+  manifest.append(reinterpret_cast<const char*>(&hash_count), 4);
+  uint8_t hashes_digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(hashes.data()), hashes.size(), hashes_digest);
+  manifest.append(reinterpret_cast<const char*>(hashes_digest), SHA256_DIGEST_LENGTH);
+
+  std::string pkcs7;
+  ASSERT_NO_FATAL_FAILURE(SignWithTestKey(*package, manifest, &pkcs7));
+  uint32_t pkcs7_size = pkcs7.size();
+  manifest.append(reinterpret_cast<const char*>(&pkcs7_size), 4);
+  manifest += pkcs7;
+  uint32_t manifest_size = manifest.size();
+  manifest.append(reinterpret_cast<const char*>(&manifest_size), 4);
+  manifest += "CHUNKMF1";
+
+  // Insert the manifest ahead of the whole-file signature, and fix up both comment lengths.
+  const size_t signature_start = get_unaligned<uint16_t>(package->data() + package->size() - 6);
+  package->insert(package->size() - signature_start, manifest);
+  uint16_t new_comment_size = comment_size + manifest.size();
+  memcpy(&(*package)[signed_len], &new_comment_size, 2);
+  memcpy(&(*package)[package->size() - 2], &new_comment_size, 2);
+}
+
+static int VerifyChunkManifest(const std::string& package, const std::vector<Certificate>& certs,
+                               ChunkManifest* manifest) {
+  auto memory_package =
+      Package::CreateMemoryPackage(std::vector<uint8_t>(package.begin(), package.end()), nullptr);
+  return verify_chunk_manifest(memory_package.get(), certs, manifest);
+}
+
+TEST(VerifierTest, ChunkManifest) {
+  std::vector<Certificate> certs;
+  certs.emplace_back(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+  LoadKeyFromFile(from_testdata_base("testkey_v3.x509.pem"), &certs.back());
+
+  std::string package;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("otasigned_v3.zip"), &package));
+
+  // No chunk manifest yet.
+  ChunkManifest manifest;
+  ASSERT_EQ(VERIFY_FAILURE, VerifyChunkManifest(package, certs, &manifest));
+
+  // The chunk hashes straddle the boundary between chunks 1 and 2.
+  AddChunkManifest(1024, 2000, &package);
+  VerifyFile(package, certs, VERIFY_SUCCESS);
+  ASSERT_EQ(VERIFY_SUCCESS, VerifyChunkManifest(package, certs, &manifest));
+  ASSERT_EQ(1024U, manifest.chunk_size);
+  ASSERT_EQ(2000U, manifest.hashes_offset);
+  ASSERT_EQ((manifest.signed_len + 1023) / 1024, manifest.hashes.size());
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(package.data());
+  for (size_t i = 0; i < manifest.hashes.size(); i++) {
+    ASSERT_TRUE(CheckChunk(manifest, i, data + i * 1024)) << i;
+  }
+
+  // A change to a chunk, including to the chunk hashes within it, fails the check.
+  for (size_t offset : { 10, 2010, 2100 }) {
+    std::string altered(package);
+    altered[offset] ^= 1;
+    size_t chunk = offset / 1024;
+    ASSERT_FALSE(CheckChunk(manifest, chunk,
+                            reinterpret_cast<const uint8_t*>(altered.data()) + chunk * 1024))
+        << offset;
+  }
+
+  // Any change to the chunk hashes breaks the manifest.
+  std::string altered(package);
+  altered[2000] ^= 1;
+  ASSERT_EQ(VERIFY_FAILURE, VerifyChunkManifest(altered, certs, &manifest));
+
+  // So does any change to the signed part of the manifest.
+  const size_t trailer_end =
+      package.size() - get_unaligned<uint16_t>(package.data() + package.size() - 6);
+  const size_t manifest_size = get_unaligned<uint32_t>(package.data() + trailer_end - 12);
+  altered = package;
+  altered[trailer_end - 12 - manifest_size + 24] ^= 1;
+  ASSERT_EQ(VERIFY_FAILURE, VerifyChunkManifest(altered, certs, &manifest));
+}
+
+TEST(VerifierTest, DigestCache) {
+  std::vector<Certificate> certs;
+  certs.emplace_back(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
+  LoadKeyFromFile(from_testdata_base("testkey_v3.x509.pem"), &certs.back());
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(from_testdata_base("otasigned_v3.zip"), &content));
+  TemporaryFile package_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package_file.path));
+
+  TemporaryDir td;
+  std::string digest_cache = std::string(td.path) + "/verify_digests";
+  auto package = Package::CreateFilePackage(package_file.path, nullptr);
+  ASSERT_NE(nullptr, package);
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(package.get(), certs, digest_cache));
+
+  // <salt> <fingerprint> <key index> <digest>, readable only by us.
+  struct stat sb;
+  ASSERT_EQ(0, stat(digest_cache.c_str(), &sb));
+  ASSERT_EQ(0600U, sb.st_mode & 0777);
+  std::string cache_content;
+  ASSERT_TRUE(android::base::ReadFileToString(digest_cache, &cache_content));
+  std::vector<std::string> fields = android::base::Split(android::base::Trim(cache_content), " ");
+  ASSERT_EQ(4U, fields.size());
+  ASSERT_EQ(64U, fields[0].size());
+  ASSERT_EQ(64U, fields[1].size());
+  ASSERT_EQ("0", fields[2]);
+  ASSERT_EQ(64U, fields[3].size());
+
+  // The same package under a different path (e.g. sideloaded again) hits the cache, which leaves
+  // the entry alone. A full hash pass would write a new one with a new salt.
+  TemporaryFile copy_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, copy_file.path));
+  auto copy = Package::CreateFilePackage(copy_file.path, nullptr);
+  ASSERT_NE(nullptr, copy);
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(copy.get(), certs, digest_cache));
+  std::string new_cache_content;
+  ASSERT_TRUE(android::base::ReadFileToString(digest_cache, &new_cache_content));
+  ASSERT_EQ(cache_content, new_cache_content);
+
+  // A corrupt digest in the cache falls back to the full hash pass, and the entry is rewritten.
+  std::vector<std::string> corrupt = fields;
+  corrupt[3] = std::string(64, '0');
+  ASSERT_EQ(0, unlink(digest_cache.c_str()));
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(corrupt, " "), digest_cache,
+                                               0600, getuid(), getgid()));
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(package.get(), certs, digest_cache));
+  ASSERT_TRUE(android::base::ReadFileToString(digest_cache, &cache_content));
+  ASSERT_NE(corrupt[3], android::base::Split(android::base::Trim(cache_content), " ")[3]);
+
+  // A cache file that others could access is ignored, and replaced after the full hash pass.
+  ASSERT_EQ(0, chmod(digest_cache.c_str(), 0644));
+  ASSERT_TRUE(android::base::ReadFileToString(digest_cache, &cache_content));
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(package.get(), certs, digest_cache));
+  ASSERT_EQ(0, stat(digest_cache.c_str(), &sb));
+  ASSERT_EQ(0600U, sb.st_mode & 0777);
+  ASSERT_TRUE(android::base::ReadFileToString(digest_cache, &new_cache_content));
+  ASSERT_NE(cache_content, new_cache_content);
+
+  // Altering the package invalidates the cache entry, even if the footer and EOCD are intact.
+  content[50] += 1;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, package_file.path));
+  package = Package::CreateFilePackage(package_file.path, nullptr);
+  ASSERT_NE(nullptr, package);
+  ASSERT_EQ(VERIFY_FAILURE, verify_file(package.get(), certs, digest_cache));
+}
+
 TEST(VerifierTest, BadPackage_AlteredFooter) {
   std::vector<Certificate> certs;
   certs.emplace_back(0, Certificate::KEY_TYPE_RSA, nullptr, nullptr);
@@ -15,9 +15,11 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <map>
 #include <string>
 
 #include <android-base/file.h>
@@ -25,9 +27,22 @@
 #include <gtest/gtest.h>
 #include <otautil/ZipUtil.h>
 #include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
 
+static void BuildZipArchive(const std::map<std::string, std::string>& file_map, int fd) {
+  FILE* zip_file = fdopen(fd, "w");
+  ZipWriter writer(zip_file);
+  for (const auto& [name, content] : file_map) {
+    ASSERT_EQ(0, writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, writer.WriteBytes(content.data(), content.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file));
+}
+
 TEST(ZipUtilTest, invalid_args) {
   std::string zip_path = from_testdata_base("ziptest_valid.zip");
   ZipArchiveHandle handle;
@@ -189,3 +204,56 @@ TEST(ZipUtilTest, set_timestamp) {
 
   CloseArchive(handle);
 }
+
+TEST(ZipUtilTest, extract_many_files) {
+  // Enough files, in enough directories, to keep all the extracting threads busy.
+  std::map<std::string, std::string> files;
+  for (size_t i = 0; i < 200; i++) {
+    std::string name = "firmware/" + std::to_string(i % 7) + "/" + std::to_string(i % 3) + "/" +
+                       std::to_string(i) + ".bin";
+    files[name] = std::string(i * 100, 'a' + i % 26);
+  }
+  TemporaryFile temp_file;
+  BuildZipArchive(files, temp_file.release());
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &handle));
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "firmware", td.path, nullptr, nullptr));
+  CloseArchive(handle);
+
+  for (const auto& [name, content] : files) {
+    std::string path = td.path + name.substr(strlen("firmware"));
+    std::string extracted;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &extracted)) << path;
+    ASSERT_EQ(content, extracted) << path;
+  }
+}
+
+TEST(ZipUtilTest, extract_no_matching_entries) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  // Nothing to extract, into a destination that doesn't exist, succeeds without creating it.
+  TemporaryDir td;
+  std::string dest_path = std::string(td.path) + "/nonexistent";
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "nonexistent", dest_path, nullptr, nullptr));
+  CloseArchive(handle);
+
+  struct stat sb;
+  ASSERT_EQ(-1, stat(dest_path.c_str(), &sb));
+  ASSERT_EQ(ENOENT, errno);
+}
+
+TEST(ZipUtilTest, extract_failure) {
+  // "a/b" can't be both a file and a directory.
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "a/b", "file" }, { "a/b/c", "file under a file" } }, temp_file.release());
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &handle));
+  TemporaryDir td;
+  ASSERT_FALSE(ExtractPackageRecursive(handle, "", td.path, nullptr, nullptr));
+  CloseArchive(handle);
+}
@@ -36,6 +36,11 @@
 // Each block range represents a half-open interval; the line "30 33"
 // reprents the blocks [30, 31, 32].
 //
+// If ro.uncrypt.binary_block_map is set, the map is also written in the
+// equivalent, more compact binary format of BlockMapData::EncodeBinary()
+// (otautil/sysutil.h), to the same path plus ".bin". Recovery reads that
+// one when present; older readers keep using the text one.
+//
 // Recovery can take this block map file and retrieve the underlying
 // file data to use as an update package.
 
@@ -89,6 +94,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -98,11 +105,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -118,12 +130,20 @@
 #include <fstab/fstab.h>
 
 #include "otautil/error_code.h"
+#include "otautil/rangeset.h"
+#include "otautil/sysutil.h"
 
 using android::fs_mgr::Fstab;
 using android::fs_mgr::ReadDefaultFstab;
 
 static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+// The number of extents fetched with each FS_IOC_FIEMAP call.
+static constexpr size_t FIEMAP_BATCH_EXTENTS = 512;
+// The max size of each read when copying the decrypted package to the block device, and the number
+// of such buffers in flight between the reader and the writer.
+static constexpr size_t COPY_CHUNK_SIZE = 4 * 1024 * 1024;
+static constexpr size_t COPY_BUFFERS = 4;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -240,12 +260,275 @@ static int RetryFibmap(int fd, const std::string& name, int* block, const int he
   return kUncryptIoctlError;
 }
 
+// Maps the blocks of |fd| to the block device with FS_IOC_FIEMAP, a batch of extents per call. On
+// success, |ranges| holds the physical block ranges in file order, as [start, end) pairs like the
+// ones add_block_to_ranges() builds. Returns false if the filesystem doesn't support FIEMAP, or some
+// block can't be read from the block device as is (e.g. it's a hole or inline data), in which case
+// the caller falls back to FIBMAP.
+static bool FiemapRanges(int fd, const std::string& name, off64_t file_size, int blksize,
+                         std::vector<int>* ranges) {
+  CHECK(ranges != nullptr);
+  ranges->clear();
+
+  // Extents whose data isn't at a fixed, block-aligned location on the device.
+  static constexpr uint32_t UNMAPPABLE_FLAGS = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                               FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED |
+                                               FIEMAP_EXTENT_DATA_INLINE |
+                                               FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN;
+
+  const uint64_t blocks = ((file_size - 1) / blksize) + 1;
+  std::vector<uint8_t> buffer(sizeof(struct fiemap) +
+                              FIEMAP_BATCH_EXTENTS * sizeof(struct fiemap_extent));
+  auto fm = reinterpret_cast<struct fiemap*>(buffer.data());
+  uint64_t mapped = 0;
+  size_t calls = 0;
+  while (mapped < blocks) {
+    memset(buffer.data(), 0, buffer.size());
+    fm->fm_start = mapped * blksize;
+    fm->fm_length = blocks * blksize - fm->fm_start;
+    // Flush the delayed allocations first, so that every block is at its final location.
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = FIEMAP_BATCH_EXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+      PLOG(WARNING) << "FIEMAP of \"" << name << "\" failed";
+      return false;
+    }
+    calls++;
+    if (fm->fm_mapped_extents == 0) {
+      LOG(WARNING) << "FIEMAP found no extent at block " << mapped;
+      return false;
+    }
+
+    for (uint32_t i = 0; i < fm->fm_mapped_extents && mapped < blocks; i++) {
+      const struct fiemap_extent& extent = fm->fm_extents[i];
+      if ((extent.fe_flags & UNMAPPABLE_FLAGS) != 0 || extent.fe_logical % blksize != 0 ||
+          extent.fe_physical % blksize != 0 || extent.fe_length % blksize != 0) {
+        LOG(WARNING) << "can't map extent at " << extent.fe_logical << " (flags 0x" << std::hex
+                     << extent.fe_flags << std::dec << ", length " << extent.fe_length << ")";
+        return false;
+      }
+      uint64_t first_block = extent.fe_logical / blksize;
+      if (first_block > mapped) {
+        LOG(WARNING) << "hole at block " << mapped;
+        return false;
+      }
+      // An extent may start before the requested offset.
+      uint64_t skip = mapped - first_block;
+      uint64_t count = extent.fe_length / blksize;
+      if (skip >= count) {
+        continue;
+      }
+      count = std::min(count - skip, blocks - mapped);
+      uint64_t start = extent.fe_physical / blksize + skip;
+      if (start + count > INT_MAX) {
+        LOG(WARNING) << "block " << start + count << " is out of range";
+        return false;
+      }
+      if (!ranges->empty() && ranges->back() == static_cast<int>(start)) {
+        ranges->back() += static_cast<int>(count);
+      } else {
+        ranges->push_back(static_cast<int>(start));
+        ranges->push_back(static_cast<int>(start + count));
+      }
+      mapped += count;
+    }
+  }
+
+  LOG(INFO) << "mapped " << blocks << " blocks as " << ranges->size() / 2 << " ranges with "
+            << calls << " FIEMAP call(s)";
+  return true;
+}
+
+// Writes all the |iov| to |fd| at |offset|, retrying on short writes.
+static bool WriteFullyAtOffset(int fd, std::vector<struct iovec> iov, off64_t offset) {
+  size_t index = 0;
+  while (index < iov.size()) {
+    ssize_t written =
+        TEMP_FAILURE_RETRY(pwritev64(fd, iov.data() + index, iov.size() - index, offset));
+    if (written <= 0) {
+      if (written == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    offset += written;
+    while (written > 0) {
+      if (static_cast<size_t>(written) >= iov[index].iov_len) {
+        written -= iov[index].iov_len;
+        index++;
+      } else {
+        iov[index].iov_base = static_cast<unsigned char*>(iov[index].iov_base) + written;
+        iov[index].iov_len -= written;
+        written = 0;
+      }
+    }
+  }
+  return true;
+}
+
+// Copies the (decrypted) content of |fd| to its blocks on the raw block device |wfd|, given the
+// physical block |ranges| of the file in order. A reader thread reads the file in chunks of up to
+// COPY_CHUNK_SIZE, each within one range, while this thread writes them out: the chunks queued
+// back to back on the device go out with a single pwritev(). Reports the progress to |socket|.
+static int CopyExtents(int fd, const std::string& name, off64_t file_size, int blksize,
+                       const std::vector<int>& ranges, int wfd, const std::string& blk_dev,
+                       int socket) {
+  struct Chunk {
+    std::vector<unsigned char> data;
+    size_t size;  // A multiple of blksize; the last chunk is zero-padded past the end of the file.
+    off64_t device_offset;
+  };
+
+  const size_t chunk_size = std::max<size_t>(COPY_CHUNK_SIZE / blksize, 1) * blksize;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::unique_ptr<Chunk>> free_chunks;
+  std::deque<std::unique_ptr<Chunk>> full_chunks;
+  bool reader_done = false;
+  bool stop = false;
+  int reader_error = kUncryptNoError;
+  for (size_t i = 0; i < COPY_BUFFERS; i++) {
+    free_chunks.push_back(std::make_unique<Chunk>());
+    free_chunks.back()->data.resize(chunk_size);
+  }
+
+  std::thread reader([&]() {
+    off64_t pos = 0;
+    for (size_t i = 0; i < ranges.size(); i += 2) {
+      off64_t device_offset = static_cast<off64_t>(ranges[i]) * blksize;
+      off64_t range_end = static_cast<off64_t>(ranges[i + 1]) * blksize;
+      while (device_offset < range_end) {
+        std::unique_ptr<Chunk> chunk;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&]() { return stop || !free_chunks.empty(); });
+          if (stop) {
+            return;
+          }
+          chunk = std::move(free_chunks.front());
+          free_chunks.pop_front();
+        }
+
+        size_t size = std::min<off64_t>(chunk_size, range_end - device_offset);
+        size_t to_read = std::min<off64_t>(size, file_size - pos);
+        if (!android::base::ReadFullyAtOffset(fd, chunk->data.data(), to_read, pos)) {
+          PLOG(ERROR) << "failed to read " << name << " at " << pos;
+          std::lock_guard<std::mutex> lock(mutex);
+          reader_error = kUncryptReadError;
+          reader_done = true;
+          cv.notify_all();
+          return;
+        }
+        memset(chunk->data.data() + to_read, 0, size - to_read);
+        chunk->size = size;
+        chunk->device_offset = device_offset;
+        pos += size;
+        device_offset += size;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        full_chunks.push_back(std::move(chunk));
+        cv.notify_all();
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    reader_done = true;
+    cv.notify_all();
+  });
+
+  int error = kUncryptNoError;
+  off64_t written = 0;
+  int last_progress = 0;
+  while (true) {
+    std::vector<std::unique_ptr<Chunk>> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return reader_done || !full_chunks.empty(); });
+      if (full_chunks.empty()) {
+        error = reader_error;
+        break;
+      }
+      do {
+        batch.push_back(std::move(full_chunks.front()));
+        full_chunks.pop_front();
+      } while (!full_chunks.empty() &&
+               full_chunks.front()->device_offset ==
+                   batch.back()->device_offset + static_cast<off64_t>(batch.back()->size));
+    }
+
+    std::vector<struct iovec> iov;
+    size_t batch_size = 0;
+    for (const auto& chunk : batch) {
+      iov.push_back({ chunk->data.data(), chunk->size });
+      batch_size += chunk->size;
+    }
+    if (!WriteFullyAtOffset(wfd, iov, batch.front()->device_offset)) {
+      PLOG(ERROR) << "failed to write " << batch_size << " bytes to " << blk_dev << " at "
+                  << batch.front()->device_offset;
+      error = kUncryptWriteError;
+      break;
+    }
+
+    // Update the status file, progress must be between [0, 99].
+    written += batch_size;
+    int progress = std::min(99, static_cast<int>(100 * (double(written) / double(file_size))));
+    if (progress > last_progress) {
+      last_progress = progress;
+      write_status_to_socket(progress, socket);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& chunk : batch) {
+      free_chunks.push_back(std::move(chunk));
+    }
+    cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+  reader.join();
+  return error;
+}
+
+// Writes |content| to |binary_map_file| through a temporary file.
+static int WriteBinaryBlockMap(const std::string& binary_map_file, const std::string& content) {
+  std::string tmp_file = binary_map_file + ".tmp";
+  android::base::unique_fd fd(
+      open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR));
+  if (fd == -1) {
+    PLOG(ERROR) << "failed to open " << tmp_file;
+    return kUncryptFileOpenError;
+  }
+  if (!android::base::WriteStringToFd(content, fd)) {
+    PLOG(ERROR) << "failed to write " << tmp_file;
+    return kUncryptWriteError;
+  }
+  if (fsync(fd) == -1) {
+    PLOG(ERROR) << "failed to fsync \"" << tmp_file << "\"";
+    return kUncryptFileSyncError;
+  }
+  if (close(fd.release()) == -1) {
+    PLOG(ERROR) << "failed to close " << tmp_file;
+    return kUncryptFileCloseError;
+  }
+  if (rename(tmp_file.c_str(), binary_map_file.c_str()) == -1) {
+    PLOG(ERROR) << "failed to rename " << tmp_file << " to " << binary_map_file;
+    return kUncryptFileRenameError;
+  }
+  return 0;
+}
+
 static int ProductBlockMap(const std::string& path, const std::string& map_file,
                            const std::string& blk_dev, bool encrypted, bool f2fs_fs, int socket) {
   std::string err;
-  if (!android::base::RemoveFileIfExists(map_file, &err)) {
-    LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
-    return kUncryptFileRemoveError;
+  std::string binary_map_file = map_file + BlockMapData::kBinarySuffix;
+  for (const auto& file : { map_file, binary_map_file }) {
+    if (!android::base::RemoveFileIfExists(file, &err)) {
+      LOG(ERROR) << "failed to remove the existing map file " << file << ": " << err;
+      return kUncryptFileRemoveError;
+    }
   }
   std::string tmp_map_file = map_file + ".tmp";
   android::base::unique_fd mapfd(open(tmp_map_file.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
@@ -329,7 +612,41 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
         }
     }
 
+    // Map the extents of the file in a few FIEMAP calls rather than a FIBMAP call per block, after
+    // the file has been pinned above.
+    std::vector<int> extents;
+    bool use_fiemap = FiemapRanges(fd, path, sb.st_size, sb.st_blksize, &extents);
+    if (!use_fiemap) {
+        LOG(INFO) << "falling back to FIBMAP";
+    }
+
+    // Finds the physical block of |file_block| with FIBMAP.
+    auto find_block = [&](int file_block, int* block) {
+        *block = file_block;
+        if (ioctl(fd, FIBMAP, block) != 0) {
+            PLOG(ERROR) << "failed to find block " << file_block;
+            return static_cast<int>(kUncryptIoctlError);
+        }
+        if (*block == 0) {
+            LOG(ERROR) << "failed to find block " << file_block << ", retrying";
+            return RetryFibmap(fd, path, block, file_block);
+        }
+        return static_cast<int>(kUncryptNoError);
+    };
+
     off64_t pos = 0;
+    if (use_fiemap) {
+        if (encrypted) {
+            int error = CopyExtents(fd, path, sb.st_size, sb.st_blksize, extents, wfd, blk_dev,
+                                    socket);
+            if (error != kUncryptNoError) {
+                return error;
+            }
+        }
+        // The extents are the block map, and the blocks have all been rewritten if needed.
+        ranges = std::move(extents);
+        pos = sb.st_size;
+    }
     int last_progress = 0;
     while (pos < sb.st_size) {
         // Update the status file, progress must be between [0, 99].
@@ -341,18 +658,9 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
 
         if ((tail+1) % WINDOW_SIZE == head) {
             // write out head buffer
-            int block = head_block;
-            if (ioctl(fd, FIBMAP, &block) != 0) {
-                PLOG(ERROR) << "failed to find block " << head_block;
-                return kUncryptIoctlError;
-            }
-
-            if (block == 0) {
-                LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-                int error = RetryFibmap(fd, path, &block, head_block);
-                if (error != kUncryptNoError) {
-                    return error;
-                }
+            int block;
+            if (int error = find_block(head_block, &block); error != kUncryptNoError) {
+                return error;
             }
 
             add_block_to_ranges(ranges, block);
@@ -386,18 +694,9 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
 
     while (head != tail) {
         // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
-        }
-
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = RetryFibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
+        int block;
+        if (int error = find_block(head_block, &block); error != kUncryptNoError) {
+            return error;
         }
 
         add_block_to_ranges(ranges, block);
@@ -444,6 +743,22 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
         }
     }
 
+    // Both maps have been removed above. The binary one goes in place before the text one, so a
+    // text map never comes with a binary one of an earlier package.
+    if (android::base::GetBoolProperty("ro.uncrypt.binary_block_map", false)) {
+        RangeSet block_ranges;
+        for (size_t i = 0; i < ranges.size(); i += 2) {
+            block_ranges.PushBack({ static_cast<size_t>(ranges[i]),
+                                    static_cast<size_t>(ranges[i + 1]) });
+        }
+        if (int status = WriteBinaryBlockMap(
+                binary_map_file,
+                BlockMapData::EncodeBinary(blk_dev, sb.st_size, sb.st_blksize, block_ranges));
+            status != 0) {
+            return status;
+        }
+    }
+
     if (rename(tmp_map_file.c_str(), map_file.c_str()) == -1) {
       PLOG(ERROR) << "failed to rename " << tmp_map_file << " to " << map_file;
       return kUncryptFileRenameError;
@@ -54,22 +54,58 @@ class UpdateVerifier {
   // Finds all the dm-enabled partitions, and returns a map of <partition_name, block_device>.
   std::map<std::string, std::string> FindDmPartitions();
 
-  // Returns true if we successfully read the blocks in |ranges| of the |dm_block_device|.
-  bool ReadBlocks(const std::string partition_name, const std::string& dm_block_device,
-                  const RangeSet& ranges);
+  struct PartitionBlocks {
+    std::string name;
+    std::string dm_block_device;
+    RangeSet ranges;
+    // The fingerprint of the partition, and the blocks already read by an earlier run on the same
+    // build, which are skipped.
+    std::string fingerprint;
+    RangeSet verified;
+  };
 
-  // Functions to override the care_map_prefix_ and property_reader_, used in test only.
+  // Returns true if we successfully read the blocks in |ranges| of each partition's
+  // |dm_block_device|. The partitions are read at the same time by a single pool of
+  // |read_threads_| threads. The ranges are cut into extents of at most |read_size_| bytes, which
+  // the threads take in the order of their offsets on each device, alternating between devices.
+  // The blocks read so far are saved as a checkpoint about every second, and once at the end.
+  bool ReadBlocks(const std::vector<PartitionBlocks>& partitions);
+
+  // Returns the blocks recorded in the checkpoint as already read, for the partitions whose
+  // fingerprint in the checkpoint matches the one in |partition_fingerprints_|. The checkpoint,
+  // if any, is at |checkpoint_path_| and has a line per partition:
+  //   <partition name> <fingerprint> <ranges read, as in RangeSet::ToString()>
+  std::map<std::string, RangeSet> LoadCheckpoint();
+
+  // Atomically replaces the checkpoint with |content|.
+  bool WriteCheckpoint(const std::string& content);
+
+  // Functions to override the care_map_prefix_, checkpoint_path_, property_reader_ and the read
+  // options, used in test only.
   void set_care_map_prefix(const std::string& prefix);
+  void set_checkpoint_path(const std::string& path);
   void set_property_reader(const std::function<std::string(const std::string&)>& property_reader);
+  void set_read_options(size_t read_threads, size_t read_size);
 
   std::map<std::string, RangeSet> partition_map_;
+  // The fingerprints from the care map, of the partitions in |partition_map_|.
+  std::map<std::string, std::string> partition_fingerprints_;
   // The path to the care_map excluding the filename extension; default value:
   // "/data/ota_package/care_map"
   std::string care_map_prefix_;
+  // The path to the checkpoint; default value: "/metadata/ota/update_verifier.checkpoint"
+  std::string checkpoint_path_;
 
   // The function to read the device property; default value: android::base::GetProperty()
   std::function<std::string(const std::string&)> property_reader_;
 
+  // The number of reader threads, i.e. the number of reads in flight on the device; default
+  // value: the number of CPUs.
+  size_t read_threads_;
+  // The size of each read in bytes, a multiple of the block size; default value (0): the largest
+  // request the block device takes without splitting it, within [128 KiB, 4 MiB].
+  size_t read_size_;
+
   // Check if snapuserd daemon has already completed the update verification
   // Applicable only for VABC with userspace snapshots
   bool CheckVerificationStatus();
@@ -49,7 +49,9 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <future>
+#include <mutex>
 #include <thread>
 
 #include <BootControlClient.h>
@@ -70,6 +72,18 @@
 // TODO(xunchang) remove the prefix and use a default path instead.
 constexpr const char* kDefaultCareMapPrefix = "/data/ota_package/care_map";
 
+static constexpr size_t kBlockSize = 4096;
+
+// The bounds of the size of each read, and the size used when the device doesn't tell.
+static constexpr size_t kMinReadSize = 128 * 1024;
+static constexpr size_t kMaxReadSize = 4 * 1024 * 1024;
+static constexpr size_t kDefaultReadSize = 1024 * 1024;
+
+// The checkpoint of the blocks read so far, and how often it's saved. It's kept in /metadata/ota,
+// as /data/ota_package (where the care map is) is read-only to update_verifier.
+static constexpr const char* kDefaultCheckpointPath = "/metadata/ota/update_verifier.checkpoint";
+static constexpr std::chrono::milliseconds kCheckpointInterval(1000);
+
 // Find directories in format of "/sys/block/dm-X".
 static int dm_name_filter(const dirent* de) {
   if (android::base::StartsWith(de->d_name, "dm-")) {
@@ -80,7 +94,10 @@ static int dm_name_filter(const dirent* de) {
 
 UpdateVerifier::UpdateVerifier()
     : care_map_prefix_(kDefaultCareMapPrefix),
-      property_reader_([](const std::string& id) { return android::base::GetProperty(id, ""); }) {}
+      checkpoint_path_(kDefaultCheckpointPath),
+      property_reader_([](const std::string& id) { return android::base::GetProperty(id, ""); }),
+      read_threads_(std::thread::hardware_concurrency() ?: 4),
+      read_size_(0) {}
 
 // Iterate the content of "/sys/block/dm-X/dm/name" and find all the dm-wrapped block devices.
 // We will later read all the ("cared") blocks from "/dev/block/dm-X" to ensure the target
@@ -131,44 +148,180 @@ std::map<std::string, std::string> UpdateVerifier::FindDmPartitions() {
   return dm_block_devices;
 }
 
-bool UpdateVerifier::ReadBlocks(const std::string partition_name,
-                                const std::string& dm_block_device, const RangeSet& ranges) {
-  // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
-  // the last group).
-  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
-  std::vector<RangeSet> groups = ranges.Split(thread_num);
+// Returns the size of the reads from |block_device|: the largest request it takes without splitting
+// it, as found in /sys/block/dm-X/queue/max_sectors_kb, within [kMinReadSize, kMaxReadSize].
+static size_t GetReadSize(const std::string& block_device) {
+  std::string path =
+      "/sys/block/" + android::base::Basename(block_device) + "/queue/max_sectors_kb";
+  std::string content;
+  size_t max_kb;
+  if (!android::base::ReadFileToString(path, &content) ||
+      !android::base::ParseUint(android::base::Trim(content), &max_kb)) {
+    return kDefaultReadSize;
+  }
+  return std::clamp(max_kb, kMinReadSize / 1024, kMaxReadSize / 1024) * 1024;
+}
 
-  std::vector<std::future<bool>> threads;
-  for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition_name]() {
-      android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
-      if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition_name;
-        return false;
+// Returns |ranges| sorted, with the overlapping or adjacent ones merged.
+static std::vector<Range> MergeRanges(std::vector<Range> ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<Range> merged;
+  for (const auto& range : ranges) {
+    if (!merged.empty() && range.first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+// Returns the blocks of |ranges| that aren't in |excluded|, which must be sorted and merged.
+static std::vector<Range> SubtractRanges(const RangeSet& ranges,
+                                         const std::vector<Range>& excluded) {
+  std::vector<Range> result;
+  for (auto [start, end] : ranges) {
+    // Skip the excluded ranges that end before this one starts, then cut out the overlapping ones.
+    auto it = std::upper_bound(
+        excluded.begin(), excluded.end(), start,
+        [](size_t block, const Range& range) { return block < range.second; });
+    for (; it != excluded.end() && it->first < end && start < end; ++it) {
+      if (it->first > start) {
+        result.emplace_back(start, it->first);
+      }
+      start = std::max(start, it->second);
+    }
+    if (start < end) {
+      result.emplace_back(start, end);
+    }
+  }
+  return result;
+}
+
+bool UpdateVerifier::ReadBlocks(const std::vector<PartitionBlocks>& partitions) {
+  struct PartitionState {
+    android::base::unique_fd fd;
+    size_t read_blocks;
+    // The extents of one read each, sorted by offset so that the threads sweep the device together.
+    std::vector<Range> extents;
+    // The number of extents not read yet; the last thread to finish one logs the throughput.
+    std::atomic<size_t> remaining;
+    // The blocks read so far, including the verified ones; guarded by |checkpoint_mutex| below.
+    std::vector<Range> read;
+  };
+
+  std::vector<PartitionState> states(partitions.size());
+  size_t max_read_blocks = 1;
+  for (size_t i = 0; i < partitions.size(); i++) {
+    const auto& partition = partitions[i];
+    auto& state = states[i];
+    state.fd.reset(TEMP_FAILURE_RETRY(open(partition.dm_block_device.c_str(), O_RDONLY)));
+    if (state.fd.get() == -1) {
+      PLOG(ERROR) << "Error reading " << partition.dm_block_device << " for partition "
+                  << partition.name;
+      return false;
+    }
+
+    size_t read_size = read_size_ ?: GetReadSize(partition.dm_block_device);
+    state.read_blocks = std::max<size_t>(read_size / kBlockSize, 1);
+    max_read_blocks = std::max(max_read_blocks, state.read_blocks);
+    state.read = MergeRanges({ partition.verified.begin(), partition.verified.end() });
+    for (const auto& [range_start, range_end] : SubtractRanges(partition.ranges, state.read)) {
+      for (size_t start = range_start; start < range_end; start += state.read_blocks) {
+        state.extents.emplace_back(start, std::min(range_end, start + state.read_blocks));
       }
+    }
+    // The care map doesn't list the ranges in order.
+    std::sort(state.extents.begin(), state.extents.end());
+    state.remaining = state.extents.size();
+    if (state.extents.empty()) {
+      LOG(INFO) << "Partition " << partition.name << " has been verified by an earlier run.";
+    }
+  }
 
-      static constexpr size_t kBlockSize = 4096;
-      std::vector<uint8_t> buf(1024 * kBlockSize);
+  // Returns the checkpoint of the blocks read so far. Called with |checkpoint_mutex| held, or once
+  // all the threads are done.
+  std::mutex checkpoint_mutex;
+  auto format_checkpoint = [&partitions, &states]() {
+    std::string checkpoint;
+    for (size_t i = 0; i < partitions.size(); i++) {
+      auto& read = states[i].read;
+      read = MergeRanges(std::move(read));
+      if (!read.empty()) {
+        checkpoint += partitions[i].name + " " + partitions[i].fingerprint + " " +
+                      RangeSet(std::vector<Range>(read)).ToString() + "\n";
+      }
+    }
+    return checkpoint;
+  };
+
+  // Hand out the extents of all the partitions round-robin, so that every device is kept busy
+  // from the start rather than one after another. Once the smaller partitions are done, all the
+  // threads move on to the remaining ones.
+  size_t max_extents = 0;
+  for (const auto& state : states) {
+    max_extents = std::max(max_extents, state.extents.size());
+  }
+  std::vector<std::pair<size_t, size_t>> schedule;  // <partition index, extent index>
+  for (size_t extent = 0; extent < max_extents; extent++) {
+    for (size_t i = 0; i < states.size(); i++) {
+      if (extent < states[i].extents.size()) {
+        schedule.emplace_back(i, extent);
+      }
+    }
+  }
 
-      for (const auto& [range_start, range_end] : group) {
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * kBlockSize, SEEK_SET) == -1) {
-          PLOG(ERROR) << "lseek to " << range_start << " failed";
-          return false;
-        }
+  android::base::Timer timer;
+  std::chrono::milliseconds last_checkpoint(0);
+  std::mutex write_mutex;
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> failed = false;
+  auto thread_func = [&]() {
+    std::vector<uint8_t> buf(max_read_blocks * kBlockSize);
+    for (size_t n = next++; n < schedule.size() && !failed; n = next++) {
+      const auto& partition = partitions[schedule[n].first];
+      auto& state = states[schedule[n].first];
+      const auto& [start, end] = state.extents[schedule[n].second];
+      if (!android::base::ReadFullyAtOffset(state.fd.get(), buf.data(), (end - start) * kBlockSize,
+                                            static_cast<off64_t>(start) * kBlockSize)) {
+        PLOG(ERROR) << "Failed to read blocks " << start << " to " << end << " on partition "
+                    << partition.name;
+        failed = true;
+        return false;
+      }
 
-        size_t remain = (range_end - range_start) * kBlockSize;
-        while (remain > 0) {
-          size_t to_read = std::min(remain, 1024 * kBlockSize);
-          if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
-            return false;
-          }
-          remain -= to_read;
+      std::string checkpoint;
+      {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex);
+        state.read.emplace_back(start, end);
+        if (timer.duration() - last_checkpoint >= kCheckpointInterval) {
+          last_checkpoint = timer.duration();
+          checkpoint = format_checkpoint();
         }
       }
-      return true;
-    };
+      // Don't hold up the other threads on a slow write; another checkpoint comes soon.
+      if (!checkpoint.empty()) {
+        std::unique_lock<std::mutex> lock(write_mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+          WriteCheckpoint(checkpoint);
+        }
+      }
+
+      if (--state.remaining == 0) {
+        uint64_t bytes = static_cast<uint64_t>(partition.ranges.blocks()) * kBlockSize;
+        uint64_t msec = std::max<uint64_t>(timer.duration().count(), 1);
+        LOG(INFO) << "Finished reading blocks on partition " << partition.name << " @ "
+                  << partition.dm_block_device << " with " << state.read_blocks * kBlockSize / 1024
+                  << " KiB per read: " << bytes / 1024 / 1024 << " MiB in " << msec << " ms ("
+                  << bytes * 1000 / msec / 1024 / 1024 << " MiB/s).";
+      }
+    }
+    return true;
+  };
 
+  size_t thread_num = std::clamp<size_t>(read_threads_, 1, std::max<size_t>(schedule.size(), 1));
+  std::vector<std::future<bool>> threads;
+  for (size_t i = 0; i < thread_num; i++) {
     threads.emplace_back(std::async(std::launch::async, thread_func));
   }
 
@@ -176,8 +329,13 @@ bool UpdateVerifier::ReadBlocks(const std::string partition_name,
   for (auto& t : threads) {
     ret = t.get() && ret;
   }
-  LOG(INFO) << "Finished reading blocks on partition " << partition_name << " @ " << dm_block_device
-            << " with " << thread_num << " threads.";
+  // Save the final progress, so that a reboot before the slot gets marked successful doesn't
+  // read everything again.
+  WriteCheckpoint(format_checkpoint());
+  if (ret) {
+    LOG(INFO) << "Finished reading " << partitions.size() << " partitions with " << thread_num
+              << " threads in " << timer.duration().count() << " ms.";
+  }
   return ret;
 }
 
@@ -209,22 +367,76 @@ bool UpdateVerifier::VerifyPartitions() {
     return false;
   }
 
+  auto verified = LoadCheckpoint();
+  std::vector<PartitionBlocks> partitions;
   for (const auto& [partition_name, ranges] : partition_map_) {
     if (dm_block_devices.find(partition_name) == dm_block_devices.end()) {
       LOG(ERROR) << "Failed to find dm block device for " << partition_name;
       return false;
     }
+    partitions.push_back({ partition_name, dm_block_devices.at(partition_name), ranges,
+                           partition_fingerprints_.at(partition_name), verified[partition_name] });
+  }
 
-    if (!ReadBlocks(partition_name, dm_block_devices.at(partition_name), ranges)) {
-      return false;
+  return ReadBlocks(partitions);
+}
+
+std::map<std::string, RangeSet> UpdateVerifier::LoadCheckpoint() {
+  std::string content;
+  if (!android::base::ReadFileToString(checkpoint_path_, &content)) {
+    if (errno != ENOENT) {
+      PLOG(WARNING) << "Failed to read " << checkpoint_path_;
     }
+    return {};
   }
 
+  std::map<std::string, RangeSet> verified;
+  for (const auto& line : android::base::Split(android::base::Trim(content), "\n")) {
+    std::vector<std::string> pieces = android::base::Split(line, " ");
+    if (pieces.size() != 3) {
+      LOG(WARNING) << "Ignoring the malformed checkpoint " << checkpoint_path_;
+      return {};
+    }
+    const std::string& name = pieces[0];
+    // A checkpoint from another build says nothing about the blocks of this one.
+    if (auto it = partition_fingerprints_.find(name);
+        it == partition_fingerprints_.end() || it->second != pieces[1]) {
+      continue;
+    }
+    RangeSet ranges = RangeSet::Parse(pieces[2]);
+    if (!ranges) {
+      LOG(WARNING) << "Ignoring the malformed checkpoint " << checkpoint_path_;
+      return {};
+    }
+    LOG(INFO) << "Resuming the verification of " << name << ": " << ranges.blocks()
+              << " blocks have been read.";
+    verified.emplace(name, std::move(ranges));
+  }
+  return verified;
+}
+
+bool UpdateVerifier::WriteCheckpoint(const std::string& content) {
+  std::string tmp_name = checkpoint_path_ + ".tmp";
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (fd.get() == -1) {
+    PLOG(WARNING) << "Failed to open " << tmp_name;
+    return false;
+  }
+  if (!android::base::WriteStringToFd(content, fd.get()) || fsync(fd.get()) == -1) {
+    PLOG(WARNING) << "Failed to write " << tmp_name;
+    return false;
+  }
+  if (rename(tmp_name.c_str(), checkpoint_path_.c_str()) == -1) {
+    PLOG(WARNING) << "Failed to rename " << tmp_name << " to " << checkpoint_path_;
+    return false;
+  }
   return true;
 }
 
 bool UpdateVerifier::ParseCareMap() {
   partition_map_.clear();
+  partition_fingerprints_.clear();
 
   std::string care_map_name = care_map_prefix_ + ".pb";
   if (access(care_map_name.c_str(), R_OK) == -1) {
@@ -289,6 +501,7 @@ bool UpdateVerifier::ParseCareMap() {
     }
 
     partition_map_.emplace(partition.name(), ranges);
+    partition_fingerprints_.emplace(partition.name(), partition.fingerprint());
   }
 
   if (partition_map_.empty()) {
@@ -303,11 +516,28 @@ void UpdateVerifier::set_care_map_prefix(const std::string& prefix) {
   care_map_prefix_ = prefix;
 }
 
+void UpdateVerifier::set_checkpoint_path(const std::string& path) {
+  checkpoint_path_ = path;
+}
+
 void UpdateVerifier::set_property_reader(
     const std::function<std::string(const std::string&)>& property_reader) {
   property_reader_ = property_reader;
 }
 
+void UpdateVerifier::set_read_options(size_t read_threads, size_t read_size) {
+  read_threads_ = read_threads;
+  read_size_ = read_size;
+}
+
+// Removes the checkpoint, which is of no more use once the slot has been marked successful.
+static void RemoveCheckpoint() {
+  std::string err;
+  if (!android::base::RemoveFileIfExists(kDefaultCheckpointPath, &err)) {
+    LOG(WARNING) << "Failed to remove " << kDefaultCheckpointPath << ": " << err;
+  }
+}
+
 static int reboot_device() {
   if (android_reboot(ANDROID_RB_RESTART2, 0, nullptr) == -1) {
     LOG(ERROR) << "Failed to reboot.";
@@ -387,6 +617,7 @@ int update_verifier(int argc, char** argv) {
         return reboot_device();
       }
       LOG(INFO) << "Marked slot " << current_slot << " as booted successfully.";
+      RemoveCheckpoint();
       // Clears the warm reset flag for next reboot.
       if (!android::base::SetProperty("ota.warm_reset", "0")) {
         LOG(WARNING) << "Failed to reset the warm reset flag";
@@ -394,6 +625,9 @@ int update_verifier(int argc, char** argv) {
     } else {
       LOG(INFO) << "Deferred marking slot " << current_slot << " as booted successfully.";
     }
+  } else if (is_successful.value_or(false)) {
+    // The slot may have been marked successful by vold, after a deferred marking above.
+    RemoveCheckpoint();
   }
 
   LOG(INFO) << "Leaving update_verifier.";
@@ -24,6 +24,7 @@ tune2fs_static_libraries := \
 
 updater_common_static_libraries := \
     libapplypatch \
+    libapplypatch_deflate \
     libbootloader_message \
     libbspatch \
     libedify \
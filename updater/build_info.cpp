@@ -52,7 +52,7 @@ bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool ex
 
       temp_files_.emplace_back(work_dir_);
       auto& image_file = temp_files_.back();
-      if (!target_file.ExtractImage(entry_name, fstab_info, work_dir_, &image_file)) {
+      if (!target_file.ExtractImage(entry_name, fstab_info, &image_file)) {
         LOG(ERROR) << "Failed to set up source image files.";
         return false;
       }
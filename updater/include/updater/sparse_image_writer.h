@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "updater/sparse_writer.h"
+
+// Converts a stream in the Android sparse image format (see libsparse) to the raw image, as it
+// comes in. RAW chunks are passed on to the SparseWriter, FILL chunks are written from a bounded
+// buffer of the fill value (or as zeroes), and DONT_CARE chunks are discarded. CRC32 chunks are
+// skipped; the integrity of the data is up to the source of the stream. Nothing but the chunk
+// headers and the fill buffer is held in memory.
+class SparseImageWriter {
+ public:
+  explicit SparseImageWriter(SparseWriter* writer);
+
+  // Takes the next |size| bytes of the sparse image. Returns false if the image is malformed, or if
+  // writing fails.
+  bool Write(const uint8_t* data, size_t size);
+
+  // Checks that the whole image has been received, and discards the blocks past the last chunk,
+  // if any. The SparseWriter still needs to be finished afterwards.
+  bool Finish();
+
+ private:
+  enum class State {
+    kFileHeader,
+    kSkip,         // The extra bytes of a larger file header.
+    kChunkHeader,
+    kRawData,
+    kFillValue,
+    kCrc32,
+    kDone,
+  };
+
+  // Handles the header (or value) collected in |buffer_| for the current state.
+  bool ProcessBuffer();
+
+  bool ProcessFileHeader();
+
+  bool ProcessChunkHeader();
+
+  bool Fill(uint32_t value, uint64_t size);
+
+  // Moves on to the next chunk header, or to kDone after the last chunk.
+  void NextChunk();
+
+  // Accounts for the current chunk, and moves on to the next one.
+  void EndChunk();
+
+  SparseWriter* writer_;
+  State state_ = State::kFileHeader;
+
+  // The bytes of the header (or value) being collected, up to |buffer_size_|.
+  std::vector<uint8_t> buffer_;
+  size_t buffer_size_;
+
+  uint32_t block_size_ = 0;
+  uint32_t total_blocks_ = 0;
+  uint32_t total_chunks_ = 0;
+  uint16_t chunk_header_size_ = 0;
+
+  uint32_t chunks_ = 0;        // The chunks handled so far.
+  uint32_t blocks_ = 0;        // The blocks covered by them.
+  uint32_t chunk_blocks_ = 0;  // The blocks covered by the current chunk.
+  uint64_t remaining_ = 0;     // The bytes left in kSkip or kRawData.
+
+  // A run of the last fill value, which is written over and over for a FILL chunk.
+  std::vector<uint32_t> fill_buffer_;
+};
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Writes a stream of data to a file or a block device from its start, without writing the blocks
+// that are all zeroes. On a block device, they're zeroed out with BLKZEROOUT, which the storage
+// can do without transferring (or even writing) them. In a regular file, which must start out
+// empty, they're left as holes. Any other file gets all the data written.
+class SparseWriter {
+ public:
+  explicit SparseWriter(int fd);
+
+  // Appends |size| bytes at |data| to the stream. A partial block at the end is held back until
+  // the next call completes it.
+  bool Write(const uint8_t* data, size_t size);
+
+  // Appends |size| zeroes to the stream, without going through them.
+  bool WriteZeroes(uint64_t size);
+
+  // Appends |size| bytes whose content doesn't matter. On a block device, the whole blocks are
+  // discarded with BLKDISCARD where supported, and left as they are otherwise. Any other file gets
+  // zeroes.
+  bool Discard(uint64_t size);
+
+  // Writes out what has been held back, zeroes out the trailing zero blocks, if any, and sets the
+  // size of a regular file. Must be called once all the data has been written.
+  bool Finish();
+
+  // The number of bytes written so far.
+  uint64_t size() const {
+    return offset_ + partial_block_.size();
+  }
+
+  // The number of bytes that have been found to be zeroes, rather than written.
+  uint64_t skipped() const {
+    return skipped_;
+  }
+
+  // The number of bytes that have been discarded on a block device, rather than written.
+  uint64_t discarded() const {
+    return discarded_;
+  }
+
+ private:
+  // Writes |size| bytes of |data| at |offset_|, after zeroing out the pending zero blocks.
+  bool WriteData(const uint8_t* data, size_t size);
+
+  // Writes the blocks in |data|, leaving out the zero ones. |size| is a multiple of the block size.
+  bool WriteBlocks(const uint8_t* data, size_t size);
+
+  // Zeroes out the pending zero blocks, on a block device.
+  bool FlushZeroes();
+
+  // Appends the zeroes needed to complete the partial block, if any, out of |*size| ones, which is
+  // updated with what remains.
+  bool CompletePartialBlock(uint64_t* size);
+
+  int fd_;
+  bool is_block_device_ = false;
+  bool is_regular_file_ = false;
+  uint64_t offset_ = 0;
+  // The file offset of |fd_|, which is behind |offset_| after skipping zeroes or discarding.
+  uint64_t position_ = 0;
+  // The zero blocks not zeroed out yet, which end at |offset_|.
+  uint64_t zero_start_ = 0;
+  uint64_t zero_length_ = 0;
+  uint64_t skipped_ = 0;
+  uint64_t discarded_ = 0;
+  std::vector<uint8_t> partial_block_;
+};
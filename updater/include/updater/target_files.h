@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
 #include <string>
 #include <string_view>
@@ -54,13 +55,18 @@ class TargetFile {
   bool EntryExists(const std::string_view name) const;
   // Extracts the image file |entry_name|. Returns true on success.
   bool ExtractImage(const std::string_view entry_name, const FstabInfo& fstab_info,
-                    const std::string_view work_dir, TemporaryFile* image_file) const;
+                    TemporaryFile* image_file) const;
 
  private:
   // Wrapper functions to read the entry from either the zipped target-file, or the extracted input
   // directory.
   bool ReadEntryToString(const std::string_view name, std::string* content) const;
   bool ExtractEntryToTempFile(const std::string_view name, TemporaryFile* temp_file) const;
+  // Extracts the entry, which is a sparse image, to |temp_file| as the raw image.
+  bool ExtractSparseImageToTempFile(const std::string_view name, TemporaryFile* temp_file) const;
+  using WriteFn = std::function<bool(const uint8_t* data, size_t size)>;
+  // Passes the content of the entry to |write|, a chunk at a time.
+  bool ProcessEntryContents(const std::string_view name, const WriteFn& write) const;
 
   std::string path_;      // Path to the zipped target-file or an extracted directory.
   bool extracted_input_;  // True if the target-file has been extracted.
@@ -68,6 +68,9 @@ class Updater : public UpdaterInterface {
   size_t GetMappedPackageLength() const override {
     return mapped_package_.length;
   }
+  void AdvisePackageRange(uint64_t offset, uint64_t length, int advice) const override {
+    mapped_package_.Advise(offset, length, advice);
+  }
 
  private:
   friend class UpdaterTestBase;
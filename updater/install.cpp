@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -37,9 +38,16 @@
 
 #include <linux/xattr.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -57,6 +65,7 @@
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 #include <ziparchive/zip_archive.h>
+#include <zlib.h>
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
@@ -66,6 +75,8 @@
 #include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
 #include "otautil/ziputil.h"
+#include "updater/sparse_image_writer.h"
+#include "updater/sparse_writer.h"
 
 #ifndef __ANDROID__
 #include <cutils/memory.h>  // for strlcpy
@@ -157,18 +168,184 @@ Value* PackageExtractDirFn(const char* name, State* state,
   return StringValue(success ? "t" : "");
 }
 
-// package_extract_file(package_file[, dest_file])
+// The size of each write of package_extract_file() to its destination. libziparchive writes an
+// entry out 32 KiB at a time, which leaves a block device mostly idle.
+static constexpr size_t kExtractWriteSize = 1024 * 1024;
+
+// Receives the data of an entry being inflated, and writes it out in chunks of kExtractWriteSize
+// on a separate thread. One buffer is being filled while the other one is being written.
+class PipelinedWriter {
+ public:
+  using WriteFn = std::function<bool(const uint8_t* data, size_t size)>;
+
+  explicit PipelinedWriter(WriteFn write)
+      : write_(std::move(write)), thread_(&PipelinedWriter::WriteThread, this) {
+    for (auto& buffer : buffers_) {
+      buffer.resize(kExtractWriteSize);
+    }
+  }
+
+  ~PipelinedWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // The callback for ProcessZipEntryContents().
+  static bool Append(const uint8_t* data, size_t size, void* cookie) {
+    auto writer = static_cast<PipelinedWriter*>(cookie);
+    while (size > 0) {
+      size_t to_copy = std::min(size, kExtractWriteSize - writer->filled_);
+      memcpy(writer->buffers_[writer->filling_].data() + writer->filled_, data, to_copy);
+      writer->filled_ += to_copy;
+      data += to_copy;
+      size -= to_copy;
+      if (writer->filled_ == kExtractWriteSize && !writer->Submit()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Writes out the rest of the data. Returns false if any of the writes has failed.
+  bool Finish() {
+    if (filled_ > 0 && !Submit()) {
+      return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !submitted_; });
+    return !failed_;
+  }
+
+ private:
+  // Hands the buffer being filled over to the writing thread, once it's done with the other one.
+  bool Submit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !submitted_; });
+    if (failed_) {
+      return false;
+    }
+    submitted_ = true;
+    submitted_buffer_ = filling_;
+    submitted_size_ = filled_;
+    lock.unlock();
+    cv_.notify_all();
+
+    filling_ ^= 1;
+    filled_ = 0;
+    return true;
+  }
+
+  void WriteThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || submitted_; });
+      if (!submitted_) {
+        return;
+      }
+      const uint8_t* data = buffers_[submitted_buffer_].data();
+      size_t size = submitted_size_;
+      lock.unlock();
+
+      bool success = write_(data, size);
+
+      lock.lock();
+      failed_ = failed_ || !success;
+      submitted_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  WriteFn write_;
+  std::array<std::vector<uint8_t>, 2> buffers_;
+  size_t filling_ = 0;  // The buffer being filled, only used by the inflating thread.
+  size_t filled_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool submitted_ = false;  // Whether a buffer is being written.
+  size_t submitted_buffer_ = 0;
+  size_t submitted_size_ = 0;
+  bool failed_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// Writes the data of |entry| to |fd|, in large writes, skipping the zero blocks (see
+// SparseWriter). If |sparse_image| is true, the entry is a sparse image, which is converted to raw
+// on the way. A stored entry is written straight from the mapped package; a deflated one is
+// written while the rest of it is being inflated. The CRC is checked either way. Returns false on
+// errors, which have been logged.
+static bool ExtractEntryToFd(UpdaterInterface* updater, const ZipEntry64& entry, int fd,
+                             bool sparse_image) {
+  SparseWriter writer(fd);
+  SparseImageWriter image_writer(&writer);
+  auto write = [&writer, &image_writer, sparse_image](const uint8_t* data, size_t size) {
+    return sparse_image ? image_writer.Write(data, size) : writer.Write(data, size);
+  };
+
+  const uint8_t* package = updater->GetMappedPackageAddress();
+  size_t package_length = updater->GetMappedPackageLength();
+  if (entry.method == kCompressStored && package != nullptr && entry.offset >= 0 &&
+      entry.compressed_length == entry.uncompressed_length &&
+      entry.uncompressed_length <= package_length &&
+      static_cast<uint64_t>(entry.offset) <= package_length - entry.uncompressed_length) {
+    const uint8_t* data = package + entry.offset;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (uint64_t written = 0; written < entry.uncompressed_length;) {
+      size_t size = std::min<uint64_t>(kExtractWriteSize, entry.uncompressed_length - written);
+      if (!write(data + written, size)) {
+        return false;
+      }
+      crc = crc32(crc, data + written, size);
+      written += size;
+    }
+    if (crc != entry.crc32) {
+      LOG(ERROR) << "CRC mismatch: expected " << entry.crc32 << ", got " << crc;
+      return false;
+    }
+  } else {
+    PipelinedWriter pipelined_writer(write);
+    int32_t ret = ProcessZipEntryContents(updater->GetPackageHandle(), &entry,
+                                          PipelinedWriter::Append, &pipelined_writer);
+    if (!pipelined_writer.Finish()) {
+      return false;
+    }
+    if (ret != 0) {
+      LOG(ERROR) << ErrorCodeString(ret);
+      return false;
+    }
+  }
+
+  if ((sparse_image && !image_writer.Finish()) || !writer.Finish()) {
+    return false;
+  }
+  if (writer.skipped() > 0) {
+    LOG(INFO) << "Skipped writing " << writer.skipped() << " of " << writer.size()
+              << " bytes, which are zeroes";
+  }
+  if (writer.discarded() > 0) {
+    LOG(INFO) << "Discarded " << writer.discarded() << " of " << writer.size() << " bytes";
+  }
+  return true;
+}
+
+// package_extract_file(package_file[, dest_file[, format]])
 //   Extracts a single package_file from the update package and writes it to dest_file,
-//   overwriting existing files if necessary. Without the dest_file argument, returns the
-//   contents of the package file as a binary blob.
+//   overwriting existing files if necessary. With the format "sparse", package_file is an Android
+//   sparse image, which is written out as the raw image; the default format is "raw". Without the
+//   dest_file argument, returns the contents of the package file as a binary blob.
 Value* PackageExtractFileFn(const char* name, State* state,
                             const std::vector<std::unique_ptr<Expr>>& argv) {
-  if (argv.size() < 1 || argv.size() > 2) {
-    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 or 2 args, got %zu", name,
+  if (argv.size() < 1 || argv.size() > 3) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 to 3 args, got %zu", name,
                       argv.size());
   }
 
-  if (argv.size() == 2) {
+  if (argv.size() >= 2) {
     // The two-argument version extracts to a file.
 
     std::vector<std::string> args;
@@ -178,6 +355,14 @@ Value* PackageExtractFileFn(const char* name, State* state,
     }
     const std::string& zip_path = args[0];
     std::string dest_path = args[1];
+    bool sparse_image = false;
+    if (args.size() == 3) {
+      if (args[2] != "raw" && args[2] != "sparse") {
+        return ErrorAbort(state, kArgsParsingFailure, "%s() Unknown format \"%s\"", name,
+                          args[2].c_str());
+      }
+      sparse_image = args[2] == "sparse";
+    }
 
     ZipArchiveHandle za = state->updater->GetPackageHandle();
     ZipEntry64 entry;
@@ -200,14 +385,16 @@ Value* PackageExtractFileFn(const char* name, State* state,
       return StringValue("");
     }
 
+    // Read the entry ahead in large chunks rather than faulting it in page by page, and let its
+    // pages go first once it has been written out.
+    state->updater->AdvisePackageRange(entry.offset, entry.compressed_length, MADV_WILLNEED);
     bool success = true;
-    int32_t ret = ExtractEntryToFile(za, &entry, fd);
-    if (ret != 0) {
+    if (!ExtractEntryToFd(state->updater, entry, fd, sparse_image)) {
       LOG(ERROR) << name << ": Failed to extract entry \"" << zip_path << "\" ("
-                 << entry.uncompressed_length << " bytes) to \"" << dest_path
-                 << "\": " << ErrorCodeString(ret);
+                 << entry.uncompressed_length << " bytes) to \"" << dest_path << "\"";
       success = false;
     }
+    state->updater->AdvisePackageRange(entry.offset, entry.compressed_length, MADV_DONTNEED);
     if (fsync(fd) == -1) {
       PLOG(ERROR) << "fsync of \"" << dest_path << "\" failed";
       success = false;
@@ -244,8 +431,10 @@ Value* PackageExtractFileFn(const char* name, State* state,
     }
     buffer.resize(entry.uncompressed_length);
 
+    state->updater->AdvisePackageRange(entry.offset, entry.compressed_length, MADV_WILLNEED);
     int32_t ret =
         ExtractToMemory(za, &entry, reinterpret_cast<uint8_t*>(&buffer[0]), buffer.size());
+    state->updater->AdvisePackageRange(entry.offset, entry.compressed_length, MADV_DONTNEED);
     if (ret != 0) {
       return ErrorAbort(state, kPackageExtractFileFailure,
                         "%s: Failed to extract entry \"%s\" (%zu bytes) to memory: %s", name,
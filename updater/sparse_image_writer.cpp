@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/sparse_image_writer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+// The on-disk format, as defined in system/core/libsparse/sparse_format.h. All the fields are
+// little endian.
+static constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+static constexpr uint16_t kMajorVersion = 1;
+
+static constexpr uint16_t kChunkTypeRaw = 0xCAC1;
+static constexpr uint16_t kChunkTypeFill = 0xCAC2;
+static constexpr uint16_t kChunkTypeDontCare = 0xCAC3;
+static constexpr uint16_t kChunkTypeCrc32 = 0xCAC4;
+
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct ChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  uint32_t chunk_sz;  // In blocks of the output.
+  uint32_t total_sz;  // In bytes of the input, including this header.
+};
+
+// The largest buffer of a fill value. A FILL chunk may cover the whole image.
+static constexpr size_t kFillBufferSize = 1024 * 1024;
+
+SparseImageWriter::SparseImageWriter(SparseWriter* writer)
+    : writer_(writer), buffer_size_(sizeof(SparseHeader)) {}
+
+bool SparseImageWriter::ProcessFileHeader() {
+  SparseHeader header;
+  memcpy(&header, buffer_.data(), sizeof(header));
+  if (header.magic != kSparseHeaderMagic) {
+    LOG(ERROR) << "Not a sparse image: bad magic " << std::hex << header.magic;
+    return false;
+  }
+  if (header.major_version != kMajorVersion) {
+    LOG(ERROR) << "Unsupported sparse image version " << header.major_version;
+    return false;
+  }
+  if (header.file_hdr_sz < sizeof(SparseHeader) || header.chunk_hdr_sz < sizeof(ChunkHeader)) {
+    LOG(ERROR) << "Invalid sparse image header sizes " << header.file_hdr_sz << " and "
+               << header.chunk_hdr_sz;
+    return false;
+  }
+  if (header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+    LOG(ERROR) << "Invalid sparse image block size " << header.blk_sz;
+    return false;
+  }
+
+  block_size_ = header.blk_sz;
+  total_blocks_ = header.total_blks;
+  total_chunks_ = header.total_chunks;
+  chunk_header_size_ = header.chunk_hdr_sz;
+
+  remaining_ = header.file_hdr_sz - sizeof(SparseHeader);
+  state_ = State::kSkip;
+  if (remaining_ == 0) {
+    NextChunk();
+  }
+  return true;
+}
+
+bool SparseImageWriter::ProcessChunkHeader() {
+  ChunkHeader header;
+  memcpy(&header, buffer_.data(), sizeof(header));
+  if (header.chunk_sz > total_blocks_ - blocks_) {
+    LOG(ERROR) << "Chunk " << chunks_ << " of " << header.chunk_sz << " blocks goes past the "
+               << total_blocks_ << " blocks of the image";
+    return false;
+  }
+  if (header.total_sz < chunk_header_size_) {
+    LOG(ERROR) << "Invalid size " << header.total_sz << " of chunk " << chunks_;
+    return false;
+  }
+  chunk_blocks_ = header.chunk_sz;
+  uint64_t size = static_cast<uint64_t>(header.chunk_sz) * block_size_;
+  uint64_t data_size = header.total_sz - chunk_header_size_;
+
+  switch (header.chunk_type) {
+    case kChunkTypeRaw:
+      if (data_size != size) break;
+      remaining_ = size;
+      state_ = State::kRawData;
+      if (remaining_ == 0) {
+        EndChunk();
+      }
+      return true;
+
+    case kChunkTypeFill:
+      if (data_size != sizeof(uint32_t)) break;
+      buffer_size_ = sizeof(uint32_t);
+      state_ = State::kFillValue;
+      return true;
+
+    case kChunkTypeDontCare:
+      if (data_size != 0) break;
+      if (!writer_->Discard(size)) {
+        return false;
+      }
+      EndChunk();
+      return true;
+
+    case kChunkTypeCrc32:
+      if (data_size != sizeof(uint32_t) || header.chunk_sz != 0) break;
+      buffer_size_ = sizeof(uint32_t);
+      state_ = State::kCrc32;
+      return true;
+
+    default:
+      LOG(ERROR) << "Unknown chunk type " << std::hex << header.chunk_type << std::dec
+                 << " of chunk " << chunks_;
+      return false;
+  }
+
+  LOG(ERROR) << "Invalid size " << header.total_sz << " of chunk " << chunks_ << " (type "
+             << std::hex << header.chunk_type << std::dec << ", " << header.chunk_sz
+             << " blocks)";
+  return false;
+}
+
+bool SparseImageWriter::Fill(uint32_t value, uint64_t size) {
+  if (value == 0) {
+    return writer_->WriteZeroes(size);
+  }
+
+  // The block size is a multiple of 4 bytes, so the fill value repeats evenly.
+  size_t buffer_length = std::min<uint64_t>(size, kFillBufferSize) / sizeof(uint32_t);
+  if (fill_buffer_.empty() || fill_buffer_[0] != value) {
+    fill_buffer_.clear();
+  }
+  fill_buffer_.resize(std::max(buffer_length, fill_buffer_.size()), value);
+
+  auto data = reinterpret_cast<const uint8_t*>(fill_buffer_.data());
+  while (size > 0) {
+    size_t to_write = std::min<uint64_t>(size, fill_buffer_.size() * sizeof(uint32_t));
+    if (!writer_->Write(data, to_write)) {
+      return false;
+    }
+    size -= to_write;
+  }
+  return true;
+}
+
+void SparseImageWriter::NextChunk() {
+  buffer_size_ = chunk_header_size_;
+  state_ = (chunks_ == total_chunks_) ? State::kDone : State::kChunkHeader;
+}
+
+void SparseImageWriter::EndChunk() {
+  chunks_++;
+  blocks_ += chunk_blocks_;
+  chunk_blocks_ = 0;
+  NextChunk();
+}
+
+bool SparseImageWriter::ProcessBuffer() {
+  switch (state_) {
+    case State::kFileHeader:
+      return ProcessFileHeader();
+
+    case State::kChunkHeader:
+      return ProcessChunkHeader();
+
+    case State::kFillValue: {
+      uint32_t value;
+      memcpy(&value, buffer_.data(), sizeof(value));
+      if (!Fill(value, static_cast<uint64_t>(chunk_blocks_) * block_size_)) {
+        return false;
+      }
+      EndChunk();
+      return true;
+    }
+
+    case State::kCrc32:
+      EndChunk();
+      return true;
+
+    default:
+      LOG(FATAL) << "Unexpected state " << static_cast<int>(state_);
+      return false;
+  }
+}
+
+bool SparseImageWriter::Write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    if (state_ == State::kDone) {
+      LOG(ERROR) << "Unexpected " << size << " bytes after the last chunk of the sparse image";
+      return false;
+    }
+
+    if (state_ == State::kSkip || state_ == State::kRawData) {
+      size_t length = std::min<uint64_t>(size, remaining_);
+      if (state_ == State::kRawData && !writer_->Write(data, length)) {
+        return false;
+      }
+      data += length;
+      size -= length;
+      remaining_ -= length;
+      if (remaining_ == 0) {
+        if (state_ == State::kSkip) {
+          NextChunk();
+        } else {
+          EndChunk();
+        }
+      }
+      continue;
+    }
+
+    size_t length = std::min(size, buffer_size_ - buffer_.size());
+    buffer_.insert(buffer_.end(), data, data + length);
+    data += length;
+    size -= length;
+    if (buffer_.size() == buffer_size_) {
+      bool success = ProcessBuffer();
+      buffer_.clear();
+      if (!success) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool SparseImageWriter::Finish() {
+  if (state_ != State::kDone) {
+    LOG(ERROR) << "The sparse image ends after " << chunks_ << " of " << total_chunks_
+               << " chunks";
+    return false;
+  }
+  // The blocks not covered by any chunk are left unspecified, as with libsparse.
+  return writer_->Discard(static_cast<uint64_t>(total_blocks_ - blocks_) * block_size_);
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/sparse_writer.h"
+
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+// The granularity of the zero detection. The blocks are aligned to it in the output, so that the
+// zero ones can be zeroed out on any block device.
+static constexpr size_t kZeroBlockSize = 4096;
+
+static const uint8_t kZeroBlock[kZeroBlockSize] = {};
+
+// Returns whether the |size| bytes at |data| are all zeroes. Comparing the data against itself one
+// byte ahead lets memcmp() go through it a vector at a time, and stop at the first non-zero byte.
+static bool IsZero(const uint8_t* data, size_t size) {
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+SparseWriter::SparseWriter(int fd) : fd_(fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) == 0) {
+    is_block_device_ = S_ISBLK(sb.st_mode);
+    is_regular_file_ = S_ISREG(sb.st_mode);
+  }
+}
+
+bool SparseWriter::FlushZeroes() {
+  if (zero_length_ == 0) {
+    return true;
+  }
+  if (is_block_device_) {
+    uint64_t range[2] = { zero_start_, zero_length_ };
+    if (ioctl(fd_, BLKZEROOUT, &range) == -1) {
+      PLOG(ERROR) << "Failed to zero out " << zero_length_ << " bytes at " << zero_start_;
+      return false;
+    }
+  }
+  zero_length_ = 0;
+  return true;
+}
+
+bool SparseWriter::WriteData(const uint8_t* data, size_t size) {
+  if (!FlushZeroes()) {
+    return false;
+  }
+  if (position_ != offset_ && lseek64(fd_, offset_, SEEK_SET) == -1) {
+    PLOG(ERROR) << "Failed to seek to " << offset_;
+    return false;
+  }
+  if (!android::base::WriteFully(fd_, data, size)) {
+    PLOG(ERROR) << "Failed to write " << size << " bytes at " << offset_;
+    return false;
+  }
+  offset_ += size;
+  position_ = offset_;
+  return true;
+}
+
+bool SparseWriter::WriteBlocks(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    // Write the run of data blocks up to the next zero block, if any.
+    size_t data_length = 0;
+    while (data_length < size && !IsZero(data + data_length, kZeroBlockSize)) {
+      data_length += kZeroBlockSize;
+    }
+    if (data_length > 0) {
+      if (!WriteData(data, data_length)) {
+        return false;
+      }
+      data += data_length;
+      size -= data_length;
+      continue;
+    }
+
+    // Add the zero block to the pending ones.
+    if (zero_length_ == 0) {
+      zero_start_ = offset_;
+    }
+    zero_length_ += kZeroBlockSize;
+    skipped_ += kZeroBlockSize;
+    offset_ += kZeroBlockSize;
+    data += kZeroBlockSize;
+    size -= kZeroBlockSize;
+  }
+  return true;
+}
+
+bool SparseWriter::Write(const uint8_t* data, size_t size) {
+  // Anything else, e.g. a pipe, just gets the data as is.
+  if (!is_block_device_ && !is_regular_file_) {
+    return WriteData(data, size);
+  }
+
+  // Complete the partial block left over from the previous call first.
+  if (!partial_block_.empty()) {
+    size_t to_copy = std::min(size, kZeroBlockSize - partial_block_.size());
+    partial_block_.insert(partial_block_.end(), data, data + to_copy);
+    data += to_copy;
+    size -= to_copy;
+    if (partial_block_.size() < kZeroBlockSize) {
+      return true;
+    }
+    if (!WriteBlocks(partial_block_.data(), kZeroBlockSize)) {
+      return false;
+    }
+    partial_block_.clear();
+  }
+
+  size_t blocks_size = size - size % kZeroBlockSize;
+  if (!WriteBlocks(data, blocks_size)) {
+    return false;
+  }
+  partial_block_.assign(data + blocks_size, data + size);
+  return true;
+}
+
+bool SparseWriter::CompletePartialBlock(uint64_t* size) {
+  if (partial_block_.empty()) {
+    return true;
+  }
+  size_t to_write = std::min<uint64_t>(*size, kZeroBlockSize - partial_block_.size());
+  *size -= to_write;
+  return Write(kZeroBlock, to_write);
+}
+
+bool SparseWriter::WriteZeroes(uint64_t size) {
+  if (is_block_device_ || is_regular_file_) {
+    if (!CompletePartialBlock(&size)) {
+      return false;
+    }
+    uint64_t blocks_size = size - size % kZeroBlockSize;
+    if (blocks_size > 0) {
+      if (zero_length_ == 0) {
+        zero_start_ = offset_;
+      }
+      zero_length_ += blocks_size;
+      skipped_ += blocks_size;
+      offset_ += blocks_size;
+      size -= blocks_size;
+    }
+  }
+  while (size > 0) {
+    size_t to_write = std::min<uint64_t>(size, kZeroBlockSize);
+    if (!Write(kZeroBlock, to_write)) {
+      return false;
+    }
+    size -= to_write;
+  }
+  return true;
+}
+
+bool SparseWriter::Discard(uint64_t size) {
+  if (!is_block_device_) {
+    return WriteZeroes(size);
+  }
+
+  if (!CompletePartialBlock(&size)) {
+    return false;
+  }
+  uint64_t blocks_size = size - size % kZeroBlockSize;
+  if (blocks_size > 0) {
+    if (!FlushZeroes()) {
+      return false;
+    }
+    uint64_t range[2] = { offset_, blocks_size };
+    if (ioctl(fd_, BLKDISCARD, &range) == -1) {
+      PLOG(WARNING) << "Failed to discard " << blocks_size << " bytes at " << offset_
+                    << "; leaving them as they are";
+    }
+    discarded_ += blocks_size;
+    offset_ += blocks_size;
+  }
+  return WriteZeroes(size - blocks_size);
+}
+
+bool SparseWriter::Finish() {
+  // The partial block at the end is written as is.
+  if (!partial_block_.empty()) {
+    if (!WriteData(partial_block_.data(), partial_block_.size())) {
+      return false;
+    }
+    partial_block_.clear();
+  }
+  if (!FlushZeroes()) {
+    return false;
+  }
+  // A regular file ending with zeroes needs to be extended over them.
+  if (is_regular_file_ && ftruncate64(fd_, offset_) == -1) {
+    PLOG(ERROR) << "Failed to set the file size to " << offset_;
+    return false;
+  }
+  return true;
+}
@@ -16,41 +16,22 @@
 
 #include "updater/target_files.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <filesystem>
-#include <memory>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/strings.h>
-#include <sparse/sparse.h>
+#include <android-base/unique_fd.h>
 
-static bool SimgToImg(int input_fd, int output_fd) {
-  if (lseek64(input_fd, 0, SEEK_SET) == -1) {
-    PLOG(ERROR) << "Failed to lseek64 on the input sparse image";
-    return false;
-  }
-
-  if (lseek64(output_fd, 0, SEEK_SET) == -1) {
-    PLOG(ERROR) << "Failed to lseek64 on the output raw image";
-    return false;
-  }
-
-  std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> s_file(
-      sparse_file_import(input_fd, true, false), sparse_file_destroy);
-  if (!s_file) {
-    LOG(ERROR) << "Failed to import the sparse image.";
-    return false;
-  }
-
-  if (sparse_file_write(s_file.get(), output_fd, false, false, false) < 0) {
-    PLOG(ERROR) << "Failed to output the raw image file.";
-    return false;
-  }
+#include "updater/sparse_image_writer.h"
+#include "updater/sparse_writer.h"
 
-  return true;
-}
+// The size of each read of an entry from the extracted input directory.
+static constexpr size_t kReadSize = 1024 * 1024;
 
 static bool ParsePropertyFile(const std::string_view prop_content,
                               std::map<std::string, std::string, std::less<>>* props_map) {
@@ -155,12 +136,28 @@ bool TargetFile::ReadEntryToString(const std::string_view name, std::string* con
   return true;
 }
 
-bool TargetFile::ExtractEntryToTempFile(const std::string_view name,
-                                        TemporaryFile* temp_file) const {
+bool TargetFile::ProcessEntryContents(const std::string_view name, const WriteFn& write) const {
   if (extracted_input_) {
     std::string entry_path = path_ + "/" + std::string(name);
-    return std::filesystem::copy_file(entry_path, temp_file->path,
-                                      std::filesystem::copy_options::overwrite_existing);
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(entry_path.c_str(), O_RDONLY)));
+    if (fd == -1) {
+      PLOG(ERROR) << "Failed to open " << entry_path;
+      return false;
+    }
+    std::vector<uint8_t> buffer(kReadSize);
+    while (true) {
+      ssize_t size = TEMP_FAILURE_RETRY(read(fd, buffer.data(), buffer.size()));
+      if (size == -1) {
+        PLOG(ERROR) << "Failed to read " << entry_path;
+        return false;
+      }
+      if (size == 0) {
+        return true;
+      }
+      if (!write(buffer.data(), size)) {
+        return false;
+      }
+    }
   }
 
   CHECK(handle_);
@@ -170,13 +167,42 @@ bool TargetFile::ExtractEntryToTempFile(const std::string_view name,
     return false;
   }
 
-  if (auto status = ExtractEntryToFile(handle_, &entry, temp_file->fd); status != 0) {
+  auto callback = [](const uint8_t* data, size_t size, void* cookie) {
+    return (*static_cast<const WriteFn*>(cookie))(data, size);
+  };
+  if (auto status =
+          ProcessZipEntryContents(handle_, &entry, callback, const_cast<WriteFn*>(&write));
+      status != 0) {
     LOG(ERROR) << "Failed to extract zip entry " << name << " : " << ErrorCodeString(status);
     return false;
   }
   return true;
 }
 
+bool TargetFile::ExtractEntryToTempFile(const std::string_view name,
+                                        TemporaryFile* temp_file) const {
+  if (extracted_input_) {
+    std::string entry_path = path_ + "/" + std::string(name);
+    return std::filesystem::copy_file(entry_path, temp_file->path,
+                                      std::filesystem::copy_options::overwrite_existing);
+  }
+
+  // The images are mostly zeroes; leave them as holes in the file.
+  SparseWriter writer(temp_file->fd);
+  auto write = [&writer](const uint8_t* data, size_t size) { return writer.Write(data, size); };
+  return ProcessEntryContents(name, write) && writer.Finish();
+}
+
+bool TargetFile::ExtractSparseImageToTempFile(const std::string_view name,
+                                              TemporaryFile* temp_file) const {
+  SparseWriter writer(temp_file->fd);
+  SparseImageWriter image_writer(&writer);
+  auto write = [&image_writer](const uint8_t* data, size_t size) {
+    return image_writer.Write(data, size);
+  };
+  return ProcessEntryContents(name, write) && image_writer.Finish() && writer.Finish();
+}
+
 bool TargetFile::Open() {
   if (!extracted_input_) {
     if (auto ret = OpenArchive(path_.c_str(), &handle_); ret != 0) {
@@ -237,7 +263,7 @@ bool TargetFile::GetBuildProps(std::map<std::string, std::string, std::less<>>*
 }
 
 bool TargetFile::ExtractImage(const std::string_view entry_name, const FstabInfo& fstab_info,
-                              const std::string_view work_dir, TemporaryFile* image_file) const {
+                              TemporaryFile* image_file) const {
   if (!EntryExists(entry_name)) {
     return false;
   }
@@ -247,14 +273,8 @@ bool TargetFile::ExtractImage(const std::string_view entry_name, const FstabInfo
     if (!ExtractEntryToTempFile(entry_name, image_file)) {
       return false;
     }
-  } else {  // treated as ext4 sparse image
-    TemporaryFile sparse_image{ std::string(work_dir) };
-    if (!ExtractEntryToTempFile(entry_name, &sparse_image)) {
-      return false;
-    }
-
-    // Convert the sparse image to raw.
-    if (!SimgToImg(sparse_image.fd, image_file->fd)) {
+  } else {  // treated as ext4 sparse image, converted to raw as it's extracted
+    if (!ExtractSparseImageToTempFile(entry_name, image_file)) {
       LOG(ERROR) << "Failed to convert " << fstab_info.mount_point << " to raw.";
       return false;
     }